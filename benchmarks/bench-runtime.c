@@ -0,0 +1,493 @@
+#define _GNU_SOURCE /* <- needed for dladdr */
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include <scorep/SCOREP_SubstratePlugins.h>
+
+#include "bench-runtime.h"
+
+/** Maximum number of instrumented functions */
+#define BENCH_MAX_REGIONS 65536
+
+/** Slots of the function hash, a power of two bigger than BENCH_MAX_REGIONS */
+#define BENCH_REGION_SLOTS ( 2 * BENCH_MAX_REGIONS )
+
+/** Maximum number of threads in the pool */
+#define BENCH_MAX_POOL 256
+
+typedef void ( *enter_callback )( struct SCOREP_Location*, uint64_t, SCOREP_RegionHandle, uint64_t* );
+typedef void ( *team_callback )( struct SCOREP_Location*, uint64_t, SCOREP_ParadigmType,
+                                 SCOREP_InterimCommunicatorHandle );
+typedef void ( *join_callback )( struct SCOREP_Location*, uint64_t, SCOREP_ParadigmType );
+
+/**
+ * A Score-P location, opaque for the plugin.
+ */
+struct SCOREP_Location
+{
+    uint32_t id;
+};
+
+/**
+ * Slot of the function hash.
+ */
+typedef struct region_slot
+{
+    void* function;
+    SCOREP_RegionHandle handle;
+} region_slot;
+
+/** Entry point of the plugin */
+static SCOREP_SubstratePluginInfo plugin;
+
+/** Event callbacks of the plugin */
+static SCOREP_Substrates_Callback* events = NULL;
+
+/** Marks whether the plugin has been loaded */
+static bool started = false;
+
+/** Function hash, written under region_mtx and read without locking */
+static region_slot region_slots[BENCH_REGION_SLOTS];
+
+/** Region names, indexed by handle - 1 */
+static char* region_names[BENCH_MAX_REGIONS];
+
+/** Number of defined regions */
+static uint32_t region_cnt = 0;
+
+/** Guards the definition of regions and locations */
+static pthread_mutex_t region_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/** All locations */
+static struct SCOREP_Location locations[BENCH_MAX_POOL + 1];
+
+/** Number of created locations */
+static uint32_t location_cnt = 0;
+
+/** Location of the calling thread */
+static __thread struct SCOREP_Location* location = NULL;
+
+/** Instrumentation calls of the calling thread */
+static __thread uint64_t thread_events = 0;
+
+/** Name and start of the current phase */
+static const char* phase_name = NULL;
+static uint64_t phase_start = 0;
+static uint64_t phase_events = 0;
+
+/** The thread pool, see bench_parallel */
+static pthread_t pool[BENCH_MAX_POOL];
+static int pool_size = 0;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static uint64_t pool_generation = 0;
+static int pool_running = 0;
+static int team_size = 0;
+static void ( *team_function )( int ) = NULL;
+
+/** Experiment directory, from BENCH_EXPERIMENT_DIR */
+static const char* experiment_dir = "bench-exp";
+
+static const char* get_experiment_dir_name( void )
+{
+    return experiment_dir;
+}
+
+static int ipc_get_size( void )
+{
+    return 1;
+}
+
+static int ipc_get_rank( void )
+{
+    return 0;
+}
+
+/**
+ * Returns the size of an element of the given type.
+ */
+static size_t ipc_type_size( SCOREP_Ipc_Datatype                                   type )
+{
+    return type == SCOREP_IPC_INT ? sizeof( int ) : type == SCOREP_IPC_UINT64_T ? sizeof( uint64_t ) : 1;
+}
+
+static int ipc_gather( const void*                                                  send,
+                       void*                                                        recv,
+                       int                                                          count,
+                       SCOREP_Ipc_Datatype                                          type,
+                       __attribute__((unused)) int                                  root )
+{
+    memcpy( recv, send, count * ipc_type_size( type ) );
+    return 0;
+}
+
+static int ipc_gatherv( const void*                                                 send,
+                        int                                                         count,
+                        void*                                                       recv,
+                        __attribute__((unused)) const int*                          recv_counts,
+                        SCOREP_Ipc_Datatype                                         type,
+                        __attribute__((unused)) int                                 root )
+{
+    memcpy( recv, send, count * ipc_type_size( type ) );
+    return 0;
+}
+
+static int ipc_bcast( __attribute__((unused)) void*                                 buffer,
+                      __attribute__((unused)) int                                   count,
+                      __attribute__((unused)) SCOREP_Ipc_Datatype                   type,
+                      __attribute__((unused)) int                                   root )
+{
+    return 0;
+}
+
+static uint32_t location_get_id( const struct SCOREP_Location*                     loc )
+{
+    return loc->id;
+}
+
+static SCOREP_ParadigmType region_get_paradigm_type( __attribute__((unused)) SCOREP_RegionHandle handle )
+{
+    return SCOREP_PARADIGM_COMPILER;
+}
+
+static const char* region_get_canonical_name( SCOREP_RegionHandle                  handle )
+{
+    return region_names[handle - 1];
+}
+
+static SCOREP_SubstratePluginCallbacks scorep_callbacks =
+{
+    .SCOREP_GetExperimentDirName            = get_experiment_dir_name,
+    .SCOREP_Ipc_GetSize                     = ipc_get_size,
+    .SCOREP_Ipc_GetRank                     = ipc_get_rank,
+    .SCOREP_Ipc_Gather                      = ipc_gather,
+    .SCOREP_Ipc_Gatherv                     = ipc_gatherv,
+    .SCOREP_Ipc_Bcast                       = ipc_bcast,
+    .SCOREP_Location_GetId                  = location_get_id,
+    .SCOREP_RegionHandle_GetCanonicalName   = region_get_canonical_name,
+    .SCOREP_RegionHandle_GetParadigmType    = region_get_paradigm_type
+};
+
+/**
+ * Creates the location of the calling thread.
+ */
+static void create_location( void )
+{
+    pthread_mutex_lock( &region_mtx );
+    location = &locations[location_cnt];
+    location->id = location_cnt++;
+    pthread_mutex_unlock( &region_mtx );
+    if( plugin.create_location != NULL )
+    {
+        plugin.create_location( location, location->id == 0 ? NULL : &locations[0] );
+    }
+}
+
+/**
+ * Loads the plugin and initializes it like Score-P does.
+ */
+__attribute__((constructor)) static void bench_start( void )
+{
+    const char* path = getenv( "BENCH_PLUGIN" );
+    // Score-P doesn't open the plugins with RTLD_GLOBAL either.
+    void* library = dlopen( path != NULL ? path : "libscorep_substrate_dynamic_filtering.so",
+                            RTLD_NOW );
+    SCOREP_SubstratePluginInfo ( *get_info )( void ) = NULL;
+    if( library != NULL )
+    {
+        *(void**) &get_info = dlsym( library, "SCOREP_SubstratePlugin_dynamic_filtering_get_info" );
+    }
+    if( get_info == NULL )
+    {
+        fprintf( stderr, "Could not load the plugin (set BENCH_PLUGIN): %s\n", dlerror( ) );
+        exit( EXIT_FAILURE );
+    }
+
+    if( getenv( "BENCH_EXPERIMENT_DIR" ) != NULL )
+    {
+        experiment_dir = getenv( "BENCH_EXPERIMENT_DIR" );
+    }
+    mkdir( experiment_dir, S_IRWXU );
+
+    plugin = get_info( );
+    plugin.set_callbacks( &scorep_callbacks, sizeof( scorep_callbacks ) );
+    plugin.init( );
+    plugin.assign_id( 0 );
+    plugin.get_event_functions( SCOREP_SUBSTRATES_RECORDING_ENABLED, &events );
+    create_location( );
+    started = true;
+}
+
+/**
+ * Finalizes the plugin like Score-P does.
+ */
+__attribute__((destructor)) static void bench_stop( void )
+{
+    if( !started )
+    {
+        return;
+    }
+    started = false;
+    if( plugin.pre_unify != NULL )
+    {
+        plugin.pre_unify( );
+    }
+    plugin.write_data( );
+    plugin.finalize( );
+}
+
+/**
+ * Returns the region handle of an instrumented function, defines the region on its first call.
+ */
+static inline SCOREP_RegionHandle get_region( void*                                 function )
+{
+    size_t slot = ( (uintptr_t) function >> 4 ) & ( BENCH_REGION_SLOTS - 1 );
+    for( ;; slot = ( slot + 1 ) & ( BENCH_REGION_SLOTS - 1 ) )
+    {
+        void* current = __atomic_load_n( &region_slots[slot].function, __ATOMIC_ACQUIRE );
+        if( current == function )
+        {
+            return region_slots[slot].handle;
+        }
+        if( current == NULL )
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock( &region_mtx );
+    for( ;; slot = ( slot + 1 ) & ( BENCH_REGION_SLOTS - 1 ) )
+    {
+        if( region_slots[slot].function == function )
+        {
+            pthread_mutex_unlock( &region_mtx );
+            return region_slots[slot].handle;
+        }
+        if( region_slots[slot].function == NULL )
+        {
+            break;
+        }
+    }
+    if( region_cnt == BENCH_MAX_REGIONS )
+    {
+        fprintf( stderr, "Too many instrumented functions.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    Dl_info info;
+    char name[64];
+    if( dladdr( function, &info ) != 0 && info.dli_sname != NULL )
+    {
+        region_names[region_cnt] = strdup( info.dli_sname );
+    }
+    else
+    {
+        snprintf( name, sizeof( name ), "fn_%p", function );
+        region_names[region_cnt] = strdup( name );
+    }
+    SCOREP_RegionHandle handle = ++region_cnt;
+    plugin.new_definition_handle( handle, SCOREP_HANDLE_TYPE_REGION );
+    region_slots[slot].handle = handle;
+    __atomic_store_n( &region_slots[slot].function, function, __ATOMIC_RELEASE );
+    pthread_mutex_unlock( &region_mtx );
+    return handle;
+}
+
+__attribute__((noinline)) void __cyg_profile_func_enter( void*                      function,
+                                                         __attribute__((unused)) void* call_site )
+{
+    if( !started )
+    {
+        return;
+    }
+    thread_events++;
+    if( events[SCOREP_EVENT_ENTER_REGION] != NULL )
+    {
+        ( (enter_callback) events[SCOREP_EVENT_ENTER_REGION] )( location, __rdtsc( ),
+                                                                get_region( function ), NULL );
+    }
+}
+
+__attribute__((noinline)) void __cyg_profile_func_exit( void*                       function,
+                                                        __attribute__((unused)) void* call_site )
+{
+    if( !started )
+    {
+        return;
+    }
+    thread_events++;
+    if( events[SCOREP_EVENT_EXIT_REGION] != NULL )
+    {
+        ( (enter_callback) events[SCOREP_EVENT_EXIT_REGION] )( location, __rdtsc( ),
+                                                               get_region( function ), NULL );
+    }
+}
+
+uint64_t bench_now( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint64_t bench_events( void )
+{
+    return thread_events;
+}
+
+uint64_t bench_heap_bytes( void )
+{
+#if defined( __GLIBC__ ) && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 33 ) )
+    struct mallinfo2 info = mallinfo2( );
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+void bench_phase_begin( const char*                                                 name )
+{
+    phase_name = name;
+    phase_events = thread_events;
+    phase_start = bench_now( );
+}
+
+void bench_phase_end( uint64_t                                                      calls )
+{
+    uint64_t duration = bench_now( ) - phase_start;
+    uint64_t cnt = thread_events - phase_events;
+    printf( "%-28s %12lu calls %12lu events %10.2f ns/call %10.2f ns/event\n",
+            phase_name, calls, cnt, (double) duration / ( calls > 0 ? calls : 1 ),
+            cnt > 0 ? (double) duration / cnt : 0.0 );
+    fflush( stdout );
+}
+
+void bench_time_to_filter( const char*                                              name,
+                           void                                                     ( *fn )( void ),
+                           uint64_t                                                 max_calls )
+{
+    uint64_t start = bench_now( );
+    for( uint64_t i = 0; i < max_calls; ++i )
+    {
+        uint64_t before = thread_events;
+        fn( );
+        if( thread_events == before )
+        {
+            printf( "%-28s filtered after %lu calls, %.3f ms\n", name, i,
+                    ( bench_now( ) - start ) / 1e6 );
+            fflush( stdout );
+            return;
+        }
+    }
+    printf( "%-28s not filtered within %lu calls\n", name, max_calls );
+    fflush( stdout );
+}
+
+/**
+ * Thread of the pool, runs the teams it's part of.
+ */
+static void* pool_thread( void*                                                     arg )
+{
+    int tid = (int) (intptr_t) arg;
+    uint64_t generation = 0;
+
+    create_location( );
+    pthread_mutex_lock( &pool_mtx );
+    for( ;; )
+    {
+        while( pool_generation == generation || tid >= team_size )
+        {
+            generation = pool_generation;
+            pthread_cond_wait( &pool_start, &pool_mtx );
+        }
+        generation = pool_generation;
+        pthread_mutex_unlock( &pool_mtx );
+
+        if( events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_BEGIN] != NULL )
+        {
+            ( (team_callback) events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_BEGIN] )(
+                location, __rdtsc( ), SCOREP_PARADIGM_OPENMP, 0 );
+        }
+        team_function( tid );
+        if( events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_END] != NULL )
+        {
+            ( (team_callback) events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_END] )(
+                location, __rdtsc( ), SCOREP_PARADIGM_OPENMP, 0 );
+        }
+
+        pthread_mutex_lock( &pool_mtx );
+        if( --pool_running == 0 )
+        {
+            pthread_cond_signal( &pool_done );
+        }
+    }
+    return NULL;
+}
+
+bench_team_stats bench_parallel( int                                                thread_cnt,
+                                 void                                               ( *fn )( int ) )
+{
+    bench_team_stats stats = { 0, 0 };
+    if( thread_cnt > BENCH_MAX_POOL )
+    {
+        thread_cnt = BENCH_MAX_POOL;
+    }
+    while( pool_size < thread_cnt - 1 )
+    {
+        pool_size++;
+        pthread_create( &pool[pool_size - 1], NULL, pool_thread, (void*) (intptr_t) pool_size );
+    }
+
+    if( events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_BEGIN] != NULL )
+    {
+        ( (team_callback) events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_BEGIN] )(
+            location, __rdtsc( ), SCOREP_PARADIGM_OPENMP, 0 );
+    }
+    pthread_mutex_lock( &pool_mtx );
+    team_function = fn;
+    team_size = thread_cnt;
+    pool_running = thread_cnt - 1;
+    pool_generation++;
+    pthread_cond_broadcast( &pool_start );
+    pthread_mutex_unlock( &pool_mtx );
+
+    fn( 0 );
+    if( events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_END] != NULL )
+    {
+        ( (team_callback) events[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_END] )(
+            location, __rdtsc( ), SCOREP_PARADIGM_OPENMP, 0 );
+    }
+
+    pthread_mutex_lock( &pool_mtx );
+    while( pool_running > 0 )
+    {
+        pthread_cond_wait( &pool_done, &pool_mtx );
+    }
+    pthread_mutex_unlock( &pool_mtx );
+    stats.heap_bytes = bench_heap_bytes( );
+
+    uint64_t start = bench_now( );
+    if( events[SCOREP_EVENT_THREAD_FORK_JOIN_JOIN] != NULL )
+    {
+        ( (join_callback) events[SCOREP_EVENT_THREAD_FORK_JOIN_JOIN] )(
+            location, __rdtsc( ), SCOREP_PARADIGM_OPENMP );
+    }
+    stats.join_ns = bench_now( ) - start;
+    return stats;
+}
+
+int bench_max_threads( void )
+{
+    const char* env = getenv( "BENCH_THREADS" );
+    int threads = env != NULL ? atoi( env ) : 16;
+    return threads < 1 ? 1 : threads > BENCH_MAX_POOL ? BENCH_MAX_POOL : threads;
+}
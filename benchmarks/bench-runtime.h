@@ -0,0 +1,87 @@
+#ifndef BENCH_RUNTIME_H
+#define BENCH_RUNTIME_H
+
+#include <stdint.h>
+
+/**
+ * Minimal Score-P emulation for the micro-benchmarks.
+ *
+ * The benchmarks are compiled with -finstrument-functions. This runtime implements the
+ * instrumentation calls, loads the plugin (path from BENCH_PLUGIN), defines a compiler region for
+ * every instrumented function and forwards the enter, exit and fork/join events to the plugin, just
+ * like Score-P does. Timestamps are taken from the time stamp counter, Score-P's default timer on
+ * x86. All functions of the runtime are excluded from the instrumentation.
+ */
+
+/** Result of a team, see bench_parallel */
+typedef struct bench_team_stats
+{
+    /** Time spent in the plugin's join callback in ns */
+    uint64_t join_ns;
+    /** Heap memory in use while all threads of the team were alive (0 if unknown) */
+    uint64_t heap_bytes;
+} bench_team_stats;
+
+/**
+ * Returns the monotonic time in ns.
+ */
+uint64_t bench_now( void );
+
+/**
+ * Returns the number of instrumentation calls seen on the calling thread.
+ */
+uint64_t bench_events( void );
+
+/**
+ * Returns the heap memory currently in use in bytes, 0 if unknown.
+ */
+uint64_t bench_heap_bytes( void );
+
+/**
+ * Starts a timed phase of a benchmark on the main thread.
+ *
+ * @param   name                            Name of the phase, printed by bench_phase_end.
+ */
+void bench_phase_begin( const char*                                                 name );
+
+/**
+ * Ends the current phase and prints its events, ns per call and ns per event.
+ *
+ * @param   calls                           Number of calls of instrumented functions in the phase.
+ */
+void bench_phase_end( uint64_t                                                      calls );
+
+/**
+ * Calls the given function until one call doesn't produce any events anymore, i.e. until the
+ * plugin deleted the instrumentation of all functions it calls, and prints the time this took.
+ *
+ * @param   name                            Name printed with the result.
+ * @param   fn                              Function calling instrumented functions, must not be
+ *                                          instrumented itself.
+ * @param   max_calls                       Calls after which the search is given up.
+ */
+void bench_time_to_filter( const char*                                              name,
+                           void                                                     ( *fn )( void ),
+                           uint64_t                                                 max_calls );
+
+/**
+ * Runs the given function on a team of threads, emulating an OpenMP parallel region.
+ *
+ * The threads are kept in a pool, so every thread keeps its Score-P location across teams. The
+ * main thread takes part as thread 0.
+ *
+ * @param   thread_cnt                      Size of the team.
+ * @param   fn                              Function executed by every thread of the team, gets the
+ *                                          number of the thread.
+ *
+ * @return                                  Costs of the team.
+ */
+bench_team_stats bench_parallel( int                                                thread_cnt,
+                                 void                                               ( *fn )( int ) );
+
+/**
+ * Returns the number of threads to use, from BENCH_THREADS (default 16).
+ */
+int bench_max_threads( void );
+
+#endif /* BENCH_RUNTIME_H */
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bench-runtime.h"
+
+/** Calls of every leaf per phase */
+#define ITERATIONS 4000
+
+/** Sink for the results, keeps the compiler from dropping the calls */
+volatile uint64_t sink;
+
+#define LEAF( n )                                                                              \
+    __attribute__((noinline)) uint64_t leaf_##n( uint64_t x )                                  \
+    {                                                                                          \
+        __asm__ volatile( "" );                                                                \
+        return x * ( n ) + 1;                                                                  \
+    }
+#define LEAVES_16( n )                                                                         \
+    LEAF( n##0 ) LEAF( n##1 ) LEAF( n##2 ) LEAF( n##3 ) LEAF( n##4 ) LEAF( n##5 ) LEAF( n##6 ) \
+    LEAF( n##7 ) LEAF( n##8 ) LEAF( n##9 ) LEAF( n##a ) LEAF( n##b ) LEAF( n##c ) LEAF( n##d ) \
+    LEAF( n##e ) LEAF( n##f )
+#define LEAVES_256                                                                             \
+    LEAVES_16( 0x0 ) LEAVES_16( 0x1 ) LEAVES_16( 0x2 ) LEAVES_16( 0x3 ) LEAVES_16( 0x4 )       \
+    LEAVES_16( 0x5 ) LEAVES_16( 0x6 ) LEAVES_16( 0x7 ) LEAVES_16( 0x8 ) LEAVES_16( 0x9 )       \
+    LEAVES_16( 0xa ) LEAVES_16( 0xb ) LEAVES_16( 0xc ) LEAVES_16( 0xd ) LEAVES_16( 0xe )       \
+    LEAVES_16( 0xf )
+
+LEAVES_256
+
+#undef LEAF
+#define LEAF( n ) leaf_##n,
+
+/** All leaves, called through a pointer so that every one keeps its own call site */
+static uint64_t ( * const leaves[] )( uint64_t ) = { LEAVES_256 };
+
+/** Number of leaves */
+#define LEAF_CNT ( sizeof( leaves ) / sizeof( leaves[0] ) )
+
+__attribute__((no_instrument_function)) static void run_once( void )
+{
+    uint64_t x = sink;
+    for( size_t i = 0; i < LEAF_CNT; ++i )
+    {
+        x = leaves[i]( x );
+    }
+    sink = x;
+}
+
+__attribute__((no_instrument_function)) static void run_phase( const char*          name )
+{
+    bench_phase_begin( name );
+    for( int i = 0; i < ITERATIONS; ++i )
+    {
+        run_once( );
+    }
+    bench_phase_end( (uint64_t) ITERATIONS * LEAF_CNT );
+}
+
+/**
+ * Many tiny leaf functions: 256 regions, each one of them has to be filtered on its own.
+ */
+__attribute__((no_instrument_function)) int main( void )
+{
+    bench_time_to_filter( "leaves", run_once, 10000 );
+    run_phase( "leaves" );
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bench-runtime.h"
+
+/** Calls per phase */
+#define ITERATIONS 200000
+
+/** Sink for the results, keeps the compiler from dropping the calls */
+volatile uint64_t sink;
+
+/**
+ * Function with several returns.
+ */
+__attribute__((noinline)) int classify( uint64_t                                    x )
+{
+    __asm__ volatile( "" );
+    if( x % 7 == 0 )
+    {
+        return 0;
+    }
+    if( x % 5 == 0 )
+    {
+        return 1;
+    }
+    if( x % 3 == 0 )
+    {
+        return 2;
+    }
+    return 3;
+}
+
+/**
+ * Inlined into every caller, so that its instrumentation ends up at several call sites. Several
+ * returns as well.
+ */
+static inline __attribute__((always_inline)) uint64_t scale( uint64_t                x )
+{
+    if( x & 1 )
+    {
+        return x * 3 + 1;
+    }
+    return x / 2;
+}
+
+__attribute__((noinline)) uint64_t step_a( uint64_t                                 x )
+{
+    return scale( x ) + classify( x );
+}
+
+__attribute__((noinline)) uint64_t step_b( uint64_t                                 x )
+{
+    if( x == 0 )
+    {
+        return 1;
+    }
+    return scale( scale( x ) ) ^ classify( x + 1 );
+}
+
+__attribute__((no_instrument_function)) static void run_once( void )
+{
+    uint64_t x = sink;
+    x = step_a( x + 1 );
+    x = step_b( x );
+    sink = x;
+}
+
+__attribute__((no_instrument_function)) static void run_phase( const char*          name )
+{
+    bench_phase_begin( name );
+    for( int i = 0; i < ITERATIONS; ++i )
+    {
+        run_once( );
+    }
+    // step_a: itself, scale and classify; step_b: itself, two scales and classify
+    bench_phase_end( (uint64_t) ITERATIONS * 7 );
+}
+
+/**
+ * Functions with several exits and inlined functions with several call sites per region.
+ */
+__attribute__((no_instrument_function)) int main( void )
+{
+    bench_time_to_filter( "multi-exit", run_once, 10000 );
+    run_phase( "multi-exit" );
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bench-runtime.h"
+
+/** Depth of every recursion */
+#define DEPTH 64
+
+/** Recursions per phase */
+#define ITERATIONS 20000
+
+/** Sink for the results, keeps the compiler from dropping the calls */
+volatile uint64_t sink;
+
+__attribute__((noinline)) uint64_t recurse( int                                     depth )
+{
+    __asm__ volatile( "" );
+    if( depth == 0 )
+    {
+        return 1;
+    }
+    return recurse( depth - 1 ) + 1;
+}
+
+__attribute__((no_instrument_function)) static void run_once( void )
+{
+    sink += recurse( DEPTH );
+}
+
+__attribute__((no_instrument_function)) static void run_phase( const char*          name )
+{
+    bench_phase_begin( name );
+    for( int i = 0; i < ITERATIONS; ++i )
+    {
+        run_once( );
+    }
+    bench_phase_end( (uint64_t) ITERATIONS * ( DEPTH + 1 ) );
+}
+
+/**
+ * Deep recursion of one tiny function: every call is nested in DEPTH calls of the same region.
+ */
+__attribute__((no_instrument_function)) int main( void )
+{
+    bench_time_to_filter( "recursion", run_once, 10000 );
+    run_phase( "recursion" );
+    return 0;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench-runtime.h"
+#include "dynamic-filtering.h"
+
+/** Calls of every leaf per phase */
+#define ITERATIONS 4000
+
+/** Calls after which waiting for the restored instrumentation is given up */
+#define MAX_CALLS 10000
+
+/** Sink for the results, keeps the compiler from dropping the calls */
+volatile uint64_t sink;
+
+#define LEAF( n )                                                                              \
+    __attribute__((noinline)) uint64_t leaf_##n( uint64_t x )                                  \
+    {                                                                                          \
+        __asm__ volatile( "" );                                                                \
+        return x * ( n ) + 1;                                                                  \
+    }
+#define LEAVES_16                                                                              \
+    LEAF( 0x0 ) LEAF( 0x1 ) LEAF( 0x2 ) LEAF( 0x3 ) LEAF( 0x4 ) LEAF( 0x5 ) LEAF( 0x6 )       \
+    LEAF( 0x7 ) LEAF( 0x8 ) LEAF( 0x9 ) LEAF( 0xa ) LEAF( 0xb ) LEAF( 0xc ) LEAF( 0xd )       \
+    LEAF( 0xe ) LEAF( 0xf )
+
+LEAVES_16
+
+#undef LEAF
+#define LEAF( n ) leaf_##n,
+
+/** All leaves, called through a pointer so that every one keeps its own call site */
+static uint64_t ( * const leaves[] )( uint64_t ) = { LEAVES_16 };
+
+/** Number of leaves */
+#define LEAF_CNT ( sizeof( leaves ) / sizeof( leaves[0] ) )
+
+/** scorep_dynamic_filtering_restore of the plugin */
+static scorep_dynamic_filtering_restore_fn restore;
+
+/**
+ * Long enough to keep its instrumentation. Its exit is where the plugin takes restore requests.
+ */
+__attribute__((noinline)) void next_phase( void )
+{
+    uint64_t start = bench_now( );
+    while( bench_now( ) - start < 1000000 )
+    {
+        __asm__ volatile( "" );
+    }
+}
+
+__attribute__((no_instrument_function)) static void run_once( void )
+{
+    uint64_t x = sink;
+    for( size_t i = 0; i < LEAF_CNT; ++i )
+    {
+        x = leaves[i]( x );
+    }
+    sink = x;
+}
+
+__attribute__((no_instrument_function)) static void run_phase( const char*          name )
+{
+    bench_phase_begin( name );
+    for( int i = 0; i < ITERATIONS; ++i )
+    {
+        run_once( );
+    }
+    bench_phase_end( (uint64_t) ITERATIONS * LEAF_CNT );
+}
+
+/**
+ * Requests restoring the given region, enters the next phase and calls the leaves until they
+ * produce events again.
+ *
+ * @param   region_name                     Region to restore, NULL restores all of them.
+ *
+ * @return                                  Whether the leaves produced events again.
+ */
+__attribute__((no_instrument_function)) static bool time_to_restore( const char*    region_name )
+{
+    uint64_t start = bench_now( );
+    restore( region_name );
+    next_phase( );
+    for( uint64_t i = 0; i < MAX_CALLS; ++i )
+    {
+        uint64_t before = bench_events( );
+        run_once( );
+        if( bench_events( ) != before )
+        {
+            printf( "restore %-20s restored after %lu calls, %.3f ms\n",
+                    region_name != NULL ? region_name : "(all)", i, ( bench_now( ) - start ) / 1e6 );
+            fflush( stdout );
+            return true;
+        }
+    }
+    printf( "restore %-20s not restored within %d calls\n",
+            region_name != NULL ? region_name : "(all)", MAX_CALLS );
+    fflush( stdout );
+    return false;
+}
+
+/**
+ * Restoring deleted regions through the documented lookup of scorep_dynamic_filtering_restore,
+ * with the plugin loaded like Score-P does it. Fails if the lookup or the restore fails.
+ */
+__attribute__((no_instrument_function)) int main( void )
+{
+    *(void**) &restore = dlsym( RTLD_DEFAULT, "scorep_dynamic_filtering_restore" );
+    if( restore == NULL )
+    {
+        fprintf( stderr, "Could not look up scorep_dynamic_filtering_restore.\n" );
+        return EXIT_FAILURE;
+    }
+
+    next_phase( );
+    bench_time_to_filter( "restore", run_once, MAX_CALLS );
+    run_phase( "restore filtered" );
+    if( !time_to_restore( NULL ) )
+    {
+        return EXIT_FAILURE;
+    }
+    bench_time_to_filter( "restore again", run_once, MAX_CALLS );
+    if( !time_to_restore( "leaf_0x7" ) )
+    {
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
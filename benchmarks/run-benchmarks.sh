@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs all micro-benchmarks twice: once with a threshold of one tick, so that nothing is filtered
+# and every event reaches the plugin, and once with the default settings of the plugin.
+#
+# Usage: run-benchmarks.sh <plugin library> <directory of the benchmark binaries>
+#
+# BENCH_THREADS sets the largest team of the teams benchmark, the reports of the plugin are written
+# to BENCH_EXPERIMENT_DIR (default: bench-exp in the binary directory).
+
+set -e
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 <plugin library> <directory of the benchmark binaries>" >&2
+	exit 1
+fi
+
+BENCH_PLUGIN=$1
+BENCH_EXPERIMENT_DIR=${BENCH_EXPERIMENT_DIR:-$2/bench-exp}
+export BENCH_PLUGIN BENCH_EXPERIMENT_DIR
+mkdir -p "$BENCH_EXPERIMENT_DIR"
+
+for MODE in instrumented filtered; do
+	echo "== $MODE"
+	for BENCHMARK in recursion leaves multi_exit restore teams; do
+		if [ $MODE = instrumented ]; then
+			SCOREP_SUBSTRATE_DYNAMIC_FILTERING_THRESHOLD=1 "$2/bench_$BENCHMARK" 2>> "$BENCH_EXPERIMENT_DIR/$MODE.log"
+		else
+			"$2/bench_$BENCHMARK" 2>> "$BENCH_EXPERIMENT_DIR/$MODE.log"
+		fi
+	done
+done
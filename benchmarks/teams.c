@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bench-runtime.h"
+
+/** Teams per thread count */
+#define TEAMS 64
+
+/** Leaf calls per thread and team */
+#define CALLS 2000
+
+/** Sink for the results, keeps the compiler from dropping the calls */
+volatile uint64_t sink;
+
+__attribute__((noinline)) uint64_t team_leaf( uint64_t                              x )
+{
+    __asm__ volatile( "" );
+    return x * 31 + 7;
+}
+
+__attribute__((noinline)) uint64_t team_work( int                                   tid )
+{
+    uint64_t x = tid;
+    for( int i = 0; i < CALLS; ++i )
+    {
+        x = team_leaf( x );
+    }
+    return x;
+}
+
+__attribute__((no_instrument_function)) static void run_thread( int                 tid )
+{
+    sink += team_work( tid );
+}
+
+/**
+ * OpenMP-like teams with many joins: prints the latency of the plugin's join callback, which merges
+ * the statistics of all threads, and the heap memory per thread for growing team sizes.
+ */
+__attribute__((no_instrument_function)) int main( void )
+{
+    int max_threads = bench_max_threads( );
+    uint64_t base_heap = bench_heap_bytes( );
+
+    for( int threads = 1; threads <= max_threads;
+         threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2 )
+    {
+        uint64_t join_ns = 0;
+        uint64_t heap = 0;
+        uint64_t start = bench_now( );
+        for( int i = 0; i < TEAMS; ++i )
+        {
+            bench_team_stats stats = bench_parallel( threads, run_thread );
+            join_ns += stats.join_ns;
+            heap = stats.heap_bytes;
+        }
+        uint64_t duration = bench_now( ) - start;
+        printf( "teams %3d threads %10.0f ns/join %10.0f ns/team %10lu bytes/thread\n", threads,
+                (double) join_ns / TEAMS, (double) duration / TEAMS,
+                heap > base_heap ? ( heap - base_heap ) / threads : 0 );
+        fflush( stdout );
+    }
+    return 0;
+}
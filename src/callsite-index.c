@@ -0,0 +1,701 @@
+#define _GNU_SOURCE /* <- needed for dl_iterate_phdr */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "callsite-index.h"
+#include "x86-decode.h"
+
+/**
+ * A function symbol of a loaded object.
+ */
+typedef struct symbol_entry
+{
+    /** Runtime address of the function */
+    uintptr_t address;
+    /** Size of the function */
+    uintptr_t size;
+    /** Name of the function, points into the mapped object file */
+    const char* name;
+} symbol_entry;
+
+/**
+ * A single call site found while scanning.
+ */
+typedef struct site_record
+{
+    /** Name of the instrumented function */
+    char* name;
+    /** Address of the instrumented function */
+    uintptr_t function;
+    /** Position of the callq */
+    char* site;
+    /** Whether the callq calls an enter instrumentation call */
+    bool is_enter;
+    /** Whether the function may have further call sites that couldn't be attributed */
+    bool incomplete;
+} site_record;
+
+/**
+ * The call sites of one function.
+ */
+typedef struct callsite_entry
+{
+    /** Name of the function */
+    char* name;
+    /** Positions of the enter callqs */
+    char** enter_sites;
+    /** Number of enter callqs */
+    size_t enter_cnt;
+    /** Positions of the exit callqs */
+    char** exit_sites;
+    /** Number of exit callqs */
+    size_t exit_cnt;
+} callsite_entry;
+
+/**
+ * Information passed to the callback of dl_iterate_phdr.
+ */
+typedef struct scan_context
+{
+    void* const* enter_targets;
+    void* const* exit_targets;
+    size_t target_cnt;
+} scan_context;
+
+/** All call sites found while scanning */
+static site_record* records = NULL;
+
+/** Number of call sites found while scanning */
+static size_t record_cnt = 0;
+
+/** Capacity of records */
+static size_t record_capacity = 0;
+
+/** The index, sorted by function name */
+static callsite_entry* entries = NULL;
+
+/** Number of functions in the index */
+static size_t entry_cnt = 0;
+
+/** Call sites of all functions in the index, sorted by function and kind */
+static char** sites = NULL;
+
+/**
+ * Compares two symbols by their address.
+ */
+static int compare_symbol( const void*                                              a,
+                           const void*                                              b )
+{
+    uintptr_t first = ( (const symbol_entry*) a )->address;
+    uintptr_t second = ( (const symbol_entry*) b )->address;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * Compares two call site records by their function name, enter calls first.
+ */
+static int compare_record( const void*                                              a,
+                           const void*                                              b )
+{
+    const site_record* first = a;
+    const site_record* second = b;
+    int cmp = strcmp( first->name, second->name );
+    if( cmp != 0 )
+    {
+        return cmp;
+    }
+    return (int) second->is_enter - (int) first->is_enter;
+}
+
+/**
+ * Compares a function name with an index entry.
+ */
+static int compare_entry_name( const void*                                          name,
+                               const void*                                          entry )
+{
+    return strcmp( name, ( (const callsite_entry*) entry )->name );
+}
+
+/**
+ * Reads the function symbols of a mapped object file.
+ *
+ * The symbol table is preferred, the dynamic symbol table is used for stripped objects.
+ *
+ * @param   file                            The mapped object file.
+ * @param   file_size                       Size of the mapped object file.
+ * @param   base                            Load address of the object.
+ * @param   symbols                         Returns the symbols, sorted by their address.
+ *
+ * @return                                  Number of symbols.
+ */
+static size_t read_symbols( const unsigned char*                                    file,
+                            size_t                                                  file_size,
+                            uintptr_t                                               base,
+                            symbol_entry**                                          symbols )
+{
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*) file;
+    if( file_size < sizeof( Elf64_Ehdr ) || memcmp( ehdr->e_ident, ELFMAG, SELFMAG ) != 0
+        || ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_shoff == 0
+        || ehdr->e_shoff + ehdr->e_shnum * sizeof( Elf64_Shdr ) > file_size )
+    {
+        return 0;
+    }
+
+    const Elf64_Shdr* sections = (const Elf64_Shdr*) ( file + ehdr->e_shoff );
+    const Elf64_Shdr* symtab = NULL;
+    for( size_t i = 0; i < ehdr->e_shnum; ++i )
+    {
+        if( sections[i].sh_type == SHT_SYMTAB
+            || ( sections[i].sh_type == SHT_DYNSYM && symtab == NULL ) )
+        {
+            symtab = &sections[i];
+        }
+    }
+    if( symtab == NULL || symtab->sh_link >= ehdr->e_shnum
+        || symtab->sh_offset + symtab->sh_size > file_size )
+    {
+        return 0;
+    }
+    const Elf64_Shdr* strtab = &sections[symtab->sh_link];
+    if( strtab->sh_offset + strtab->sh_size > file_size )
+    {
+        return 0;
+    }
+
+    const Elf64_Sym* syms = (const Elf64_Sym*) ( file + symtab->sh_offset );
+    const char* names = (const char*) ( file + strtab->sh_offset );
+    size_t sym_cnt = symtab->sh_size / sizeof( Elf64_Sym );
+    size_t cnt = 0;
+
+    *symbols = malloc( sym_cnt * sizeof( symbol_entry ) );
+    for( size_t i = 0; i < sym_cnt; ++i )
+    {
+        if( ELF64_ST_TYPE( syms[i].st_info ) != STT_FUNC || syms[i].st_shndx == SHN_UNDEF
+            || syms[i].st_value == 0 || syms[i].st_name >= strtab->sh_size )
+        {
+            continue;
+        }
+        ( *symbols )[cnt].address = base + syms[i].st_value;
+        ( *symbols )[cnt].size = syms[i].st_size;
+        ( *symbols )[cnt].name = names + syms[i].st_name;
+        cnt++;
+    }
+    qsort( *symbols, cnt, sizeof( symbol_entry ), compare_symbol );
+    return cnt;
+}
+
+/**
+ * Looks up the symbol starting at or containing the given address.
+ *
+ * @param   symbols                         Symbols sorted by their address.
+ * @param   symbol_cnt                      Number of symbols.
+ * @param   address                         The address to look up.
+ * @param   exact                           Whether the symbol has to start at the address.
+ *
+ * @return                                  The symbol, NULL if there's none.
+ */
+static const symbol_entry* find_symbol( const symbol_entry*                         symbols,
+                                        size_t                                      symbol_cnt,
+                                        uintptr_t                                   address,
+                                        bool                                        exact )
+{
+    // Find the last symbol starting at or before the address.
+    size_t low = 0, high = symbol_cnt;
+    while( low < high )
+    {
+        size_t mid = ( low + high ) / 2;
+        if( symbols[mid].address <= address )
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if( low == 0 )
+    {
+        return NULL;
+    }
+    const symbol_entry* symbol = &symbols[low - 1];
+    if( exact ? symbol->address != address : address >= symbol->address + symbol->size )
+    {
+        return NULL;
+    }
+    return symbol;
+}
+
+/**
+ * Adds a call site to the records.
+ */
+static void add_record( const symbol_entry*                                        function,
+                        char*                                                       site,
+                        bool                                                        is_enter,
+                        bool                                                        incomplete )
+{
+    if( record_cnt == record_capacity )
+    {
+        record_capacity = record_capacity == 0 ? 256 : 2 * record_capacity;
+        records = realloc( records, record_capacity * sizeof( site_record ) );
+    }
+    records[record_cnt].name = strdup( function->name );
+    records[record_cnt].function = function->address;
+    records[record_cnt].site = site;
+    records[record_cnt].is_enter = is_enter;
+    records[record_cnt].incomplete = incomplete;
+    record_cnt++;
+}
+
+/**
+ * Checks whether the given address is one of the given instrumentation calls.
+ */
+static bool is_target( void* const*                                                 targets,
+                       size_t                                                       target_cnt,
+                       const unsigned char*                                         address )
+{
+    for( size_t i = 0; i < target_cnt; ++i )
+    {
+        if( targets[i] != NULL && targets[i] == address )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether the given memory range lies within one loaded segment of the object.
+ */
+static bool in_object( const struct dl_phdr_info*                                  info,
+                       const unsigned char*                                         address,
+                       size_t                                                       size )
+{
+    for( size_t i = 0; i < info->dlpi_phnum; ++i )
+    {
+        const ElfW( Phdr )* phdr = &info->dlpi_phdr[i];
+        const unsigned char* begin = (const unsigned char*) ( info->dlpi_addr + phdr->p_vaddr );
+        if( phdr->p_type == PT_LOAD && address >= begin && address + size <= begin + phdr->p_memsz )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reads the function stored in the GOT slot addressed by a RIP relative jmp or call.
+ *
+ * @param   info                            The object holding the instruction.
+ * @param   next                            Address of the instruction following the jmp or call.
+ * @param   displacement                    Displacement of the GOT slot.
+ *
+ * @return                                  The function, NULL if the slot isn't part of the object.
+ */
+static const unsigned char* read_got_slot( const struct dl_phdr_info*               info,
+                                           const unsigned char*                     next,
+                                           int32_t                                  displacement )
+{
+    const unsigned char* const* slot = (const unsigned char* const*) ( next + displacement );
+    return in_object( info, (const unsigned char*) slot, sizeof( *slot ) ) ? *slot : NULL;
+}
+
+/**
+ * Determines the function instrumented by an instrumentation call from its first argument.
+ *
+ * The argument is the address of the instrumented function, as tracked by x86_track_registers. An
+ * argument loaded from a GOT slot is known by the address of the slot, the function is then read
+ * from the slot.
+ *
+ * @param   info                            The object holding the call.
+ * @param   argument                        The tracked value of rdi at the call, 0 if it's unknown.
+ * @param   symbols                         Symbols of the object, sorted by their address.
+ * @param   symbol_cnt                      Number of symbols.
+ *
+ * @return                                  The instrumented function, NULL if it's unknown.
+ */
+static const symbol_entry* find_instrumented_function( const struct dl_phdr_info*   info,
+                                                       uintptr_t                    argument,
+                                                       const symbol_entry*          symbols,
+                                                       size_t                       symbol_cnt )
+{
+    if( argument == 0 )
+    {
+        return NULL;
+    }
+    const symbol_entry* symbol = find_symbol( symbols, symbol_cnt, argument, true );
+    if( symbol == NULL )
+    {
+        const unsigned char* slot = (const unsigned char*) argument;
+        const unsigned char* function = read_got_slot( info, slot, 0 );
+        if( function != NULL )
+        {
+            symbol = find_symbol( symbols, symbol_cnt, (uintptr_t) function, true );
+        }
+    }
+    return symbol;
+}
+
+/**
+ * Returns the function called or jumped to by the instruction at the given position.
+ *
+ * Direct calls and jumps into the PLT of the object (plain entries as well as the endbr64 ones of the
+ * second PLT) are followed to the function stored in the GOT.
+ *
+ * @param   info                            The object holding the instruction.
+ * @param   site                            Position of the instruction.
+ * @param   code_end                        End of the executable segment holding the instruction.
+ * @param   is_jump                         Returns whether the instruction is a tail call.
+ *
+ * @return                                  The target, NULL if there's no call or jump.
+ */
+static const unsigned char* get_site_target( const struct dl_phdr_info*             info,
+                                             const unsigned char*                   site,
+                                             const unsigned char*                   code_end,
+                                             bool*                                  is_jump )
+{
+    int32_t displacement;
+
+    if( site[0] == 0xff && code_end - site >= 6 && ( site[1] == 0x15 || site[1] == 0x25 ) )
+    {
+        // call/jmp *disp32(%rip)
+        *is_jump = site[1] == 0x25;
+        memcpy( &displacement, site + 2, sizeof( displacement ) );
+        return read_got_slot( info, site + 6, displacement );
+    }
+    if( site[0] != 0xe8 && site[0] != 0xe9 )
+    {
+        return NULL;
+    }
+
+    *is_jump = site[0] == 0xe9;
+    memcpy( &displacement, site + 1, sizeof( displacement ) );
+    const unsigned char* target = site + 5 + displacement;
+    const unsigned char* jump = target;
+    if( !in_object( info, target, 11 ) )
+    {
+        return target;
+    }
+    if( jump[0] == 0xf3 && jump[1] == 0x0f && jump[2] == 0x1e && jump[3] == 0xfa )
+    {
+        // endbr64
+        jump += 4;
+    }
+    if( jump[0] == 0xf2 )
+    {
+        // bnd prefix
+        jump++;
+    }
+    if( jump[0] == 0xff && jump[1] == 0x25 )
+    {
+        memcpy( &displacement, jump + 2, sizeof( displacement ) );
+        const unsigned char* function = read_got_slot( info, jump + 6, displacement );
+        return function != NULL ? function : target;
+    }
+    return target;
+}
+
+/**
+ * Checks whether an instrumentation call is called or jumped to by the instruction at the given
+ * position.
+ *
+ * @param   info                            The object holding the instruction.
+ * @param   context                         The instrumentation calls.
+ * @param   site                            Position of the instruction.
+ * @param   code_end                        End of the executable segment holding the instruction.
+ * @param   is_enter                        Returns whether an enter instrumentation call is called.
+ *
+ * @return                                  Whether the instruction is an instrumentation call site.
+ */
+static bool is_instrumentation_call( const struct dl_phdr_info*                     info,
+                                     const scan_context*                            context,
+                                     const unsigned char*                           site,
+                                     const unsigned char*                           code_end,
+                                     bool*                                          is_enter )
+{
+    bool is_jump = false;
+    const unsigned char* target = get_site_target( info, site, code_end, &is_jump );
+    if( target == NULL )
+    {
+        return false;
+    }
+    *is_enter = !is_jump && is_target( context->enter_targets, context->target_cnt, target );
+    return *is_enter || is_target( context->exit_targets, context->target_cnt, target );
+}
+
+/**
+ * Checks whether any byte sequence of the executable segments looks like an instrumentation call.
+ *
+ * This is cheap compared to reading the symbols and decoding every function, which is only done for
+ * objects passing this check.
+ */
+static bool has_instrumentation_calls( const struct dl_phdr_info*                   info,
+                                       const scan_context*                          context )
+{
+    for( size_t i = 0; i < info->dlpi_phnum; ++i )
+    {
+        const ElfW( Phdr )* phdr = &info->dlpi_phdr[i];
+        if( phdr->p_type != PT_LOAD || !( phdr->p_flags & PF_X ) )
+        {
+            continue;
+        }
+
+        const unsigned char* code_begin = (const unsigned char*) ( info->dlpi_addr + phdr->p_vaddr );
+        const unsigned char* code_end = code_begin + phdr->p_memsz;
+        for( const unsigned char* current = code_begin; code_end - current >= 5; ++current )
+        {
+            bool is_enter;
+            if( is_instrumentation_call( info, context, current, code_end, &is_enter ) )
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Decodes one function and records its instrumentation call sites.
+ *
+ * Only instructions found by decoding linearly from the start of the function are considered, so
+ * byte sequences that merely look like a call (e.g. within an immediate) are never recorded. The
+ * decoding stops at the first instruction that can't be decoded.
+ *
+ * A call site is assigned to the function whose address is its first argument. Sites whose argument
+ * isn't known are dropped. They may belong to the function or to any function inlined into it, so
+ * all of these are recorded as incomplete then, as they are if the function couldn't be decoded up
+ * to its end.
+ *
+ * @param   info                            The object holding the function.
+ * @param   context                         The instrumentation calls.
+ * @param   function                        The function to decode.
+ * @param   code_end                        End of the executable segment holding the function.
+ * @param   symbols                         Symbols of the object, sorted by their address.
+ * @param   symbol_cnt                      Number of symbols.
+ *
+ * @return                                  End of the decoded instructions.
+ */
+static const unsigned char* scan_function( const struct dl_phdr_info*               info,
+                                           const scan_context*                      context,
+                                           const symbol_entry*                      function,
+                                           const unsigned char*                     code_end,
+                                           const symbol_entry*                      symbols,
+                                           size_t                                   symbol_cnt )
+{
+    const unsigned char* current = (const unsigned char*) function->address;
+    const unsigned char* end = current + function->size;
+    uintptr_t registers[X86_REGISTER_CNT] = { 0 };
+    size_t first_record = record_cnt;
+    bool incomplete = false;
+    x86_insn insn;
+
+    while( current < end && x86_decode( current, end - current, &insn ) )
+    {
+        const unsigned char* site = current + insn.opcode;
+        uintptr_t argument = registers[X86_RDI];
+        x86_track_registers( current, &insn, registers );
+        current += insn.length;
+
+        // Only take the plain forms, i.e. e8/e9 with a rel32 and ff15/ff25 with a disp32(%rip).
+        size_t operand_size = insn.length - insn.opcode;
+        bool is_enter;
+        if( ( ( ( site[0] == 0xe8 || site[0] == 0xe9 ) && operand_size == 5 )
+              || ( site[0] == 0xff && ( site[1] == 0x15 || site[1] == 0x25 ) && operand_size == 6 ) )
+            && is_instrumentation_call( info, context, site, code_end, &is_enter ) )
+        {
+            const symbol_entry* instrumented = find_instrumented_function( info, argument,
+                                                                           symbols, symbol_cnt );
+            if( instrumented != NULL )
+            {
+                add_record( instrumented, (char*) site, is_enter, false );
+            }
+            else
+            {
+                incomplete = true;
+            }
+        }
+    }
+
+    if( incomplete || current < end )
+    {
+        // The record without a site marks the function itself, it's never taken into the index.
+        for( size_t i = first_record; i < record_cnt; ++i )
+        {
+            records[i].incomplete = true;
+        }
+        add_record( function, NULL, false, true );
+    }
+    return current;
+}
+
+/**
+ * Scans one loaded object for instrumentation call sites (callback of dl_iterate_phdr).
+ *
+ * Besides direct callqs, calls through the GOT (-fno-plt) and tail calls to the exit
+ * instrumentation calls (-foptimize-sibling-calls) are recorded. The functions are decoded starting
+ * at their symbols, code not covered by a sized function symbol isn't scanned.
+ */
+static int scan_object( struct dl_phdr_info*                                        info,
+                        __attribute__((unused)) size_t                              size,
+                        void*                                                       data )
+{
+    const scan_context* context = data;
+    if( !has_instrumentation_calls( info, context ) )
+    {
+        return 0;
+    }
+
+    // The symbols are only read for objects that contain instrumentation calls.
+    const char* path = info->dlpi_name[0] != '\0' ? info->dlpi_name : "/proc/self/exe";
+    struct stat file_stat;
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return 0;
+    }
+    unsigned char* file = MAP_FAILED;
+    size_t file_size = 0;
+    if( fstat( fd, &file_stat ) == 0 && file_stat.st_size > 0 )
+    {
+        file_size = file_stat.st_size;
+        file = mmap( NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    }
+    close( fd );
+    if( file == MAP_FAILED )
+    {
+        return 0;
+    }
+    symbol_entry* symbols = NULL;
+    size_t symbol_cnt = read_symbols( file, file_size, info->dlpi_addr, &symbols );
+
+    for( size_t i = 0; i < info->dlpi_phnum; ++i )
+    {
+        const ElfW( Phdr )* phdr = &info->dlpi_phdr[i];
+        if( phdr->p_type != PT_LOAD || !( phdr->p_flags & PF_X ) )
+        {
+            continue;
+        }
+
+        const unsigned char* code_begin = (const unsigned char*) ( info->dlpi_addr + phdr->p_vaddr );
+        const unsigned char* code_end = code_begin + phdr->p_memsz;
+        const unsigned char* decoded_end = code_begin;
+        for( size_t j = 0; j < symbol_cnt; ++j )
+        {
+            // Aliases and nested symbols are covered by the function decoded before.
+            const unsigned char* function = (const unsigned char*) symbols[j].address;
+            if( symbols[j].size == 0 || function < decoded_end
+                || function + symbols[j].size > code_end )
+            {
+                continue;
+            }
+            decoded_end = scan_function( info, context, &symbols[j], code_end, symbols, symbol_cnt );
+        }
+    }
+
+    free( symbols );
+    munmap( file, file_size );
+    return 0;
+}
+
+size_t callsite_index_build( void* const*                                           enter_targets,
+                             void* const*                                           exit_targets,
+                             size_t                                                 target_cnt )
+{
+    scan_context context = { enter_targets, exit_targets, target_cnt };
+
+    callsite_index_free( );
+    dl_iterate_phdr( scan_object, &context );
+
+    // Group the call sites by function. Functions of several objects sharing one name (e.g. static
+    // functions) are left out, as their call sites can't be told apart by the region name. Inlined
+    // copies of a function pass the address of the function itself, so they are kept. Functions
+    // that may have call sites which couldn't be attributed are left out as well, their call sites
+    // are discovered at runtime.
+    qsort( records, record_cnt, sizeof( site_record ), compare_record );
+    entries = malloc( ( record_cnt > 0 ? record_cnt : 1 ) * sizeof( callsite_entry ) );
+    sites = malloc( ( record_cnt > 0 ? record_cnt : 1 ) * sizeof( char* ) );
+    size_t site_cnt = 0;
+    for( size_t first = 0; first < record_cnt; )
+    {
+        size_t last = first;
+        size_t enter_cnt = 0;
+        bool unique = true;
+        bool complete = true;
+        while( last < record_cnt && strcmp( records[last].name, records[first].name ) == 0 )
+        {
+            unique = unique && records[last].function == records[first].function;
+            complete = complete && !records[last].incomplete;
+            enter_cnt += records[last].is_enter;
+            last++;
+        }
+        if( unique && complete && enter_cnt > 0 && enter_cnt < last - first )
+        {
+            callsite_entry* entry = &entries[entry_cnt++];
+            entry->name = records[first].name;
+            entry->enter_sites = &sites[site_cnt];
+            entry->enter_cnt = enter_cnt;
+            entry->exit_sites = &sites[site_cnt + enter_cnt];
+            entry->exit_cnt = last - first - enter_cnt;
+            records[first].name = NULL;
+            for( size_t i = first; i < last; ++i )
+            {
+                sites[site_cnt++] = records[i].site;
+            }
+        }
+        for( size_t i = first; i < last; ++i )
+        {
+            free( records[i].name );
+        }
+        first = last;
+    }
+
+    free( records );
+    records = NULL;
+    record_cnt = 0;
+    record_capacity = 0;
+
+    return entry_cnt;
+}
+
+bool callsite_index_lookup( const char*                                             name,
+                            char* const**                                           enter_sites,
+                            size_t*                                                 enter_cnt,
+                            char* const**                                           exit_sites,
+                            size_t*                                                 exit_cnt )
+{
+    if( entry_cnt == 0 || name == NULL )
+    {
+        return false;
+    }
+    const callsite_entry* entry = bsearch( name, entries, entry_cnt, sizeof( callsite_entry ),
+                                           compare_entry_name );
+    if( entry == NULL )
+    {
+        return false;
+    }
+    *enter_sites = entry->enter_sites;
+    *enter_cnt = entry->enter_cnt;
+    *exit_sites = entry->exit_sites;
+    *exit_cnt = entry->exit_cnt;
+    return true;
+}
+
+void callsite_index_free( void )
+{
+    for( size_t i = 0; i < entry_cnt; ++i )
+    {
+        free( entries[i].name );
+    }
+    free( entries );
+    free( sites );
+    entries = NULL;
+    sites = NULL;
+    entry_cnt = 0;
+}
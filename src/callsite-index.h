@@ -0,0 +1,58 @@
+#ifndef CALLSITE_INDEX_H
+#define CALLSITE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Index of the instrumentation call sites of all loaded objects.
+ *
+ * The executable segments of the binary and all shared objects are scanned once for callqs to
+ * the instrumentation calls, including calls through the PLT or GOT and tail calls to the exit
+ * instrumentation calls. Every call site is assigned to the function it instruments, which is
+ * looked up in the symbol table of the object. This way the call sites of a region are known ahead
+ * of its first enter and exit event.
+ *
+ * The functions are decoded instruction by instruction starting at their symbols, so only real
+ * instructions are recorded and never bytes in the middle of one.
+ */
+
+/**
+ * Builds the call site index.
+ *
+ * @param   enter_targets                   Addresses of all known enter instrumentation calls.
+ * @param   exit_targets                    Addresses of all known exit instrumentation calls,
+ *                                          NULL entries are skipped in both arrays.
+ * @param   target_cnt                      Number of entries in both arrays.
+ *
+ * @return                                  Number of functions with known call sites.
+ */
+size_t callsite_index_build( void* const*                                           enter_targets,
+                             void* const*                                           exit_targets,
+                             size_t                                                 target_cnt );
+
+/**
+ * Looks up the call sites of the given function.
+ *
+ * Functions with several enter or exit call sites (e.g. inlined ones) return all of them.
+ *
+ * @param   name                            Symbol name of the function.
+ * @param   enter_sites                     Returns the positions of the enter callqs.
+ * @param   enter_cnt                       Returns the number of enter callqs.
+ * @param   exit_sites                      Returns the positions of the exit callqs.
+ * @param   exit_cnt                        Returns the number of exit callqs.
+ *
+ * @return                                  Whether the call sites of the function are known.
+ */
+bool callsite_index_lookup( const char*                                             name,
+                            char* const**                                           enter_sites,
+                            size_t*                                                 enter_cnt,
+                            char* const**                                           exit_sites,
+                            size_t*                                                 exit_cnt );
+
+/**
+ * Frees the call site index.
+ */
+void callsite_index_free( void );
+
+#endif /* CALLSITE_INDEX_H */
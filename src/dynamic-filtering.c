@@ -5,8 +5,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libunwind.h>
+#include <limits.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -15,9 +17,19 @@
 #include <assert.h>
 
 #include <dlfcn.h>
+#include <link.h>
+#include <linux/membarrier.h>
+#include <x86intrin.h>
 
 #include <scorep/SCOREP_SubstratePlugins.h>
 
+#include "callsite-index.h"
+#include "dynamic-filtering.h"
+#include "filter-cache.h"
+#include "module-registry.h"
+#include "output-buffer.h"
+#include "x86-decode.h"
+
 /**
  * Default to own built-in hash function.
  */
@@ -37,39 +49,138 @@
 
 #include "uthash.h"
 
+/**
+ * Default to a dense region table with up to 2^20 slots.
+ *
+ * Region handles below this limit are looked up directly in region_table, all others are stored in
+ * the regions hash.
+ */
+#ifndef DENSE_REGION_LIMIT
+#define DENSE_REGION_LIMIT 1048576
+#endif
+
+/** Number of call sites stored within call_sites itself */
+#ifndef INLINE_CALL_SITES
+#define INLINE_CALL_SITES 2
+#endif
+
+/**
+ * Set of callqs calling one instrumentation function for a region.
+ *
+ * A region has more than one enter and exit call site if it has been inlined or has several return
+ * paths. The first sites are stored inline, further ones in a block from the site arena.
+ */
+typedef struct call_sites
+{
+    /** Number of known call sites */
+    uint32_t cnt;
+    /** Number of call sites that have already been overridden, these are the first ones */
+    uint32_t patched;
+    /** Capacity of spilled */
+    uint32_t capacity;
+    /** Call sites beyond the inline ones */
+    char** spilled;
+    /** The first call sites */
+    char* sites[INLINE_CALL_SITES];
+} call_sites;
+
+/** Returns the call site with the given index */
+#define CALL_SITE( set, i )                                                                       \
+    ( ( i ) < INLINE_CALL_SITES ? ( set )->sites[i] : ( set )->spilled[( i ) - INLINE_CALL_SITES] )
+
 /**
  * Stores region info.
  */
 typedef struct region_info
 {
-    /** Handle for uthash usage */
-    UT_hash_handle hh;
     /** Global counter for region entries */
     uint64_t call_cnt;
+    /** Global counter for timed region entries, duration covers these (see sampling_interval) */
+    uint64_t sampled_cnt;
     /** Global calculated region duration */
     uint64_t duration;
-    /** Timestamp of last enter into this region (used by main thread) */
-    uint64_t last_enter;
-    /** Pointer to the callq for the enter instrumentation function */
-    char* enter_func;
-    /** Pointer to the callq for the exit instrumentation function */
-    char* exit_func;
+    /** Global calculated exclusive region duration (without the time spent in child regions) */
+    uint64_t exclusive_duration;
+    /** Callqs for the enter instrumentation function */
+    call_sites enter_sites;
+    /** Callqs for the exit instrumentation function */
+    call_sites exit_sites;
     /** Human readable name of the region */
     char* region_name;
     /** Handle identifying the region */
     uint32_t region_handle;
-    /** Recursion depth in this region */
-    uint32_t depth;
+    /** Position of this region in region_list and the thread local tables */
+    uint32_t index;
     /** Mean region duration used for comparison */
     float mean_duration;
+    /** Marks whether mean_duration is part of the global mean duration */
+    bool in_mean;
+    /** Value of call_cnt when the filter criteria were evaluated last */
+    uint64_t eval_cnt;
+    /** Timestamp of the last evaluation of the filter criteria */
+    uint64_t eval_time;
+    /** Next region in the queue of pending deletions */
+    struct region_info* next_pending;
+    /** Marks whether the region is in the queue of pending deletions */
+    bool queued;
     /** Marks whether the region is deletable */
     bool deletable;
     /** Marks whether the region has been deleted */
     bool inactive;
+    /** Grace period that has to be completed before the exit call may be deleted */
+    uint32_t patch_generation;
+    /** Timestamp of the deletion, used for estimating the avoided overhead */
+    uint64_t deleted_at;
+    /** Generation of the module registry plus one in which a call site lookup failed, see
+        get_function_call_ip */
+    uint64_t missed_generation;
     /** Marks whether the region is optimized beyond repair */
     bool optimized;
+    /** Marks whether all exit calls of the region are known (see complete_exit_sites) */
+    bool exits_complete;
+    /** Marks whether the call sites have been taken from the call site index, so none has to be
+        discovered */
+    bool indexed;
+    /** Marks whether the region is in joined_regions (only used within on_join) */
+    bool joined;
+    /** Marks whether one of the first early_calls timed activations was too long for the early rule */
+    bool early_failed;
+    /** Longest of the first early_calls timed activations, kept until the cut-off is known (see
+        check_early_deletion) */
+    uint64_t early_max;
+    /** Marks whether the region is in restore_waiting */
+    bool restore_waiting;
+    /** Slot of the region in the reductions of the consensus (see reduce_consensus) */
+    uint32_t consensus_slot;
 } region_info;
 
+/** Size of a cache line, thread local blocks are aligned to this */
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#ifdef DYNAMIC_FILTERING_SOA
+/**
+ * Stores the rarely used calling information per thread.
+ *
+ * When the struct of arrays layout is used, the counters touched on every event are kept in
+ * separate arrays of local_info and only the metadata remains in this struct.
+ */
+typedef struct local_region_meta
+{
+    /** Pointer to the callq for the enter instrumentation function discovered last */
+    char* enter_func;
+    /** Pointer to the callq for the exit instrumentation function discovered last */
+    char* exit_func;
+    /** Marks whether the region is optimized beyond repair */
+    bool optimized;
+    /** Longest of the first early_calls timed activations since the last join (see
+        check_early_deletion) */
+    uint64_t early_max;
+    /** Marks whether the region is on the dirty list of the thread */
+    bool dirty;
+} local_region_meta;
+#else
 /**
  * Stores calling information per thread.
  *
@@ -78,811 +189,5838 @@ typedef struct region_info
  */
 typedef struct local_region_info
 {
-    /** Handle for uthash usage */
-    UT_hash_handle hh;
     /** Local counter for region entries */
     uint64_t call_cnt;
+    /** Local counter for timed region entries */
+    uint64_t sampled_cnt;
     /** Local calculated region duration */
     uint64_t duration;
-    /** Timestamp of last enter into this region */
-    uint64_t last_enter;
-    /** Region id this info belongs to */
-    uint32_t region_handle;
-    /** Pointer to the callq for the enter instrumentation function */
+    /** Local calculated exclusive region duration */
+    uint64_t exclusive_duration;
+    /** Recursion depth in this region (only maintained by the main thread) */
+    uint32_t depth;
+    /** Number of entries until the next timed one (see sample_call) */
+    uint32_t countdown;
+    /** Number of open untimed activations above the topmost timed one (see handle_exit_region) */
+    uint32_t unsampled;
+    /** Pointer to the callq for the enter instrumentation function discovered last */
     char* enter_func;
-    /** Pointer to the callq for the exit instrumentation function */
+    /** Pointer to the callq for the exit instrumentation function discovered last */
     char* exit_func;
     /** Marks whether the region is optimized beyond repair */
     bool optimized;
-    /** Human readable name of the region */
-    char* region_name;
+    /** Longest of the first early_calls timed activations since the last join (see
+        check_early_deletion) */
+    uint64_t early_max;
+    /** Marks whether the region is on the dirty list of the thread */
+    bool dirty;
 } local_region_info;
 
-/** Global list of defined regions */
-static region_info* regions = NULL;
+/** Without the struct of arrays layout, metadata and counters share one struct */
+typedef local_region_info local_region_meta;
+#endif
 
-/** Number of created threads */
-static uint32_t num_threads = 0;
+/** Number of regions per page of the thread local tables */
+#define LOCAL_PAGE_SIZE 256
 
-/** Default to max 512 threads that are observed */
-#ifndef MAX_THREAD_CNT
-#define MAX_THREAD_CNT 512
+/** Number of pages per block of the thread local arena */
+#define LOCAL_ARENA_PAGES 8
+
+/**
+ * Page of thread local region infos, covering LOCAL_PAGE_SIZE consecutive region indices.
+ */
+typedef struct local_page
+{
+#ifdef DYNAMIC_FILTERING_SOA
+    /** Local counters for region entries */
+    uint64_t call_cnt[LOCAL_PAGE_SIZE];
+    /** Local counters for timed region entries */
+    uint64_t sampled_cnt[LOCAL_PAGE_SIZE];
+    /** Local calculated region durations */
+    uint64_t duration[LOCAL_PAGE_SIZE];
+    /** Local calculated exclusive region durations */
+    uint64_t exclusive_duration[LOCAL_PAGE_SIZE];
+    /** Recursion depths in the regions (only maintained by the main thread) */
+    uint32_t depth[LOCAL_PAGE_SIZE];
+    /** Numbers of entries until the next timed one (see sample_call) */
+    uint32_t countdown[LOCAL_PAGE_SIZE];
+    /** Numbers of open untimed activations above the topmost timed ones (see handle_exit_region) */
+    uint32_t unsampled[LOCAL_PAGE_SIZE];
+    /** Metadata of the regions */
+    local_region_meta meta[LOCAL_PAGE_SIZE];
+#else
+    /** The region infos */
+    local_region_info regions[LOCAL_PAGE_SIZE];
 #endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) local_page;
 
-/** Thread local region info */
-static local_region_info* local_info_array[MAX_THREAD_CNT];
+/**
+ * Table of the pages of one thread.
+ *
+ * Other threads read the table while its thread runs (see region_is_active), so it's replaced by a
+ * bigger copy like region_vector instead of being resized in place.
+ */
+typedef struct local_page_table
+{
+    /** Previously published table (retired list) */
+    struct local_page_table* retired;
+    /** Number of entries in page */
+    uint32_t cnt;
+    /** The pages, NULL for pages not touched so far */
+    local_page* page[];
+} local_page_table;
 
-/** Thread-local index for accessing the thread-local part of the array */
-static __thread uint32_t local_info_array_index;
+/**
+ * Block of the bump arena a thread allocates its pages from.
+ */
+typedef struct local_arena_block
+{
+    struct local_arena_block* next;
+    /** Number of pages handed out */
+    uint32_t used;
+    local_page pages[LOCAL_ARENA_PAGES];
+} local_arena_block;
 
-/** General mutex used as a guard for writing region info */
-static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+/** Minimum number of call sites per block of the site arena */
+#define SITE_ARENA_BLOCK_SIZE 1024
 
-/** Special mutex used for protecting the thread counter */
-static pthread_mutex_t thread_ctr_mtx = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Block of the arena holding the spilled call sites of all regions.
+ */
+typedef struct site_arena_block
+{
+    struct site_arena_block* next;
+    size_t used;
+    size_t capacity;
+    char* slot[];
+} site_arena_block;
 
-/** Special mutex used for protecting the number of threads */
-static pthread_mutex_t num_threads_mtx = PTHREAD_MUTEX_INITIALIZER;
+/** Current block of the site arena */
+static site_arena_block* site_arena = NULL;
 
-/** Thread counter */
-static uint64_t thread_ctr = 0;
+/** Minimum size in bytes of a block of the definition arena */
+#define DEFINITION_ARENA_BLOCK_SIZE ( 256 * 1024 )
 
-/** Flag indicating the filtering method to be used (true = absolute, false = relative) */
-static bool filtering_absolute = true;
+/**
+ * Block of the arena holding all region_info records and region names.
+ */
+typedef struct definition_arena_block
+{
+    struct definition_arena_block* next;
+    size_t used;
+    size_t capacity;
+    char data[] __attribute__((aligned(16)));
+} definition_arena_block;
 
-/** Threshold for filtering */
-static unsigned long long threshold = 100000;
+/** Current block of the definition arena */
+static definition_arena_block* definition_arena = NULL;
 
-/** Mean duration across all regions */
-static float mean_duration = 0;
+/**
+ * Growable array of region pointers.
+ *
+ * Readers may access a vector while it is replaced by a bigger one, so vectors are never resized in
+ * place. Instead a new vector is published and the old one is kept in the retired list until the
+ * plugin is finalized.
+ */
+typedef struct region_vector
+{
+    /** Previously published vector (retired list) */
+    struct region_vector* retired;
+    /** Number of used slots */
+    uint32_t size;
+    /** Number of allocated slots */
+    uint32_t capacity;
+    /** The slots themselves */
+    region_info* slot[];
+} region_vector;
 
-/** Flag indicating that this current thread is the main thread */
-static __thread bool main_thread = false;
+/** Dense lookup table of defined regions, indexed by region handle */
+static region_vector* region_table = NULL;
 
-/** Internal substrates id */
-static size_t id;
+/** All defined regions in definition order, indexed by region_info.index */
+static region_vector* region_list = NULL;
 
-/** Internal substrates callbacks for information retrieval about handles */
-static const SCOREP_SubstratePluginCallbacks* callbacks;
+/**
+ * Growable bitmap of region handles.
+ *
+ * Published and retired like region_vector, so it can be read without locking.
+ */
+typedef struct handle_bitmap
+{
+    /** Previously published bitmap (retired list) */
+    struct handle_bitmap* retired;
+    /** Number of words */
+    uint32_t word_cnt;
+    /** The bits, handle h is bit h % 64 of word h / 64 */
+    uint64_t word[];
+} handle_bitmap;
 
-/** Name of the enter region instrumentation call */
-static char* enter_func = NULL;
+/** Marks the compiler regions among the handles below DENSE_REGION_LIMIT */
+static handle_bitmap* compiler_regions = NULL;
 
-/** Name of the exit region instrumentation call */
-static char* exit_func = NULL;
+/**
+ * One slot of a region_hash.
+ */
+typedef struct region_hash_slot
+{
+    /** Handle of the region, only valid if region is set */
+    uint32_t handle;
+    /** The region, NULL for an empty slot */
+    region_info* region;
+} region_hash_slot;
 
-/** Whether to continue despite having detected strong optimizations */
-static bool continue_despite;
+/**
+ * Growable hash of region handles with open addressing.
+ *
+ * Published and retired like region_vector, so it can be read without locking. A slot's handle is
+ * written before its region, so a reader seeing the region sees the right handle as well. Slots
+ * are never removed and at most half of them are used, so every probe ends at an empty slot.
+ */
+typedef struct region_hash
+{
+    /** Previously published hash (retired list) */
+    struct region_hash* retired;
+    /** Number of used slots */
+    uint32_t size;
+    /** Number of slots, a power of two */
+    uint32_t capacity;
+    /** The slots themselves */
+    region_hash_slot slot[];
+} region_hash;
 
-/** Whether to create an optimization report */
-static bool create_report;
+/** Hash of defined regions whose handles don't fit into region_table */
+static region_hash* regions = NULL;
 
-/** Whether to write a filter file */
-static bool create_filter;
+/**
+ * One activation of a region on the shadow call stack.
+ */
+typedef struct shadow_frame
+{
+    /** The region that has been entered */
+    region_info* region;
+    /** Timestamp of the enter event */
+    uint64_t enter;
+    /** Inclusive time spent in the child regions so far */
+    uint64_t child_duration;
+    /** Open untimed activations of the region when it was entered (see handle_exit_region) */
+    uint32_t unsampled;
+} shadow_frame;
 
-static unsigned long long base_pointer;
+/**
+ * Costs of the plugin itself, gathered per location if a report is requested.
+ */
+typedef struct plugin_stats
+{
+    /** Number of handled enter and exit events */
+    uint64_t events;
+    /** Cycles spent in the enter and exit callbacks */
+    uint64_t callback_cycles;
+    /** Number of call site discoveries */
+    uint64_t discoveries;
+    /** Cycles spent in get_function_call_ip */
+    uint64_t discovery_cycles;
+} plugin_stats;
 
 /**
- * Update the mean duration of all regions.
+ * Thread local table of region infos.
  *
- * Only used if the plugin uses the relative filtering method.
+ * The table is indexed by region_info.index. Its pages are allocated on the first enter of a region
+ * of the page, from an arena owned by the thread, so that no two threads write to the same cache
+ * line and threads only pay for the regions they actually enter.
  */
-static void update_mean_duration( )
+typedef struct local_info
 {
-    region_info *current, *tmp;
-    uint64_t ctr = 1;
-    float new_duration = 0;
+    /** Pages of the table */
+    local_page_table* pages;
+    /** Arena the pages are allocated from */
+    local_arena_block* arena;
+    /** Indices of the regions touched since the last join, each one is listed once */
+    uint32_t* dirty;
+    /** Number of entries in pages, only read by the owning thread */
+    uint32_t page_cnt;
+    /** Number of entries in dirty */
+    uint32_t dirty_cnt;
+    /** Capacity of dirty */
+    uint32_t dirty_capacity;
+    /** Number of frames on the shadow call stack */
+    uint32_t stack_depth;
+    /** Number of enters not recorded because the shadow call stack was full */
+    uint32_t stack_overflow;
+    /** Shortest leaf activation seen by this thread (see call_cost) */
+    uint64_t min_leaf_duration;
+    /** Number of handled enter and exit events, used for detecting quiescent states */
+    uint64_t events;
+    /** Score-P id of the location using this info */
+    uint64_t location_id;
+    /** Generation of the module registry the call sites in the tables have been checked against */
+    uint64_t generation;
+    /** Costs of the plugin on this location (only gathered if create_report is set) */
+    plugin_stats stats;
+    /** The shadow call stack of this thread (stack_size frames) */
+    shadow_frame* stack;
+} __attribute__((aligned(CACHE_LINE_SIZE))) local_info;
 
-    HASH_ITER( hh, regions, current, tmp )
-    {
-        // Only use active regions for calculating the mean duration.
-#ifdef DYNAMIC_FILTERING_DEBUG
-        if( !current->inactive )
+/**
+ * Accessors for the thread local region infos, independent of the memory layout.
+ */
+#define LOCAL_PAGE( local, index )          ( ( local )->pages->page[( index ) / LOCAL_PAGE_SIZE] )
+#define LOCAL_SLOT( index )                 ( ( index ) % LOCAL_PAGE_SIZE )
+#ifdef DYNAMIC_FILTERING_SOA
+#define LOCAL_CALL_CNT( local, index )      ( LOCAL_PAGE( local, index )->call_cnt[LOCAL_SLOT( index )] )
+#define LOCAL_SAMPLED_CNT( local, index )   ( LOCAL_PAGE( local, index )->sampled_cnt[LOCAL_SLOT( index )] )
+#define LOCAL_DURATION( local, index )      ( LOCAL_PAGE( local, index )->duration[LOCAL_SLOT( index )] )
+#define LOCAL_EXCLUSIVE( local, index )     ( LOCAL_PAGE( local, index )->exclusive_duration[LOCAL_SLOT( index )] )
+#define LOCAL_DEPTH( local, index )         ( LOCAL_PAGE( local, index )->depth[LOCAL_SLOT( index )] )
+#define LOCAL_COUNTDOWN( local, index )     ( LOCAL_PAGE( local, index )->countdown[LOCAL_SLOT( index )] )
+#define PAGE_UNSAMPLED( page, index )       ( ( page )->unsampled[LOCAL_SLOT( index )] )
+#define LOCAL_META( local, index )          ( &LOCAL_PAGE( local, index )->meta[LOCAL_SLOT( index )] )
 #else
-        if( !current->deletable && !current->inactive )
+#define LOCAL_CALL_CNT( local, index )      ( LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )].call_cnt )
+#define LOCAL_SAMPLED_CNT( local, index )   ( LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )].sampled_cnt )
+#define LOCAL_DURATION( local, index )      ( LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )].duration )
+#define LOCAL_EXCLUSIVE( local, index )     ( LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )].exclusive_duration )
+#define LOCAL_DEPTH( local, index )         ( LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )].depth )
+#define LOCAL_COUNTDOWN( local, index )     ( LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )].countdown )
+#define PAGE_UNSAMPLED( page, index )       ( ( page )->regions[LOCAL_SLOT( index )].unsampled )
+#define LOCAL_META( local, index )          ( &LOCAL_PAGE( local, index )->regions[LOCAL_SLOT( index )] )
 #endif
-        {
-            new_duration += current->mean_duration;
-            ctr++;
-        }
-    }
+#define LOCAL_UNSAMPLED( local, index )     PAGE_UNSAMPLED( LOCAL_PAGE( local, index ), index )
 
-    mean_duration = new_duration / ctr;
-}
+/** Only every sampling_interval-th activation of a region per thread is timed */
+static uint32_t sampling_interval = 1;
+
+/** Number of threads currently observed (without the main thread) */
+static uint32_t num_threads = 0;
 
 /**
- * Overrides a callq at the given position with a five byte NOP.
+ * Growable registry of the thread local infos of all locations but the main thread.
  *
- * By calling mprotect right before and after writing the NOP this function ensures that the correct
- * part of the TXT segment is writable and it's only writable as long as needed.
- *
- * @param   ptr                             Position of the callq to override.
+ * Like the region vectors, a registry is never resized in place but replaced by a bigger copy, so
+ * the main thread can walk it without locking while locations are created. The infos themselves are
+ * never moved or freed before the plugin is finalized. The slots of deleted locations are recycled,
+ * but only after no walk can still see their stacks and tables anymore (see location_reclaim).
  */
-static void override_callq( char*                                             ptr )
+typedef struct location_registry
 {
-    // Get the page size of the system we're running on.
-    int page_size = sysconf( _SC_PAGE_SIZE );
-    // The callq may be splitted onto two different pages and mprotect changes access permissions
-    // on a per page basis, so we need to change the access permission on the pages where the first
-    // and the last byte of the callq reside.
-    void* first_ptr = ptr - ( (unsigned long) ptr % page_size );
-    void* second_ptr = ( ptr + 4 ) - ( (unsigned long) ( ptr + 4 ) % page_size );
+    /** Previously published registry (retired list) */
+    struct location_registry* retired;
+    /** Number of used slots */
+    uint32_t size;
+    /** Number of allocated slots */
+    uint32_t capacity;
+    /** The slots themselves */
+    local_info* slot[];
+} location_registry;
 
-    // Add the write permission.
-    if( mprotect( first_ptr, page_size, PROT_READ | PROT_WRITE | PROT_EXEC ) != 0
-     || mprotect( second_ptr, page_size, PROT_READ | PROT_WRITE | PROT_EXEC ) != 0 )
-    {
-        fprintf( stderr,  "Could not add write permission to memory access rights on position "
-                          "%p", ptr );
-    }
-    // Finally write that NOP.
-    const char nop[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
-    memmove( ptr, nop, sizeof( char ) * 5 );
+/** The registry of thread local infos */
+static location_registry* locations = NULL;
 
-    // Remove the write permission.
-    if( mprotect( first_ptr, page_size, PROT_READ | PROT_EXEC ) != 0
-     || mprotect( second_ptr, page_size, PROT_READ | PROT_EXEC ) != 0 )
-    {
-        fprintf( stderr,  "Could not remove write permission to memory access rights on position "
-                          "%p", ptr );
-    }
-}
+/** Slots of deleted locations, ready for reuse (protected by num_threads_mtx) */
+static uint32_t* free_slots = NULL;
+
+/** Number of entries in free_slots */
+static uint32_t free_slot_cnt = 0;
+
+/** Capacity of free_slots */
+static uint32_t free_slot_capacity = 0;
 
 /**
- * Checks which instrumentation call is used in the binary.
- *
- * Walks down the call path and searches for all known instrumentation functions (enter functions,
- * as this one should be called within a enter instrumentation call). The type found is stored for
- * later use in get_function_call_ip.
+ * A deleted location whose stack and tables might still be read by a walk of the registry.
  */
-static void get_instrumentation_call_type( )
+typedef struct retired_location
 {
-    unw_cursor_t cursor;
-    unw_context_t uc;
-    unw_word_t offset;
-    char sym[256];
+    /** Slot of the location in the registry */
+    uint32_t slot;
+    /** Shadow call stack of the location */
+    shadow_frame* stack;
+} retired_location;
 
-    unw_getcontext( &uc );
-    unw_init_local( &cursor, &uc );
+/** Deleted locations waiting for location_reclaim (protected by num_threads_mtx) */
+static retired_location* retired_locations = NULL;
 
-    // Step up the call path...
-    while( unw_step( &cursor ) > 0 )
-    {
-        // ... and check the function name against all know instrumentation call names.
-        unw_get_proc_name( &cursor, sym, sizeof( sym ), &offset );
+/** Number of entries in retired_locations */
+static uint32_t retired_location_cnt = 0;
 
-        if( strncmp( sym, "__cyg_profile_func_enter", 24 ) == 0 )
-        {
-            enter_func = "__cyg_profile_func_enter";
-            exit_func = "__cyg_profile_func_exit";
-            return;
-        }
-        else if( strncmp( sym, "scorep_plugin_enter_region", 26 ) == 0 )
-        {
-            enter_func = "scorep_plugin_enter_region";
-            exit_func = "scorep_plugin_exit_region";
-            return;
-        }
-        else if( strncmp( sym, "__VT_IntelEntry", 15 ) == 0 )
-        {
-            enter_func = "__VT_IntelEntry";
-            exit_func = "__VT_IntelExit";
-            return;
-        }
-    }
-}
+/** Capacity of retired_locations */
+static uint32_t retired_location_capacity = 0;
+
+/** Costs of the plugin on already deleted locations (protected by num_threads_mtx) */
+static plugin_stats retired_stats;
+
+/** Thread local info of the calling thread, NULL for the main thread and unobserved threads */
+static __thread local_info* current_local = NULL;
 
 /**
- * Returns the instruction pointer for the given function.
+ * Iterates over all slots of the location registry, including the ones of deleted locations.
  *
- * This method walks down the call path and tries to find a function with the given name and
- * returns a pointer for the first byte of the call to this function in the current call path.
- * Note that only the first (beginning from the innermost function) occurrence of the function call
- * will be handled.
- *
- * @param   function_name                   The function to look up.
+ * @param   current                         Variable of type local_info* holding the current info.
+ */
+#define LOCATION_ITER( current )                                                                  \
+    for( location_registry* _registry = __atomic_load_n( &locations, __ATOMIC_ACQUIRE );          \
+         _registry != NULL; _registry = NULL )                                                    \
+        for( uint32_t _i = 0, _size = __atomic_load_n( &_registry->size, __ATOMIC_ACQUIRE );      \
+             _i < _size && ( current = _registry->slot[_i], true ); ++_i )
+
+/**
+ * Region info of the main thread.
  *
- * @return                                  Pointer to the first byte of the call to the given
- *                                          function in the current call path.
+ * Only the main thread reads and writes this (in the event handlers, on_join and delete_regions),
+ * so it needs no synchronization. It grows on demand as new regions are entered.
  */
-static bool printed_warning;
+static local_info main_info;
+
+/** Regions merged by the running on_join */
+static region_info** joined_regions = NULL;
+
+/** Capacity of joined_regions */
+static size_t joined_capacity = 0;
+
+/** Special mutex used for protecting the thread counter */
+static pthread_mutex_t thread_ctr_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-#define DISPLACEMENT(JMPQ_ADDRESS) \
-    (((int64_t) JMPQ_ADDRESS[4])<<24 | ((int64_t) JMPQ_ADDRESS[3])<<16 | ((int64_t) JMPQ_ADDRESS[2])<<8 | ((int64_t) JMPQ_ADDRESS[1]))
+/** Special mutex used for protecting the number of threads */
+static pthread_mutex_t num_threads_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/** Thread counter */
+static uint64_t thread_ctr = 0;
 
-static char* get_function_call_ip( int is_enter )
+/**
+ * Metrics used to decide whether a region gets filtered.
+ */
+typedef enum filtering_method
 {
-    unw_cursor_t cursor;
-    unw_context_t uc;
-    unw_word_t ip;
+    /** Filter regions with a mean duration below the threshold */
+    FILTERING_ABSOLUTE,
+    /** Filter regions with a mean duration below the mean of all regions minus the threshold */
+    FILTERING_RELATIVE,
+    /** Filter regions with a mean exclusive duration below cost_factor per call costs */
+    FILTERING_EXCLUSIVE,
+    /** Filter the regions with the shortest mean duration until the overhead fits overhead_budget */
+    FILTERING_BUDGET
+} filtering_method;
 
-    unw_getcontext( &uc );
-    unw_init_local( &cursor, &uc );
+/** The filtering method to be used */
+static filtering_method method = FILTERING_ABSOLUTE;
 
-    unsigned char * target_address_scorep = dlsym(RTLD_DEFAULT, is_enter? enter_func:exit_func );
+/** Threshold for filtering */
+static unsigned long long threshold = 100000;
 
-    // Step up the call path...
-    while( unw_step( &cursor ) > 0 )
-    {
-        unw_get_reg( &cursor, UNW_REG_IP, &ip );
+/** Number of frames of the per thread shadow call stacks */
+static uint32_t stack_size = 4096;
 
-        unsigned char* assumed= (unsigned char*) ( ip - 5 );
-        unsigned char * jmp_adr =(unsigned char*) (DISPLACEMENT(assumed));
-        if (jmp_adr+(ip) == target_address_scorep )
-            return (char*) assumed;
+/** Whether to gather the exclusive durations of the regions */
+static bool exclusive_time;
 
-    }
+/** Ratio of exclusive duration to per call costs below which regions are filtered */
+static float cost_factor = 10;
 
-    // This shouldn't happen, if we're on this point, we tried to delete a function not present in
-    // the current call path. We return zero in this case because delete_regions wont try to delete
-    // this call in this case and we get no undefined behaviour.
-    return (char*) 0;
-}
+/** Number of timed calls after which a region with only short activations is filtered, 0 if unset */
+static uint64_t early_calls = 0;
+
+/** Share of the cut-off the first early_calls activations of a region have to stay below */
+static float early_fraction = 0.1;
 
 /**
- * Remove all unwanted regions.
+ * Measured costs of one instrumented call in Score-P ticks.
  *
- * This function iterates over all regions and deletes all of them that are marked as deletable. The
- * iteration over the elements isn't guarded by locks because the program's semantic ensures that
- * this function is only called when there's only one thread present.
+ * This is the shortest leaf activation seen by any thread, as an empty instrumented function takes
+ * about as long as its instrumentation. It's merged from the worker threads in on_join.
  */
-static void delete_regions( )
-{
-    region_info *current, *tmp;
+static uint64_t call_cost = UINT64_MAX;
 
-    HASH_ITER( hh, regions, current, tmp )
-    {
-        // Only delete the function calls if the region is marked as deletable, the address of the
-        // entry function call and the address of the exit function call are correctly set and the
-        // call stack depth for the function is zero (we're not currently in a recursive call of
-        // that function).
-        if( !current->inactive
-            && current->deletable
-            && current->depth == 0
-            && !( current->enter_func == 0 || current->exit_func == 0 ) )
-        {
-            override_callq( current->enter_func );
-            override_callq( current->exit_func );
-            current->inactive = true;
-#ifdef DYNAMIC_FILTERING_DEBUG
-            fprintf( stderr, "Deleted instrumentation calls for region %s!\n",
-                                                                        current->region_name );
-#endif
-        }
-    }
-}
+/** Fixed per call costs given by the user (0 = measure them) */
+static uint64_t fixed_call_cost = 0;
 
-/**
- * Team begin event.
- *
- * As long as there's multithreaded execution, there's no safe way to filter functions. So we've to
- * notice the begin of a multithreaded part of execution to stop filtering.
- *
- * @param   scorep_location                 unused
- * @param   timestamp                       unused
- * @param   scorep_paradigm                 unused
- * @param   scorep_thread_team              unused
- */
-static void on_team_begin( __attribute__((unused)) struct SCOREP_Location*          scorep_location,
-                           __attribute__((unused)) uint64_t                         timestamp,
-                           __attribute__((unused)) SCOREP_ParadigmType              scorep_paradigm,
-                           __attribute__((unused)) SCOREP_InterimCommunicatorHandle scorep_thread_team )
-{
-    if (printed_warning && !continue_despite) return;
-    pthread_mutex_lock( &thread_ctr_mtx );
-    thread_ctr++;
-    pthread_mutex_unlock( &thread_ctr_mtx );
-}
+/** Number of calls timed by calibrate_call_cost */
+#define CALIBRATION_CALLS 4096
 
-/**
- * Team end event.
- *
- * See on_team_begin.
- *
- * @param   scorep_location                 unused
- * @param   timestamp                       unused
- * @param   scorep_paradigm                 unused
- * @param   scorep_thread_team              unused
- */
-static void on_team_end( __attribute__((unused)) struct SCOREP_Location*            scorep_location,
-                         __attribute__((unused)) uint64_t                           timestamp,
-                         __attribute__((unused)) SCOREP_ParadigmType                scorep_paradigm,
-                         __attribute__((unused)) SCOREP_InterimCommunicatorHandle   scorep_thread_team )
-{
-    if (printed_warning && !continue_despite) return;
-    pthread_mutex_lock( &thread_ctr_mtx );
-    thread_ctr--;
-    pthread_mutex_unlock( &thread_ctr_mtx );
-}
+/** Number of exits of the main thread between two calls of update_budget_threshold */
+#define BUDGET_CHECK_EVENTS 1024
 
-/**
- * Thread join event.
- *
- * This is emitted when all threads finished on_team_end. As all information is gathered in the
- * global storage, the main thread can recalculate the metrics.
- *
- * @param scorep_location                   unused
- * @param timestamp                         unused
- * @param scorep_paradigm                   unused
- */
-void on_join( __attribute__((unused)) struct SCOREP_Location*                       scorep_location,
-              __attribute__((unused)) uint64_t                                      timestamp,
-              __attribute__((unused)) SCOREP_ParadigmType                           paradigm_type )
-{
-    if (printed_warning && !continue_despite) return;
-    region_info *to_change, *tmp;
+/** Costs of the plugin's own bookkeeping per instrumented call in CPU cycles, see calibrate_call_cost */
+static uint64_t calibrated_cycles = 0;
 
-    // Recalculate all filter decisions.
-    HASH_ITER( hh, regions, to_change, tmp )
-    {
-        uint32_t border = num_threads > MAX_THREAD_CNT ? MAX_THREAD_CNT : num_threads;
+/** Share of the runtime the instrumentation may take with the budget method, in percent */
+static float overhead_budget = 5;
 
+/** Mean duration below which the budget method filters regions, only ever raised */
+static float budget_threshold = 0;
 
-        // Combine the locally gathered information with the global ones.
-        for( uint32_t i = 0; i < border; ++i )
-        {
-            local_region_info* local;
-            HASH_FIND( hh, local_info_array[i], &to_change->region_handle,
-                                                                    sizeof( uint32_t ), local );
+/** Estimated share of the runtime taken by the instrumentation at the last budget check */
+static double budget_overhead = 0;
 
-            if( local != NULL )
-            {
-                to_change->call_cnt += local->call_cnt;
-                local->call_cnt = 0;
-                to_change->duration += local->duration;
-                local->duration = 0;
+/** Timestamp of the first event of the main thread seen by the budget method */
+static uint64_t budget_start = 0;
 
-                if( to_change->enter_func == 0 && local->enter_func != 0 )
-                {
-                    to_change->enter_func = local->enter_func;
-                }
+/** Cycle counter at budget_start, used for converting calibrated_cycles into Score-P ticks */
+static uint64_t budget_start_cycles = 0;
 
-                if( to_change->exit_func == 0 && local->exit_func != 0 )
-                {
-                    to_change->exit_func = local->exit_func;
-                }
-                if ( !to_change->optimized && local->optimized )
-                {
-                    to_change->optimized = true;
-                }
-            }
+/** Timestamp of the next budget check */
+static uint64_t budget_next_check = 0;
+
+/** Exits of the main thread left until update_budget_threshold is called again */
+static uint32_t budget_countdown = 1;
+
+/** Candidates of the budget check */
+static region_info** budget_regions = NULL;
+
+/** Number of entries fitting into budget_regions */
+static size_t budget_capacity = 0;
+
+/** Mean duration across all regions */
+static float mean_duration = 0;
+
+/** Sum of the mean durations of all regions being part of mean_duration */
+static double mean_duration_sum = 0;
+
+/** Number of regions being part of mean_duration */
+static uint64_t mean_duration_cnt = 0;
+
+/** Number of calls of a region between two evaluations of its filter criteria (0 = unused) */
+static uint64_t eval_interval = 0;
+
+/** Score-P ticks between two evaluations of the filter criteria of a region (0 = unused) */
+static uint64_t eval_time = 0;
+
+/**
+ * Queue of regions marked as deletable, but not yet deleted.
+ *
+ * The regions are linked via region_info.next_pending. The queue is only accessed by the main
+ * thread, which marks regions as deletable and deletes them.
+ */
+static region_info* pending_head = NULL;
+
+/** Tail of the queue of pending deletions */
+static region_info** pending_tail = &pending_head;
+
+/** Regions other threads hand over to the queue of pending deletions, linked via
+    region_info.next_pending as well (see hand_over_pending) */
+static region_info* handed_over = NULL;
+
+/** Flag indicating that this current thread is the main thread */
+static __thread bool main_thread = false;
+
+/** Upper end of the calling thread's stack, 0 until looked up by get_stack_end */
+static __thread uintptr_t stack_end = 0;
+
+/** Internal substrates id */
+static size_t id;
+
+/** Internal substrates callbacks for information retrieval about handles */
+static const SCOREP_SubstratePluginCallbacks* callbacks;
+
+/**
+ * A pair of instrumentation calls, i.e. the functions called on entering and exiting a region.
+ */
+typedef struct instrumentation_call
+{
+    /** Name of the enter region instrumentation call */
+    const char* enter_name;
+    /** Name of the exit region instrumentation call */
+    const char* exit_name;
+    /** Address of the enter region instrumentation call, resolved in init */
+    unsigned char* enter_target;
+    /** Address of the exit region instrumentation call, resolved in init */
+    unsigned char* exit_target;
+} instrumentation_call;
+
+/** All known instrumentation calls */
+static instrumentation_call instrumentation_calls[] =
+{
+    { "__cyg_profile_func_enter", "__cyg_profile_func_exit", NULL, NULL },
+    { "scorep_plugin_enter_region", "scorep_plugin_exit_region", NULL, NULL },
+    { "__VT_IntelEntry", "__VT_IntelExit", NULL, NULL }
+};
+
+/** Number of known instrumentation calls */
+#define INSTRUMENTATION_CALL_CNT ( sizeof( instrumentation_calls ) / sizeof( instrumentation_calls[0] ) )
+
+/** The instrumentation calls used in this binary (see get_instrumentation_call_type) */
+static instrumentation_call* used_call = NULL;
+
+/** Maximum number of tail calls of one function found by find_tail_call_sites */
+#define MAX_TAIL_CALL_SITES 8
+
+/** Maximum number of exit calls of one function found by find_exit_call_sites */
+#define MAX_EXIT_CALL_SITES 64
+
+/** Number of frames checked by the frame pointer based call site discovery */
+#define FAST_DISCOVERY_DEPTH 16
+
+
+/** Generation of the module registry the call sites have been checked against last */
+static uint64_t checked_generation = 0;
+
+/** Generation of the module registry plus one in which get_instrumentation_call_type failed */
+static uint64_t call_type_missed_generation = 0;
+
+/** Whether the call sites are looked up in the call site index (see callsite-index.h) */
+static bool use_callsite_index;
+
+/** Whether the frame pointer based call site discovery is used */
+static bool fast_discovery = true;
+
+/** Number of call sites found by the frame pointer based discovery */
+static uint32_t fast_discovery_hits = 0;
+
+/** Number of call sites only found by the libunwind based discovery */
+static uint32_t fast_discovery_misses = 0;
+
+/** Whether to create an optimization report */
+static bool create_report;
+
+/** Number of mprotect calls (only counted if create_report is set) */
+static uint64_t stat_mprotect_calls = 0;
+
+/** Number of overridden call sites */
+static uint64_t stat_patched_sites = 0;
+
+/** Number of overridden bytes */
+static uint64_t stat_patched_bytes = 0;
+
+/** Number of regions marked as deletable by the early rule */
+static uint64_t stat_early_regions = 0;
+
+/** Number of call sites dropped because their object has been unloaded */
+static uint64_t stat_dropped_sites = 0;
+
+/** Number of merges in on_join */
+static uint64_t stat_joins = 0;
+
+/** Cycles spent merging in on_join */
+static uint64_t stat_join_cycles = 0;
+
+/** Timestamps of the first and last event of the main thread, bound the estimated avoided costs */
+static uint64_t stat_first_timestamp = 0;
+static uint64_t stat_last_timestamp = 0;
+
+/** Whether to write a filter file */
+static bool create_filter;
+
+/**
+ * Output formats of the report.
+ */
+typedef enum report_format
+{
+    /** ASCII tables written to stderr */
+    REPORT_TABLE,
+    /** One CSV line per region, written to the experiment directory */
+    REPORT_CSV,
+    /** Regions and plugin statistics as JSON object, written to the experiment directory */
+    REPORT_JSON
+} report_format;
+
+/** Output format of the report */
+static report_format output_format = REPORT_TABLE;
+
+/** Whether all ranks agree on one filter file, see on_pre_unify */
+static bool consensus;
+
+/** Number of slots the region statistics are reduced into, regions whose names hash to the same
+    slot share their decision (see reduce_consensus) */
+static uint32_t consensus_slot_cnt = 65536;
+
+/** Flag of consensus_flags: a region of the slot has been deleted by a rank */
+#define CONSENSUS_DELETED 1u
+
+/** Flag of consensus_flags: a region of the slot is optimized beyond repair on a rank */
+#define CONSENSUS_OPTIMIZED 2u
+
+/** Flag of consensus_flags: rank 0 knows a region of the slot, so it knows a name for it */
+#define CONSENSUS_ON_ROOT 4u
+
+/** Sampled calls, durations and exclusive durations per slot, reduced over all ranks */
+static uint64_t* consensus_sums = NULL;
+
+/** Flags per slot, reduced over all ranks */
+static uint32_t* consensus_flags = NULL;
+
+/** Marks the slots excluded by the latest reduction, the same on all ranks */
+static bool* consensus_excluded = NULL;
+
+/** Names of the regions excluded by the consensus, sorted (rank 0 only, see on_pre_unify) */
+static char** consensus_names = NULL;
+
+/** Number of entries in consensus_names */
+static size_t consensus_name_cnt = 0;
+
+/** Marks whether the consensus has been reached, the filter file is then written by rank 0 only */
+static bool consensus_done = false;
+
+/** Number of collectives on MPI_COMM_WORLD between two exchanges of the statistics during the run,
+    0 for only agreeing on the filter file at the end (see on_mpi_collective_end) */
+static uint64_t consensus_interval = 0;
+
+/** Number of interim communicators whose definition order is kept, see on_mpi_collective_end */
+#define EARLY_COMMUNICATOR_CNT 64
+
+/** The first interim communicators in the order of their definition, of any paradigm */
+static SCOREP_InterimCommunicatorHandle early_comms[EARLY_COMMUNICATOR_CNT];
+
+/** Number of interim communicators defined so far */
+static uint32_t early_comm_cnt = 0;
+
+/** Position of the communicator of MPI_COMM_WORLD in early_comms, EARLY_COMMUNICATOR_CNT while it
+    isn't known (main thread only, see on_mpi_collective_end) */
+static uint32_t world_position = EARLY_COMMUNICATOR_CNT;
+
+/** Number of collectives on MPI_COMM_WORLD until the next exchange (main thread only) */
+static uint64_t consensus_countdown = 0;
+
+/** First address of the binary, the filter cache stores call sites relative to it */
+static unsigned long long base_pointer;
+
+/** Path of the persistent filter cache (see filter-cache.h), NULL if it isn't used */
+static const char* cache_file = NULL;
+
+/** State of the entries of the loaded filter cache: deleted on startup */
+#define CACHE_APPLIED 1
+
+/** State of the entries of the loaded filter cache: region has been defined */
+#define CACHE_SEEN 2
+
+/** States of the entries of the loaded filter cache */
+static unsigned char* cache_state = NULL;
+
+/** Number of entries of the loaded filter cache */
+static size_t cache_entry_cnt = 0;
+
+/** Page size of the system we're running on */
+static uintptr_t page_size;
+
+/** Whether call sites may be patched while other threads are running */
+static bool concurrent_patching;
+
+/** membarrier command used to serialize all cores after modifying code (0 = none) */
+static int membarrier_cmd = 0;
+
+/** Number of the grace period started last */
+static uint32_t grace_generation = 0;
+
+/** Number of the grace period completed last */
+static uint32_t grace_completed = 0;
+
+/** Number of the grace period needed by the regions whose enter call was deleted last */
+static uint32_t grace_needed = 0;
+
+/** Whether a grace period is currently running */
+static bool grace_running = false;
+
+/** Number of registry slots when the current grace period started */
+static uint32_t grace_threads = 0;
+
+/** Event counters of all registry slots when the current grace period started */
+static uint64_t* grace_snapshot = NULL;
+
+/** Capacity of grace_snapshot */
+static uint32_t grace_snapshot_capacity = 0;
+
+/**
+ * A call site queued for being overridden.
+ *
+ * Calls (e8) are replaced by a NOP of the same length. Tail calls, i.e. jumps (e9) or indirect jumps
+ * through the GOT (ff 25) to the exit instrumentation call, are replaced by a ret followed by a NOP.
+ * Restored call sites get their original instruction back, see saved_callq.
+ */
+typedef struct callq_patch
+{
+    /** Position of the call site */
+    char* ptr;
+    /** Length of the instruction */
+    unsigned char len;
+    /** The new instruction */
+    unsigned char code[6];
+    /** Whether the old or the new instruction is a ret, so the bytes behind are never executed */
+    bool ret;
+} callq_patch;
+
+/**
+ * The original instruction of an overridden call site.
+ *
+ * Saved when the call site is overridden for the first time, so its instrumentation can be
+ * restored later on (see scorep_dynamic_filtering_restore).
+ */
+typedef struct saved_callq
+{
+    /** Position of the call site */
+    char* ptr;
+    /** Length of the instruction */
+    unsigned char len;
+    /** The original instruction */
+    unsigned char code[6];
+} saved_callq;
+
+/** Original instructions of all overridden call sites, sorted by their position */
+static saved_callq* saved_callqs = NULL;
+
+/** Number of entries in saved_callqs */
+static size_t saved_callq_cnt = 0;
+
+/** Number of entries fitting into saved_callqs */
+static size_t saved_callq_capacity = 0;
+
+/** Guards the restore requests, which may come from any thread */
+static pthread_mutex_t restore_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/** Names of the regions to be restored */
+static char** restore_names = NULL;
+
+/** Number of entries in restore_names */
+static size_t restore_name_cnt = 0;
+
+/** Number of entries fitting into restore_names */
+static size_t restore_name_capacity = 0;
+
+/** Marks whether all deleted regions should be restored (also set by the restore signal) */
+static bool restore_all = false;
+
+/** Marks whether there are restore requests, checked by the main thread before taking them */
+static bool restore_pending = false;
+
+/** The plugin opened once more with RTLD_GLOBAL, so that the application can look up
+    scorep_dynamic_filtering_restore with dlsym( RTLD_DEFAULT, ... ) */
+static void* global_handle = NULL;
+
+/** Number of main thread exits between two checks whether waiting regions can be restored */
+#define RESTORE_RETRY_EVENTS 1024
+
+/** Requested regions that haven't been restored yet, because they might still be active (only used
+    by the main thread, see restore_waiting_regions) */
+static region_info** restore_waiting = NULL;
+
+/** Number of entries in restore_waiting */
+static size_t restore_waiting_cnt = 0;
+
+/** Number of entries fitting into restore_waiting */
+static size_t restore_waiting_capacity = 0;
+
+/** Marks whether the next pass of delete_regions checks the waiting regions */
+static bool restore_retry = false;
+
+/** Number of main thread exits until the waiting regions are checked again */
+static uint32_t restore_countdown = RESTORE_RETRY_EVENTS;
+
+/** Number of regions whose instrumentation has been restored */
+static uint64_t stat_restored_regions = 0;
+
+/** Callqs queued for being overridden */
+static callq_patch* patch_batch = NULL;
+
+/** Number of queued callqs */
+static size_t patch_batch_size = 0;
+
+/** Number of callqs fitting into patch_batch */
+static size_t patch_batch_capacity = 0;
+
+/**
+ * Makes sure the given vector has at least the given capacity.
+ *
+ * If the vector is too small, a bigger copy is published in its place and the old vector is put on
+ * the retired list. Vectors are only replaced from on_define_region, which is serialized by Score-P.
+ *
+ * @param   vector                          The vector to enlarge.
+ * @param   capacity                        The minimum number of slots needed.
+ * @param   limit                           The maximum number of slots to allocate.
+ */
+static void region_vector_reserve( region_vector**                                  vector,
+                                   uint32_t                                         capacity,
+                                   uint32_t                                         limit )
+{
+    region_vector* old = *vector;
+    if( old != NULL && old->capacity >= capacity )
+    {
+        return;
+    }
+
+    uint64_t new_capacity = old == NULL ? 1024 : old->capacity;
+    while( new_capacity < capacity )
+    {
+        new_capacity *= 2;
+    }
+    if( new_capacity > limit )
+    {
+        new_capacity = limit;
+    }
+
+    region_vector* new = calloc( 1, sizeof( region_vector ) + new_capacity * sizeof( region_info* ) );
+    if( old != NULL )
+    {
+        new->size = old->size;
+        memcpy( new->slot, old->slot, old->capacity * sizeof( region_info* ) );
+    }
+    new->capacity = new_capacity;
+    new->retired = old;
+
+    __atomic_store_n( vector, new, __ATOMIC_RELEASE );
+}
+
+/**
+ * Returns the number of regions defined so far.
+ */
+static inline uint32_t region_count( void )
+{
+    region_vector* list = __atomic_load_n( &region_list, __ATOMIC_ACQUIRE );
+    return list == NULL ? 0 : __atomic_load_n( &list->size, __ATOMIC_ACQUIRE );
+}
+
+/**
+ * Iterates over all regions defined so far in definition order.
+ *
+ * @param   current                         Variable of type region_info* holding the current
+ *                                          region.
+ */
+#define REGION_ITER( current )                                                                    \
+    for( uint32_t _i = 0, _size = region_count( );                                                \
+         _i < _size                                                                               \
+         && ( current = __atomic_load_n( &region_list, __ATOMIC_ACQUIRE )->slot[_i], true );      \
+         ++_i )
+
+/**
+ * Returns the first slot to probe for the given handle.
+ *
+ * Region handles are offsets into Score-P's memory and share their alignment, so the value of
+ * HASH_FUNCTION is scrambled by a multiplication before the slot is taken from its upper bits.
+ *
+ * @param   hash                            The hash to probe.
+ * @param   handle                          The region handle.
+ *
+ * @return                                  Index of the first slot.
+ */
+static inline uint32_t region_hash_start( const region_hash*                        hash,
+                                          uint32_t                                  handle )
+{
+    unsigned hashv;
+    HASH_FUNCTION( &handle, sizeof( uint32_t ), hashv );
+    return (uint32_t) ( ( (uint64_t) (uint32_t) hashv * 0x9E3779B97F4A7C15ull ) >> 32 )
+           & ( hash->capacity - 1 );
+}
+
+/**
+ * Looks up the region with the given handle in the given hash.
+ *
+ * Doesn't need any lock, see region_hash.
+ *
+ * @param   hash                            The hash to search.
+ * @param   handle                          The region handle.
+ *
+ * @return                                  The region info or NULL if the region is unknown.
+ */
+static inline region_info* region_hash_find( const region_hash*                     hash,
+                                             uint32_t                               handle )
+{
+    for( uint32_t i = region_hash_start( hash, handle );; i = ( i + 1 ) & ( hash->capacity - 1 ) )
+    {
+        region_info* region = __atomic_load_n( &hash->slot[i].region, __ATOMIC_ACQUIRE );
+        if( region == NULL || hash->slot[i].handle == handle )
+        {
+            return region;
+        }
+    }
+}
+
+/**
+ * Stores the given region in a free slot of the given hash.
+ *
+ * @param   hash                            The hash, needs a free slot.
+ * @param   handle                          The region handle.
+ * @param   region                          The region.
+ */
+static void region_hash_insert( region_hash*                                        hash,
+                                uint32_t                                            handle,
+                                region_info*                                        region )
+{
+    uint32_t i = region_hash_start( hash, handle );
+    while( hash->slot[i].region != NULL )
+    {
+        i = ( i + 1 ) & ( hash->capacity - 1 );
+    }
+    hash->slot[i].handle = handle;
+    __atomic_store_n( &hash->slot[i].region, region, __ATOMIC_RELEASE );
+    hash->size++;
+}
+
+/**
+ * Adds the given region to the regions hash.
+ *
+ * If the hash would be more than half full, a copy with twice the slots is published in its place
+ * and the old hash is put on the retired list. Like the region vectors, the hash is only changed
+ * from on_define_region.
+ *
+ * @param   region                          The region, its handle must not be in the hash yet.
+ */
+static void region_hash_add( region_info*                                           region )
+{
+    region_hash* old = regions;
+    if( old == NULL || 2 * ( (uint64_t) old->size + 1 ) > old->capacity )
+    {
+        uint32_t capacity = old == NULL ? 1024 : 2 * old->capacity;
+        region_hash* new = calloc( 1, sizeof( region_hash ) + capacity * sizeof( region_hash_slot ) );
+        new->capacity = capacity;
+        new->retired = old;
+        for( uint32_t i = 0; old != NULL && i < old->capacity; ++i )
+        {
+            if( old->slot[i].region != NULL )
+            {
+                region_hash_insert( new, old->slot[i].handle, old->slot[i].region );
+            }
+        }
+        __atomic_store_n( &regions, new, __ATOMIC_RELEASE );
+    }
+    region_hash_insert( regions, region->region_handle, region );
+}
+
+/**
+ * Frees the regions hash and all hashes on its retired list.
+ */
+static void region_hash_free( void )
+{
+    while( regions != NULL )
+    {
+        region_hash* retired = regions->retired;
+        free( regions );
+        regions = retired;
+    }
+}
+
+/**
+ * Looks up the region info for the given handle.
+ *
+ * Region handles below DENSE_REGION_LIMIT just need one bounds check and one load from the dense
+ * table, only the others fall back to the regions hash. Neither needs a lock, so lookups may run
+ * while another thread defines a region.
+ *
+ * @param   handle                          The region handle to look up.
+ *
+ * @return                                  The region info or NULL if the region is unknown.
+ */
+static inline region_info* lookup_region( uint32_t                                  handle )
+{
+    if( handle < DENSE_REGION_LIMIT )
+    {
+        const region_vector* table = __atomic_load_n( &region_table, __ATOMIC_ACQUIRE );
+        return table != NULL && handle < table->capacity ? table->slot[handle] : NULL;
+    }
+
+    const region_hash* hash = __atomic_load_n( &regions, __ATOMIC_ACQUIRE );
+    return hash != NULL ? region_hash_find( hash, handle ) : NULL;
+}
+
+/**
+ * Checks whether the given handle might belong to a compiler region.
+ *
+ * This is a single bit test for handles below DENSE_REGION_LIMIT, so the events of all other
+ * paradigms are dropped without calling into Score-P. Handles beyond are left to lookup_region.
+ *
+ * @param   handle                          The region handle to check.
+ *
+ * @return                                  False if the handle is known not to be a compiler region.
+ */
+static inline bool is_compiler_region( uint32_t                                     handle )
+{
+    if( handle >= DENSE_REGION_LIMIT )
+    {
+        return true;
+    }
+    const handle_bitmap* bitmap = __atomic_load_n( &compiler_regions, __ATOMIC_ACQUIRE );
+    return bitmap != NULL && handle / 64 < bitmap->word_cnt
+           && ( __atomic_load_n( &bitmap->word[handle / 64], __ATOMIC_ACQUIRE ) >> ( handle % 64 ) & 1 );
+}
+
+/**
+ * Marks the given handle as a compiler region.
+ *
+ * Like the region vectors, the bitmap is only replaced from on_define_region.
+ *
+ * @param   handle                          The region handle, has to be below DENSE_REGION_LIMIT.
+ */
+static void mark_compiler_region( uint32_t                                          handle )
+{
+    handle_bitmap* old = compiler_regions;
+    if( old == NULL || handle / 64 >= old->word_cnt )
+    {
+        uint32_t word_cnt = old == NULL ? 64 : old->word_cnt;
+        while( word_cnt <= handle / 64 )
+        {
+            word_cnt *= 2;
+        }
+        handle_bitmap* new = calloc( 1, sizeof( handle_bitmap ) + word_cnt * sizeof( uint64_t ) );
+        if( old != NULL )
+        {
+            memcpy( new->word, old->word, old->word_cnt * sizeof( uint64_t ) );
+        }
+        new->word_cnt = word_cnt;
+        new->retired = old;
+        __atomic_store_n( &compiler_regions, new, __ATOMIC_RELEASE );
+    }
+    __atomic_fetch_or( &compiler_regions->word[handle / 64], (uint64_t) 1 << ( handle % 64 ),
+                       __ATOMIC_RELEASE );
+}
+
+/**
+ * Frees the bitmap of compiler regions and all bitmaps on its retired list.
+ */
+static void handle_bitmap_free( void )
+{
+    while( compiler_regions != NULL )
+    {
+        handle_bitmap* retired = compiler_regions->retired;
+        free( compiler_regions );
+        compiler_regions = retired;
+    }
+}
+
+/**
+ * Frees the given vector and all vectors on its retired list.
+ *
+ * @param   vector                          The vector to free.
+ */
+static void region_vector_free( region_vector*                                      vector )
+{
+    while( vector != NULL )
+    {
+        region_vector* retired = vector->retired;
+        free( vector );
+        vector = retired;
+    }
+}
+
+/**
+ * Allocates an array of call sites from the site arena.
+ *
+ * The arena only grows, arrays being replaced by bigger ones are freed with the whole arena in
+ * finalize.
+ *
+ * @param   cnt                             Number of call sites.
+ *
+ * @return                                  The array.
+ */
+static char** site_arena_alloc( size_t                                              cnt )
+{
+    if( site_arena == NULL || site_arena->used + cnt > site_arena->capacity )
+    {
+        size_t capacity = cnt > SITE_ARENA_BLOCK_SIZE ? cnt : SITE_ARENA_BLOCK_SIZE;
+        site_arena_block* block = malloc( sizeof( site_arena_block ) + capacity * sizeof( char* ) );
+        block->next = site_arena;
+        block->used = 0;
+        block->capacity = capacity;
+        site_arena = block;
+    }
+    char** sites = &site_arena->slot[site_arena->used];
+    site_arena->used += cnt;
+    return sites;
+}
+
+/**
+ * Frees the site arena.
+ */
+static void site_arena_free( void )
+{
+    while( site_arena != NULL )
+    {
+        site_arena_block* next = site_arena->next;
+        free( site_arena );
+        site_arena = next;
+    }
+}
+
+/**
+ * Allocates zeroed memory from the definition arena.
+ *
+ * Region definitions live until the plugin is finalized, so they are never freed one by one.
+ *
+ * @param   size                            Number of bytes needed.
+ * @param   align                           Alignment needed, a power of two up to 16.
+ *
+ * @return                                  The memory.
+ */
+static void* definition_arena_alloc( size_t                                         size,
+                                     size_t                                         align )
+{
+    size_t offset = definition_arena == NULL ? 0
+                                             : ( definition_arena->used + align - 1 ) & ~( align - 1 );
+    if( definition_arena == NULL || offset + size > definition_arena->capacity )
+    {
+        size_t capacity = size > DEFINITION_ARENA_BLOCK_SIZE ? size : DEFINITION_ARENA_BLOCK_SIZE;
+        definition_arena_block* block = calloc( 1, sizeof( definition_arena_block ) + capacity );
+        block->next = definition_arena;
+        block->capacity = capacity;
+        definition_arena = block;
+        offset = 0;
+    }
+    definition_arena->used = offset + size;
+    return definition_arena->data + offset;
+}
+
+/**
+ * Frees the definition arena.
+ */
+static void definition_arena_free( void )
+{
+    while( definition_arena != NULL )
+    {
+        definition_arena_block* next = definition_arena->next;
+        free( definition_arena );
+        definition_arena = next;
+    }
+}
+
+/**
+ * Adds a call site to a set, unless it is already known.
+ *
+ * @param   set                             The set of call sites.
+ * @param   site                            The call site to add.
+ *
+ * @return                                  Whether the call site has been added.
+ */
+static bool call_sites_add( call_sites*                                             set,
+                            char*                                                   site )
+{
+    for( uint32_t i = 0; i < set->cnt; ++i )
+    {
+        if( CALL_SITE( set, i ) == site )
+        {
+            return false;
+        }
+    }
+
+    if( set->cnt < INLINE_CALL_SITES )
+    {
+        set->sites[set->cnt++] = site;
+        return true;
+    }
+    if( set->cnt - INLINE_CALL_SITES == set->capacity )
+    {
+        uint32_t capacity = set->capacity == 0 ? INLINE_CALL_SITES : 2 * set->capacity;
+        char** spilled = site_arena_alloc( capacity );
+        if( set->capacity > 0 )
+        {
+            memcpy( spilled, set->spilled, set->capacity * sizeof( char* ) );
+        }
+        set->spilled = spilled;
+        set->capacity = capacity;
+    }
+    set->spilled[set->cnt++ - INLINE_CALL_SITES] = site;
+    return true;
+}
+
+/**
+ * Checks whether all known call sites of a region have been overridden.
+ */
+static inline bool all_sites_patched( const region_info*                            region )
+{
+    return region->enter_sites.patched == region->enter_sites.cnt
+           && region->exit_sites.patched == region->exit_sites.cnt;
+}
+
+/**
+ * Rounds the given size up to a multiple of the cache line size.
+ *
+ * @param   size                            The size in bytes.
+ *
+ * @return                                  The rounded size in bytes.
+ */
+static inline size_t cache_line_round( size_t                                       size )
+{
+    return ( size + CACHE_LINE_SIZE - 1 ) & ~( (size_t) CACHE_LINE_SIZE - 1 );
+}
+
+/**
+ * Checks whether the thread local tables hold an entry for the given region.
+ *
+ * @param   local                           The thread local info.
+ * @param   index                           Index of the region.
+ *
+ * @return                                  Whether the entry has been allocated.
+ */
+static inline bool local_info_has( const local_info*                                local,
+                                   uint32_t                                         index )
+{
+    return index / LOCAL_PAGE_SIZE < local->page_cnt && LOCAL_PAGE( local, index ) != NULL;
+}
+
+/**
+ * Allocates the page holding the given region from the thread's arena, see local_info_touch.
+ *
+ * @param   local                           The thread local info of the calling thread.
+ * @param   index                           Index of the region.
+ */
+static __attribute__((noinline)) void local_info_fault( local_info*                 local,
+                                                         uint32_t                    index )
+{
+    uint32_t page = index / LOCAL_PAGE_SIZE;
+    if( page >= local->page_cnt )
+    {
+        uint32_t page_cnt = page + 1 > 2 * local->page_cnt ? page + 1 : 2 * local->page_cnt;
+        local_page_table* old = local->pages;
+        local_page_table* table = calloc( 1, sizeof( local_page_table ) + page_cnt * sizeof( local_page* ) );
+        if( old != NULL )
+        {
+            memcpy( table->page, old->page, local->page_cnt * sizeof( local_page* ) );
+        }
+        table->cnt = page_cnt;
+        table->retired = old;
+        __atomic_store_n( &local->pages, table, __ATOMIC_RELEASE );
+        local->page_cnt = page_cnt;
+    }
+
+    if( local->arena == NULL || local->arena->used == LOCAL_ARENA_PAGES )
+    {
+        local_arena_block* block = aligned_alloc( CACHE_LINE_SIZE, sizeof( local_arena_block ) );
+        block->next = local->arena;
+        block->used = 0;
+        local->arena = block;
+    }
+
+    // Pages are zeroed when handed out, so untouched pages of a block never get committed.
+    local_page* new = &local->arena->pages[local->arena->used++];
+    memset( new, 0, sizeof( local_page ) );
+    __atomic_store_n( &local->pages->page[page], new, __ATOMIC_RELEASE );
+}
+
+/**
+ * Makes sure that the thread local tables hold an entry for the given region.
+ *
+ * Must only be called by the thread owning the tables.
+ *
+ * @param   local                           The thread local info of the calling thread.
+ * @param   index                           Index of the region.
+ */
+static inline void local_info_touch( local_info*                                    local,
+                                     uint32_t                                       index )
+{
+    if( !local_info_has( local, index ) )
+    {
+        local_info_fault( local, index );
+    }
+}
+
+/**
+ * Frees the thread local tables and their arena in one go.
+ *
+ * @param   local                           The thread local info to free the tables of.
+ */
+static void local_info_free( local_info*                                            local )
+{
+    while( local->arena != NULL )
+    {
+        local_arena_block* next = local->arena->next;
+        free( local->arena );
+        local->arena = next;
+    }
+    while( local->pages != NULL )
+    {
+        local_page_table* retired = local->pages->retired;
+        free( local->pages );
+        local->pages = retired;
+    }
+    free( local->dirty );
+    local->dirty = NULL;
+    local->page_cnt = 0;
+    local->dirty_cnt = 0;
+    local->dirty_capacity = 0;
+}
+
+/**
+ * Puts a region onto the dirty list of a thread, so that on_join merges its entry.
+ *
+ * @param   local                           The thread local info of the calling thread.
+ * @param   index                           Index of the region, has to pass local_info_has.
+ */
+static inline void mark_dirty( local_info*                                          local,
+                               uint32_t                                             index )
+{
+    local_region_meta* meta = LOCAL_META( local, index );
+    if( !meta->dirty )
+    {
+        if( local->dirty_cnt == local->dirty_capacity )
+        {
+            local->dirty_capacity = local->dirty_capacity == 0 ? 64 : 2 * local->dirty_capacity;
+            local->dirty = realloc( local->dirty, local->dirty_capacity * sizeof( uint32_t ) );
+        }
+        meta->dirty = true;
+        local->dirty[local->dirty_cnt++] = index;
+    }
+}
+
+/**
+ * Returns the thread local info of the calling thread.
+ *
+ * @return                                  The thread local info or NULL if the thread isn't
+ *                                          observed.
+ */
+static inline local_info* current_local_info( void )
+{
+    if( main_thread )
+    {
+        return &main_info;
+    }
+    return current_local;
+}
+
+/**
+ * Hands out a slot of the location registry, reusing the slots of deleted locations first.
+ *
+ * Must be called with num_threads_mtx held.
+ *
+ * @return                                  The zeroed thread local info of the slot.
+ */
+static local_info* location_acquire( void )
+{
+    location_registry* old = locations;
+    if( free_slot_cnt > 0 )
+    {
+        local_info* local = old->slot[free_slots[--free_slot_cnt]];
+        // The event counter keeps running, so grace periods never mistake the new location for
+        // a quiescent old one.
+        uint64_t events = local->events;
+        memset( local, 0, sizeof( local_info ) );
+        local->events = events;
+        return local;
+    }
+
+    if( old == NULL || old->size == old->capacity )
+    {
+        uint32_t capacity = old == NULL ? 64 : 2 * old->capacity;
+        location_registry* new = calloc( 1, sizeof( location_registry ) + capacity * sizeof( local_info* ) );
+        if( old != NULL )
+        {
+            new->size = old->size;
+            memcpy( new->slot, old->slot, old->size * sizeof( local_info* ) );
+        }
+        new->capacity = capacity;
+        new->retired = old;
+        __atomic_store_n( &locations, new, __ATOMIC_RELEASE );
+    }
+
+    location_registry* registry = locations;
+    local_info* local = aligned_alloc( CACHE_LINE_SIZE, sizeof( local_info ) );
+    memset( local, 0, sizeof( local_info ) );
+    registry->slot[registry->size] = local;
+    __atomic_store_n( &registry->size, registry->size + 1, __ATOMIC_RELEASE );
+    return local;
+}
+
+/**
+ * Retires the slot of a deleted location.
+ *
+ * The location is hidden from all walks starting from now on by clearing its stack. Walks running
+ * right now might still read its stack and tables, so they're only freed by location_reclaim.
+ *
+ * Must be called with num_threads_mtx held.
+ *
+ * @param   local                           The thread local info of the deleted location.
+ */
+static void location_retire( local_info*                                            local )
+{
+    location_registry* registry = locations;
+    uint32_t slot = 0;
+    while( registry->slot[slot] != local )
+    {
+        slot++;
+    }
+    if( retired_location_cnt == retired_location_capacity )
+    {
+        retired_location_capacity = retired_location_capacity == 0 ? 64 : 2 * retired_location_capacity;
+        retired_locations = realloc( retired_locations,
+                                     retired_location_capacity * sizeof( retired_location ) );
+    }
+    retired_locations[retired_location_cnt].slot = slot;
+    retired_locations[retired_location_cnt].stack = local->stack;
+    __atomic_store_n( &retired_location_cnt, retired_location_cnt + 1, __ATOMIC_RELAXED );
+    __atomic_store_n( &local->stack, NULL, __ATOMIC_RELEASE );
+}
+
+/**
+ * Frees the stacks and tables of the retired locations and makes their slots available again.
+ *
+ * All walks of the registry that read the stacks and tables of other threads (delete_regions with
+ * region_is_active and the grace periods, and the merge in on_join) hold thread_ctr_mtx. So once a
+ * thread holds it, every walk that started before a location was retired has been completed and
+ * the location can't be seen anymore.
+ *
+ * Must be called with thread_ctr_mtx held, before walking the registry.
+ */
+static void location_reclaim( void )
+{
+    if( __atomic_load_n( &retired_location_cnt, __ATOMIC_RELAXED ) == 0 )
+    {
+        return;
+    }
+    pthread_mutex_lock( &num_threads_mtx );
+    for( uint32_t i = 0; i < retired_location_cnt; ++i )
+    {
+        local_info_free( locations->slot[retired_locations[i].slot] );
+        free( retired_locations[i].stack );
+        if( free_slot_cnt == free_slot_capacity )
+        {
+            free_slot_capacity = free_slot_capacity == 0 ? 64 : 2 * free_slot_capacity;
+            free_slots = realloc( free_slots, free_slot_capacity * sizeof( uint32_t ) );
+        }
+        free_slots[free_slot_cnt++] = retired_locations[i].slot;
+    }
+    retired_location_cnt = 0;
+    pthread_mutex_unlock( &num_threads_mtx );
+}
+
+/**
+ * Frees the location registry including all retired copies and all thread local infos.
+ */
+static void location_registry_free( void )
+{
+    location_registry* registry = locations;
+    for( uint32_t i = 0; registry != NULL && i < registry->size; ++i )
+    {
+        local_info_free( registry->slot[i] );
+        free( registry->slot[i]->stack );
+        free( registry->slot[i] );
+    }
+    for( uint32_t i = 0; i < retired_location_cnt; ++i )
+    {
+        free( retired_locations[i].stack );
+    }
+    free( retired_locations );
+    retired_locations = NULL;
+    retired_location_cnt = 0;
+    retired_location_capacity = 0;
+    while( registry != NULL )
+    {
+        location_registry* retired = registry->retired;
+        free( registry );
+        registry = retired;
+    }
+    locations = NULL;
+    free( free_slots );
+    free_slots = NULL;
+    free_slot_cnt = 0;
+    free_slot_capacity = 0;
+}
+
+/**
+ * Allocates the shadow call stack of a thread.
+ *
+ * The stack is allocated once with a fixed size of stack_size frames and never grows, enters beyond
+ * its capacity are only counted.
+ *
+ * @param   local                           The thread local info to allocate the stack for.
+ */
+static void shadow_stack_alloc( local_info*                                         local )
+{
+    shadow_frame* stack = aligned_alloc( CACHE_LINE_SIZE,
+                                         cache_line_round( stack_size * sizeof( shadow_frame ) ) );
+    local->stack_depth = 0;
+    local->stack_overflow = 0;
+    local->min_leaf_duration = UINT64_MAX;
+    __atomic_store_n( &local->stack, stack, __ATOMIC_RELEASE );
+}
+
+/**
+ * Frees the shadow call stack of a thread.
+ *
+ * @param   local                           The thread local info to free the stack of.
+ */
+static void shadow_stack_free( local_info*                                          local )
+{
+    shadow_frame* stack = local->stack;
+    __atomic_store_n( &local->stack, NULL, __ATOMIC_RELEASE );
+    free( stack );
+    local->stack_depth = 0;
+    local->stack_overflow = 0;
+}
+
+/**
+ * Pushes a new activation of the given region onto the shadow call stack.
+ *
+ * @param   local                           The thread local info of the current thread.
+ * @param   region                          The region that is entered.
+ * @param   timestamp                       Timestamp of the enter event.
+ * @param   unsampled                       Number of open untimed activations of the region.
+ *
+ * @return                                  Whether the frame has been pushed, false if the stack
+ *                                          is full.
+ */
+static inline bool shadow_stack_push( local_info*                                   local,
+                                      region_info*                                  region,
+                                      uint64_t                                      timestamp,
+                                      uint32_t                                      unsampled )
+{
+    if( local->stack_depth < stack_size && local->stack_overflow == 0 )
+    {
+        shadow_frame* frame = &local->stack[local->stack_depth];
+        frame->region = region;
+        frame->enter = timestamp;
+        frame->child_duration = 0;
+        frame->unsampled = unsampled;
+        // Publish the frame for region_is_active.
+        __atomic_store_n( &local->stack_depth, local->stack_depth + 1, __ATOMIC_RELEASE );
+        return true;
+    }
+    __atomic_store_n( &local->stack_overflow, local->stack_overflow + 1, __ATOMIC_RELAXED );
+    return false;
+}
+
+/**
+ * Pops the activation of the given region from the shadow call stack.
+ *
+ * Computes the inclusive and exclusive duration of the activation and adds the inclusive duration
+ * to the parent's child duration. If the topmost frame doesn't belong to the region (e.g. because an
+ * exit has been missed), the frames above the region's topmost activation are dropped. The outputs
+ * are always set, to 0 if the activation isn't found.
+ *
+ * @param   local                           The thread local info of the current thread.
+ * @param   region                          The region that is exited.
+ * @param   timestamp                       Timestamp of the exit event.
+ * @param   duration                        Returns the inclusive duration of the activation.
+ * @param   exclusive                       Returns the exclusive duration of the activation.
+ * @param   unsampled                       Returns the number of open untimed activations of the
+ *                                          region passed to shadow_stack_push.
+ *
+ * @return                                  Whether the activation could be found on the stack.
+ */
+static inline bool shadow_stack_pop( local_info*                                    local,
+                                     region_info*                                   region,
+                                     uint64_t                                       timestamp,
+                                     uint64_t*                                      duration,
+                                     uint64_t*                                      exclusive,
+                                     uint32_t*                                      unsampled )
+{
+    *duration = 0;
+    *exclusive = 0;
+    *unsampled = 0;
+
+    if( local->stack_overflow > 0 )
+    {
+        __atomic_store_n( &local->stack_overflow, local->stack_overflow - 1, __ATOMIC_RELAXED );
+        return false;
+    }
+
+    uint32_t depth = local->stack_depth;
+    while( depth > 0 && local->stack[depth - 1].region != region )
+    {
+        depth--;
+    }
+    if( depth == 0 )
+    {
+        return false;
+    }
+
+    shadow_frame* frame = &local->stack[depth - 1];
+    __atomic_store_n( &local->stack_depth, depth - 1, __ATOMIC_RELEASE );
+
+    *duration = timestamp - frame->enter;
+    *exclusive = *duration > frame->child_duration ? *duration - frame->child_duration : 0;
+    *unsampled = frame->unsampled;
+
+    if( exclusive_time )
+    {
+        if( local->stack_depth > 0 )
+        {
+            frame[-1].child_duration += *duration;
+        }
+        if( frame->child_duration == 0 && *duration < local->min_leaf_duration )
+        {
+            local->min_leaf_duration = *duration;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Decides whether the current activation of a region is timed.
+ *
+ * With a sampling interval of N only every Nth activation of a region per thread is timed, all
+ * others are merely counted and never reach the shadow call stack (see handle_enter_region). The
+ * filter decisions use the mean of the timed activations.
+ *
+ * @param   local                           The thread local info of the current thread.
+ * @param   index                           Index of the region, has to pass local_info_has.
+ *
+ * @return                                  Whether the activation is timed.
+ */
+static inline bool sample_call( local_info*                                         local,
+                                uint32_t                                            index )
+{
+    if( sampling_interval <= 1 )
+    {
+        return true;
+    }
+    uint32_t* countdown = &LOCAL_COUNTDOWN( local, index );
+    if( *countdown == 0 )
+    {
+        *countdown = sampling_interval - 1;
+        return true;
+    }
+    ( *countdown )--;
+    return false;
+}
+
+/**
+ * Counts a handled event of the current thread.
+ *
+ * Must be called after the shadow call stack has been updated, so that a thread whose event
+ * counter advanced has recorded every activation it started before. Untimed activations don't
+ * count, their count is published by the next timed event.
+ *
+ * @param   local                           The thread local info of the current thread.
+ */
+static inline void count_event( local_info*                                         local )
+{
+    __atomic_store_n( &local->events, local->events + 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * Checks whether the given region is currently active in the main thread.
+ *
+ * @param   region                          The region to check.
+ *
+ * @return                                  Whether there's an open timed or untimed activation.
+ */
+static inline bool region_is_active_on_main( const region_info*                     region )
+{
+    return local_info_has( &main_info, region->index )
+           && ( LOCAL_DEPTH( &main_info, region->index ) > 0
+                || LOCAL_UNSAMPLED( &main_info, region->index ) > 0 );
+}
+
+/**
+ * Checks whether the given region is currently active in any thread.
+ *
+ * The main thread uses its recursion depths, the shadow call stacks of all other threads are
+ * searched for an activation of the region. Untimed activations aren't on the stacks, so the count
+ * of open ones is read from the thread's tables as well. Threads whose stack overflowed count as
+ * active.
+ *
+ * @param   region                          The region to check.
+ *
+ * @return                                  Whether the region might be active.
+ */
+static bool region_is_active( region_info*                                          region )
+{
+    if( region_is_active_on_main( region ) )
+    {
+        return true;
+    }
+
+    uint32_t page_index = region->index / LOCAL_PAGE_SIZE;
+    local_info* local;
+    LOCATION_ITER( local )
+    {
+        const shadow_frame* stack = __atomic_load_n( &local->stack, __ATOMIC_ACQUIRE );
+        if( stack == NULL )
+        {
+            continue;
+        }
+        if( __atomic_load_n( &local->stack_overflow, __ATOMIC_RELAXED ) > 0 )
+        {
+            return true;
+        }
+        local_page_table* table = __atomic_load_n( &local->pages, __ATOMIC_ACQUIRE );
+        local_page* page = table != NULL && page_index < table->cnt
+                           ? __atomic_load_n( &table->page[page_index], __ATOMIC_ACQUIRE ) : NULL;
+        if( page != NULL
+            && __atomic_load_n( &PAGE_UNSAMPLED( page, region->index ), __ATOMIC_RELAXED ) > 0 )
+        {
+            return true;
+        }
+        uint32_t depth = __atomic_load_n( &local->stack_depth, __ATOMIC_ACQUIRE );
+        for( uint32_t j = 0; j < depth; ++j )
+        {
+            if( __atomic_load_n( &stack[j].region, __ATOMIC_RELAXED ) == region )
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether call sites may be patched right now although other threads are running.
+ *
+ * @return                                  Whether concurrent patching is possible.
+ */
+static inline bool concurrent_patching_possible( void )
+{
+    return concurrent_patching;
+}
+
+/**
+ * Starts a new grace period by taking a snapshot of the event counters of all threads.
+ */
+static void start_grace_period( void )
+{
+    local_info* local;
+    grace_threads = 0;
+    LOCATION_ITER( local )
+    {
+        if( grace_threads == grace_snapshot_capacity )
+        {
+            grace_snapshot_capacity = grace_snapshot_capacity == 0 ? 64 : 2 * grace_snapshot_capacity;
+            grace_snapshot = realloc( grace_snapshot, grace_snapshot_capacity * sizeof( uint64_t ) );
+        }
+        grace_snapshot[grace_threads++] = __atomic_load_n( &local->events, __ATOMIC_ACQUIRE );
+    }
+    grace_generation++;
+    grace_running = true;
+}
+
+/**
+ * Checks whether the current grace period has been completed.
+ *
+ * A grace period is completed as soon as every thread that existed when it started has handled at
+ * least one more timed event (or has been deleted). A thread that was just about to enter a region
+ * when that region's enter call was deleted has then recorded the activation on its shadow call
+ * stack or in its count of untimed activations.
+ * If other regions wait for a grace period, the next one is started right away.
+ */
+static void check_grace_period( void )
+{
+    if( !grace_running )
+    {
+        return;
+    }
+    // Slots are never removed from the registry, so the first grace_threads slots are the ones of
+    // the snapshot. A slot recycled since then keeps the event counter of its old location (see
+    // location_acquire), so the new location only counts once it handled an event itself.
+    location_registry* registry = __atomic_load_n( &locations, __ATOMIC_ACQUIRE );
+    for( uint32_t i = 0; i < grace_threads; ++i )
+    {
+        local_info* local = registry->slot[i];
+        if( __atomic_load_n( &local->stack, __ATOMIC_ACQUIRE ) != NULL
+            && __atomic_load_n( &local->events, __ATOMIC_ACQUIRE ) == grace_snapshot[i] )
+        {
+            return;
+        }
+    }
+    grace_completed = grace_generation;
+    grace_running = false;
+    if( grace_needed > grace_completed )
+    {
+        start_grace_period( );
+    }
+}
+
+/**
+ * Recalculates the mean duration of all regions from the running sum.
+ *
+ * Only active regions are part of the mean duration. Only used if the plugin uses the relative
+ * filtering method.
+ */
+static inline void update_mean_duration( )
+{
+    mean_duration = mean_duration_sum / ( __atomic_load_n( &mean_duration_cnt, __ATOMIC_RELAXED ) + 1 );
+}
+
+/**
+ * Sets the mean duration of the given region and updates the global mean duration accordingly.
+ *
+ * @param   region                          The region whose mean duration changed.
+ * @param   new_mean                        The new mean duration of the region.
+ */
+static void set_mean_duration( region_info*                                         region,
+                               float                                                new_mean )
+{
+    if( region->in_mean )
+    {
+        mean_duration_sum += (double) new_mean - region->mean_duration;
+    }
+    region->mean_duration = new_mean;
+    update_mean_duration( );
+}
+
+/**
+ * Removes the given region from the global mean duration.
+ *
+ * Called as soon as a region becomes deletable (or inactive in debug builds).
+ *
+ * @param   region                          The region to remove.
+ */
+static void remove_from_mean_duration( region_info*                                 region )
+{
+    if( region->in_mean )
+    {
+        region->in_mean = false;
+        mean_duration_sum -= region->mean_duration;
+        __atomic_fetch_sub( &mean_duration_cnt, 1, __ATOMIC_RELAXED );
+        update_mean_duration( );
+    }
+}
+
+/**
+ * Appends the given region to the queue of pending deletions, unless it is already queued.
+ *
+ * @param   region                          The region to append.
+ */
+static inline void enqueue_pending( region_info*                                    region )
+{
+    if( region->queued )
+    {
+        return;
+    }
+    region->queued = true;
+    region->next_pending = NULL;
+    *pending_tail = region;
+    pending_tail = &region->next_pending;
+}
+
+/**
+ * Hands the given region over to the main thread, which appends it to the queue of pending deletions.
+ *
+ * Used by other threads than the main thread, which must not touch the queue. The region must not
+ * be queued already.
+ *
+ * @param   region                          The region to hand over.
+ */
+static void hand_over_pending( region_info*                                         region )
+{
+    region_info* head = __atomic_load_n( &handed_over, __ATOMIC_RELAXED );
+    do
+    {
+        region->next_pending = head;
+    }
+    while( !__atomic_compare_exchange_n( &handed_over, &head, region, true, __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED ) );
+}
+
+/**
+ * Appends the regions handed over by other threads to the queue of pending deletions.
+ */
+static void take_handed_over( void )
+{
+    region_info* current = __atomic_exchange_n( &handed_over, NULL, __ATOMIC_ACQUIRE );
+    while( current != NULL )
+    {
+        region_info* next = current->next_pending;
+        enqueue_pending( current );
+        current = next;
+    }
+}
+
+/**
+ * Marks the given region as deletable.
+ *
+ * @param   region                          The region to mark.
+ */
+static void mark_deletable( region_info*                                            region )
+{
+    if( region->deletable )
+    {
+        return;
+    }
+    region->deletable = true;
+    enqueue_pending( region );
+#ifndef DYNAMIC_FILTERING_DEBUG
+    // Only active regions are used for calculating the mean duration.
+    remove_from_mean_duration( region );
+#endif
+}
+
+/**
+ * Returns the current costs of one instrumented call.
+ *
+ * Only called by the main thread, so its own measurements can be taken into account directly.
+ *
+ * @return                                  The per call costs in Score-P ticks or UINT64_MAX if
+ *                                          they're not yet known.
+ */
+static uint64_t get_call_cost( void )
+{
+    if( fixed_call_cost != 0 )
+    {
+        return fixed_call_cost;
+    }
+    return main_info.min_leaf_duration < call_cost ? main_info.min_leaf_duration : call_cost;
+}
+
+/**
+ * Returns the cut-off of the given filtering method for the early rule.
+ *
+ * It is the one apply_filter_method compares the mean durations with, the exclusive method
+ * compares exclusive durations.
+ *
+ * @param   region_method                   The filtering method.
+ *
+ * @return                                  The cut-off in Score-P ticks, 0 if not known yet.
+ */
+static inline __attribute__((always_inline)) float early_cutoff( filtering_method region_method )
+{
+    switch( region_method )
+    {
+        case FILTERING_ABSOLUTE:
+            return threshold;
+        case FILTERING_RELATIVE:
+            return mean_duration > threshold ? mean_duration - threshold : 0;
+        case FILTERING_BUDGET:
+            return budget_threshold;
+        case FILTERING_EXCLUSIVE:
+        {
+            uint64_t cost = get_call_cost( );
+            return cost != UINT64_MAX ? cost_factor * cost : 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Applies the early rule to a region.
+ *
+ * Tiny functions can be told apart after a few calls. If each of the first early_calls timed
+ * activations of a region stayed below early_fraction times the cut-off of the filtering method
+ * (see early_cutoff), the region is marked as deletable right away, regardless of the evaluation
+ * interval. The main thread checks each of its activations, the activations of other threads are
+ * checked in on_join by their longest one.
+ *
+ * The cut-off may not be known yet (e.g. before the first budget update), the longest of the first
+ * early_calls activations is kept then and compared once it is.
+ *
+ * @param   region                          The region.
+ * @param   sampled_before                  Number of timed activations of the region before the
+ *                                          checked ones have been added to its counters.
+ * @param   value                           Longest (exclusive for the exclusive method) duration of
+ *                                          the checked activations.
+ * @param   region_method                   The filtering method.
+ */
+static inline __attribute__((always_inline)) void check_early_deletion( region_info* region,
+                                                                        uint64_t     sampled_before,
+                                                                        uint64_t     value,
+                                                                        filtering_method region_method )
+{
+    if( region->early_failed || region->deletable )
+    {
+        return;
+    }
+    if( sampled_before < early_calls && value > region->early_max )
+    {
+        region->early_max = value;
+    }
+    float cutoff = early_cutoff( region_method );
+    if( cutoff == 0 )
+    {
+        return;
+    }
+    if( region->early_max >= early_fraction * cutoff )
+    {
+        region->early_failed = true;
+    }
+    else if( region->sampled_cnt >= early_calls )
+    {
+        stat_early_regions++;
+        mark_deletable( region );
+    }
+}
+
+/**
+ * Checks whether the filter criteria of the given region need to be evaluated.
+ *
+ * The criteria are evaluated every eval_interval calls and/or every eval_time ticks. If neither is
+ * set, they're evaluated on every call.
+ *
+ * @param   region                          The region that has been exited.
+ * @param   timestamp                       The current timestamp.
+ *
+ * @return                                  Whether update_filter_decision should be called.
+ */
+static inline bool evaluation_due( region_info*                                     region,
+                                   uint64_t                                         timestamp )
+{
+    if( eval_interval == 0 && eval_time == 0 )
+    {
+        return true;
+    }
+    if( ( eval_interval != 0 && region->call_cnt - region->eval_cnt >= eval_interval )
+        || ( eval_time != 0 && timestamp - region->eval_time >= eval_time ) )
+    {
+        region->eval_cnt = region->call_cnt;
+        region->eval_time = timestamp;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Decides whether the given region should be filtered.
+ *
+ * Applies the given filtering method to the region's current statistics and marks it as deletable
+ * if it's not worth being instrumented. The exit callbacks pass their method as a constant, so the
+ * switch is resolved at compile time, see DEFINE_EXIT_CALLBACKS.
+ *
+ * @param   region                          The region to check.
+ * @param   region_method                   The filtering method.
+ */
+static inline __attribute__((always_inline)) void apply_filter_method( region_info* region,
+                                                                       filtering_method region_method )
+{
+    switch( region_method )
+    {
+        case FILTERING_ABSOLUTE:
+            // We're filtering absolute so just compare this region's mean duration with the
+            // threshold.
+            if( ( (float) region->duration / region->sampled_cnt ) < threshold )
+            {
+                mark_deletable( region );
+            }
+            break;
+        case FILTERING_RELATIVE:
+            // We're filtering relative so first update the mean duration of all regions and then
+            // compare the duration of this region with the mean of all regions.
+            set_mean_duration( region, region->sampled_cnt == 0 ? 0
+                                                                : (float) region->duration
+                                                                  / region->sampled_cnt );
+
+            if( region->mean_duration < mean_duration - threshold )
+            {
+                mark_deletable( region );
+            }
+            break;
+        case FILTERING_BUDGET:
+            // The cut-off is raised by update_budget_threshold, so just compare with it.
+            if( region->sampled_cnt > 0
+                && ( (float) region->duration / region->sampled_cnt ) < budget_threshold )
+            {
+                mark_deletable( region );
+            }
+            break;
+        case FILTERING_EXCLUSIVE:
+        {
+            // We're filtering by the region's own work, so compare its mean exclusive duration with
+            // the costs of instrumenting one call.
+            uint64_t cost = get_call_cost( );
+            if( region->sampled_cnt > 0 && cost != UINT64_MAX
+                && ( (float) region->exclusive_duration / region->sampled_cnt ) < cost_factor * cost )
+            {
+                mark_deletable( region );
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Decides whether the given region should be filtered by the configured method, see
+ * apply_filter_method.
+ *
+ * @param   region                          The region to check.
+ */
+static void update_filter_decision( region_info*                                    region )
+{
+    apply_filter_method( region, method );
+}
+
+/**
+ * Measures the costs of the plugin's own bookkeeping per instrumented call.
+ *
+ * Times a loop of shadow call stack updates on a scratch location, i.e. the work done in every
+ * enter and exit callback. This is a lower bound only: the instrumentation call itself, Score-P's
+ * event handling and the other substrates aren't part of it, as the plugin can't issue
+ * instrumented calls on its own. The costs of a whole call are only known at runtime, see
+ * get_call_cost.
+ */
+static void calibrate_call_cost( void )
+{
+    shadow_frame frame;
+    local_info scratch;
+    uint64_t duration, exclusive;
+    uint32_t unsampled;
+
+    memset( &scratch, 0, sizeof( scratch ) );
+    scratch.stack = &frame;
+    scratch.min_leaf_duration = UINT64_MAX;
+
+    uint64_t start = __rdtsc( );
+    for( uint32_t i = 0; i < CALIBRATION_CALLS; ++i )
+    {
+        shadow_stack_push( &scratch, NULL, i, 0 );
+        count_event( &scratch );
+        shadow_stack_pop( &scratch, NULL, i + 1, &duration, &exclusive, &unsampled );
+        count_event( &scratch );
+        // Keep the compiler from dropping the updates of the scratch location.
+        __asm__ volatile( "" : : "r"( &scratch ) : "memory" );
+    }
+    calibrated_cycles = ( __rdtsc( ) - start ) / CALIBRATION_CALLS;
+}
+
+/**
+ * Returns the per call costs used by the budget method.
+ *
+ * As long as no call has been measured (see get_call_cost), the calibrated costs of the plugin are
+ * converted into Score-P ticks using the ticks and cycles elapsed since budget_start.
+ *
+ * @param   timestamp                       The current timestamp.
+ *
+ * @return                                  The per call costs in Score-P ticks or UINT64_MAX if
+ *                                          they're not yet known.
+ */
+static uint64_t get_budget_call_cost( uint64_t                                      timestamp )
+{
+    uint64_t cost = get_call_cost( );
+    uint64_t cycles = __rdtsc( ) - budget_start_cycles;
+    if( cost == UINT64_MAX && calibrated_cycles > 0 && cycles > 0 && timestamp > budget_start )
+    {
+        cost = (double) calibrated_cycles * ( timestamp - budget_start ) / cycles;
+    }
+    return cost == 0 ? 1 : cost;
+}
+
+/**
+ * Compares two regions by their mean duration, regions with more calls come first on a tie.
+ */
+static int compare_budget_region( const void*                                       a,
+                                  const void*                                       b )
+{
+    const region_info* first = *(region_info* const*) a;
+    const region_info* second = *(region_info* const*) b;
+    double first_mean = (double) first->duration / first->sampled_cnt;
+    double second_mean = (double) second->duration / second->sampled_cnt;
+    if( first_mean != second_mean )
+    {
+        return first_mean < second_mean ? -1 : 1;
+    }
+    return first->call_cnt > second->call_cnt ? -1 : first->call_cnt < second->call_cnt;
+}
+
+/**
+ * Raises the cut-off of the budget method until the estimated overhead fits overhead_budget.
+ *
+ * The overhead is estimated as the calls of all instrumented regions since budget_start times the
+ * per call costs. If it exceeds the budget, the regions with the shortest mean duration (and the
+ * most calls among equal ones) are marked as deletable until the remaining calls fit the budget.
+ * The cut-off is raised to the mean duration of the last of them, so regions defined later are
+ * filtered by it right away. Checks are done at exponentially growing intervals, so the costs stay
+ * low for long runs. The exit handler only calls this every BUDGET_CHECK_EVENTS exits, on_join on
+ * every join. Only called by the main thread.
+ *
+ * @param   timestamp                       The current timestamp.
+ */
+static void update_budget_threshold( uint64_t                                       timestamp )
+{
+    if( budget_start == 0 )
+    {
+        budget_start = timestamp;
+        budget_start_cycles = __rdtsc( );
+        budget_next_check = timestamp + 1;
+        return;
+    }
+    if( timestamp < budget_next_check )
+    {
+        return;
+    }
+    uint64_t elapsed = timestamp - budget_start;
+    budget_next_check = timestamp + elapsed / 8 + 1;
+
+    uint64_t cost = get_budget_call_cost( timestamp );
+    if( cost == UINT64_MAX )
+    {
+        return;
+    }
+
+    size_t cnt = 0;
+    double calls = 0;
+    region_info* current;
+    if( region_count( ) > budget_capacity )
+    {
+        budget_capacity = region_count( );
+        budget_regions = realloc( budget_regions, budget_capacity * sizeof( region_info* ) );
+    }
+    REGION_ITER( current )
+    {
+        if( !current->optimized && !current->deletable && !current->inactive
+            && current->sampled_cnt > 0 && cnt < budget_capacity )
+        {
+            budget_regions[cnt++] = current;
+            calls += current->call_cnt;
+        }
+    }
+
+    budget_overhead = calls * cost / elapsed;
+    double allowed_calls = overhead_budget / 100 * elapsed / cost;
+    if( calls <= allowed_calls )
+    {
+        return;
+    }
+
+    qsort( budget_regions, cnt, sizeof( region_info* ), compare_budget_region );
+    for( size_t i = 0; i < cnt && calls > allowed_calls; ++i )
+    {
+        float mean = (float) budget_regions[i]->duration / budget_regions[i]->sampled_cnt;
+        if( mean > budget_threshold )
+        {
+            budget_threshold = mean;
+        }
+        calls -= budget_regions[i]->call_cnt;
+        mark_deletable( budget_regions[i] );
+    }
+}
+
+/**
+ * Makes all cores discard code they might have prefetched, so modified code becomes visible.
+ */
+static void serialize_cores( void )
+{
+    if( membarrier_cmd != 0 )
+    {
+        syscall( __NR_membarrier, membarrier_cmd, 0 );
+    }
+}
+
+/**
+ * Atomically writes the first two bytes of a callq.
+ *
+ * @param   ptr                             Position of the callq.
+ * @param   first                           New first byte.
+ * @param   second                          New second byte.
+ */
+static inline void write_callq_head( char*                                          ptr,
+                                     unsigned char                                  first,
+                                     unsigned char                                  second )
+{
+    // x86 is little endian, so the first byte is the low one.
+    __atomic_store_n( (uint16_t*) ptr, (uint16_t) ( first | second << 8 ), __ATOMIC_RELAXED );
+}
+
+/**
+ * Checks whether the callq at the given position can be overridden while other threads execute it.
+ *
+ * This requires the first two bytes of a callq to be written atomically, i.e. they must not be
+ * split onto two cache lines. Tail calls and overridden tail calls (rets) are patched by writing
+ * their first byte only.
+ *
+ * @param   ptr                             Position of the callq.
+ *
+ * @return                                  Whether the callq can be overridden concurrently.
+ */
+static inline bool callq_concurrently_patchable( const char*                        ptr )
+{
+    const unsigned char* code = (const unsigned char*) ptr;
+    bool tail_call = code[0] == 0xe9 || code[0] == 0xc3 || ( code[0] == 0xff && code[1] == 0x25 );
+    return tail_call || (uintptr_t) ptr % CACHE_LINE_SIZE != CACHE_LINE_SIZE - 1;
+}
+
+/**
+ * Overrides the callqs in the patch batch.
+ *
+ * The pages holding the callqs must already be writable, see apply_callq_overrides. Callqs queued
+ * more than once are skipped.
+ *
+ * When other threads might execute the code concurrently, no thread must ever see a mix of old and
+ * new instructions. So a callq first gets replaced by a two byte jump over the remaining bytes,
+ * then the remaining bytes get the tail of the NOP and finally the jump is replaced by the head of
+ * the NOP. A tail call gets its ret first, the remaining bytes are never executed afterwards.
+ * Restoring works the same way, the NOP is replaced by the jump and a ret is kept until the bytes
+ * behind have been restored. All cores are serialized after every step, i.e. once per step for the
+ * whole batch.
+ */
+static void override_callqs( void )
+{
+    if( !concurrent_patching )
+    {
+        for( size_t i = 0; i < patch_batch_size; ++i )
+        {
+            if( i == 0 || patch_batch[i].ptr != patch_batch[i - 1].ptr )
+            {
+                memmove( patch_batch[i].ptr, patch_batch[i].code, sizeof( char ) * patch_batch[i].len );
+            }
+        }
+        return;
+    }
+
+    for( size_t i = 0; i < patch_batch_size; ++i )
+    {
+        callq_patch* patch = &patch_batch[i];
+        if( i > 0 && patch->ptr == patch_batch[i - 1].ptr )
+        {
+            continue;
+        }
+        if( patch->ret )
+        {
+            // Only the ret of an overridden tail call is written now, a restored one keeps its ret.
+            if( patch->code[0] == 0xc3 )
+            {
+                __atomic_store_n( (unsigned char*) patch->ptr, patch->code[0], __ATOMIC_RELAXED );
+            }
+        }
+        else
+        {
+            // jmp over the remaining bytes
+            write_callq_head( patch->ptr, 0xeb, patch->len - 2 );
+        }
+    }
+    serialize_cores( );
+    for( size_t i = 0; i < patch_batch_size; ++i )
+    {
+        callq_patch* patch = &patch_batch[i];
+        if( i > 0 && patch->ptr == patch_batch[i - 1].ptr )
+        {
+            continue;
+        }
+        size_t head = patch->ret ? 1 : 2;
+        memmove( patch->ptr + head, patch->code + head, sizeof( char ) * ( patch->len - head ) );
+    }
+    serialize_cores( );
+    for( size_t i = 0; i < patch_batch_size; ++i )
+    {
+        callq_patch* patch = &patch_batch[i];
+        if( ( i == 0 || patch->ptr != patch_batch[i - 1].ptr ) && patch->code[0] != 0xc3 )
+        {
+            if( patch->ret )
+            {
+                __atomic_store_n( (unsigned char*) patch->ptr, patch->code[0], __ATOMIC_RELAXED );
+            }
+            else
+            {
+                write_callq_head( patch->ptr, patch->code[0], patch->code[1] );
+            }
+        }
+    }
+    serialize_cores( );
+}
+
+/**
+ * Looks up the saved original instruction of a call site.
+ *
+ * @param   ptr                             Position of the call site.
+ *
+ * @return                                  Index of its entry in saved_callqs or of the first entry
+ *                                          behind its position if there's none.
+ */
+static size_t find_saved_callq( const char*                                         ptr )
+{
+    size_t low = 0, high = saved_callq_cnt;
+    while( low < high )
+    {
+        size_t mid = ( low + high ) / 2;
+        if( (uintptr_t) saved_callqs[mid].ptr < (uintptr_t) ptr )
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * Appends a patch to the patch batch.
+ *
+ * @param   patch                           The patch.
+ */
+static void queue_callq_patch( const callq_patch*                                   patch )
+{
+    if( patch_batch_size == patch_batch_capacity )
+    {
+        patch_batch_capacity = patch_batch_capacity == 0 ? 64 : 2 * patch_batch_capacity;
+        patch_batch = realloc( patch_batch, patch_batch_capacity * sizeof( callq_patch ) );
+    }
+    patch_batch[patch_batch_size++] = *patch;
+}
+
+/**
+ * Queues the callq at the given position for being overridden by apply_callq_overrides.
+ *
+ * The replacement is chosen by the instruction found at the position. Positions that don't hold a
+ * call or tail call (anymore) are skipped. The original instruction is saved for
+ * queue_callq_restore.
+ *
+ * @param   ptr                             Position of the callq.
+ */
+static void queue_callq_override( char*                                             ptr )
+{
+    const unsigned char nop[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+    const unsigned char* code = (const unsigned char*) ptr;
+    callq_patch patch = { ptr, 0, { 0 }, false };
+
+    if( code[0] == 0xe8 )
+    {
+        patch.len = 5;
+        memcpy( patch.code, nop, sizeof( nop ) );
+    }
+    else if( code[0] == 0xe9 )
+    {
+        // ret, nopl 0x0(%rax)
+        const unsigned char ret[] = { 0xc3, 0x0f, 0x1f, 0x40, 0x00 };
+        patch.len = 5;
+        memcpy( patch.code, ret, sizeof( ret ) );
+        patch.ret = true;
+    }
+    else if( code[0] == 0xff && code[1] == 0x15 )
+    {
+        // nopw 0x0(%rax,%rax,1)
+        patch.len = 6;
+        patch.code[0] = 0x66;
+        memcpy( patch.code + 1, nop, sizeof( nop ) );
+    }
+    else if( code[0] == 0xff && code[1] == 0x25 )
+    {
+        // ret, nopl 0x0(%rax,%rax,1)
+        patch.len = 6;
+        patch.code[0] = 0xc3;
+        memcpy( patch.code + 1, nop, sizeof( nop ) );
+        patch.ret = true;
+    }
+    else
+    {
+        return;
+    }
+
+    size_t pos = find_saved_callq( ptr );
+    if( pos == saved_callq_cnt || saved_callqs[pos].ptr != ptr )
+    {
+        if( saved_callq_cnt == saved_callq_capacity )
+        {
+            saved_callq_capacity = saved_callq_capacity == 0 ? 64 : 2 * saved_callq_capacity;
+            saved_callqs = realloc( saved_callqs, saved_callq_capacity * sizeof( saved_callq ) );
+        }
+        memmove( &saved_callqs[pos + 1], &saved_callqs[pos],
+                 ( saved_callq_cnt - pos ) * sizeof( saved_callq ) );
+        saved_callq_cnt++;
+        saved_callqs[pos].ptr = ptr;
+        saved_callqs[pos].len = patch.len;
+        memcpy( saved_callqs[pos].code, ptr, patch.len );
+    }
+    queue_callq_patch( &patch );
+}
+
+/**
+ * Queues the call site at the given position for getting its original instruction back.
+ *
+ * Positions that have never been overridden or already hold their original instruction are skipped.
+ *
+ * @param   ptr                             Position of the callq.
+ */
+static void queue_callq_restore( char*                                              ptr )
+{
+    size_t pos = find_saved_callq( ptr );
+    if( pos == saved_callq_cnt || saved_callqs[pos].ptr != ptr )
+    {
+        return;
+    }
+    const saved_callq* saved = &saved_callqs[pos];
+    if( memcmp( ptr, saved->code, saved->len ) == 0 )
+    {
+        return;
+    }
+
+    callq_patch patch = { ptr, saved->len, { 0 }, (unsigned char) ptr[0] == 0xc3 };
+    memcpy( patch.code, saved->code, saved->len );
+    queue_callq_patch( &patch );
+}
+
+/**
+ * Compares two callq positions for sorting.
+ */
+static int compare_callq( const void*                                               a,
+                          const void*                                               b )
+{
+    uintptr_t first = (uintptr_t) ( (const callq_patch*) a )->ptr;
+    uintptr_t second = (uintptr_t) ( (const callq_patch*) b )->ptr;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * Determines the write window for the queued callqs starting at the given one.
+ *
+ * The callq may be splitted onto two different pages, so the window has to reach from the page of
+ * the first byte of the first callq to the page of the last byte of the last one. Callqs on
+ * contiguous pages share one window.
+ *
+ * @param   first                           Index of the first callq in the window.
+ * @param   window_begin                    Returns the start of the window.
+ * @param   window_size                     Returns the size of the window.
+ *
+ * @return                                  Index of the first callq after the window.
+ */
+static size_t next_patch_window( size_t                                             first,
+                                 uintptr_t*                                         window_begin,
+                                 size_t*                                            window_size )
+{
+    const callq_patch* patch = &patch_batch[first];
+    uintptr_t window_end = ( (uintptr_t) patch->ptr + patch->len - 1 ) | ( page_size - 1 );
+    size_t last = first + 1;
+    while( last < patch_batch_size
+           && ( (uintptr_t) patch_batch[last].ptr & ~( page_size - 1 ) ) <= window_end + 1 )
+    {
+        patch = &patch_batch[last];
+        window_end = ( (uintptr_t) patch->ptr + patch->len - 1 ) | ( page_size - 1 );
+        last++;
+    }
+    *window_begin = (uintptr_t) patch_batch[first].ptr & ~( page_size - 1 );
+    *window_size = window_end + 1 - *window_begin;
+    return last;
+}
+
+/**
+ * Overrides all queued callqs with NOPs (or rets, see callq_patch).
+ *
+ * mprotect changes access permissions on a per page basis, so the queued callqs are sorted by their
+ * position and all callqs on a contiguous range of pages are written within one write window, i.e.
+ * between one pair of mprotect calls. The pages are only writable as long as needed.
+ */
+static void apply_callq_overrides( void )
+{
+    uintptr_t window_begin;
+    size_t window_size;
+
+    if( patch_batch_size == 0 )
+    {
+        return;
+    }
+
+    qsort( patch_batch, patch_batch_size, sizeof( callq_patch ), compare_callq );
+
+    // Add the write permission.
+    for( size_t first = 0; first < patch_batch_size; )
+    {
+        size_t last = next_patch_window( first, &window_begin, &window_size );
+        stat_mprotect_calls++;
+        if( mprotect( (void*) window_begin, window_size, PROT_READ | PROT_WRITE | PROT_EXEC ) != 0 )
+        {
+            fprintf( stderr,  "Could not add write permission to memory access rights on position "
+                              "%p", patch_batch[first].ptr );
+        }
+        first = last;
+    }
+
+    // Finally write the NOPs.
+    override_callqs( );
+    for( size_t i = 0; i < patch_batch_size; ++i )
+    {
+        if( i == 0 || patch_batch[i].ptr != patch_batch[i - 1].ptr )
+        {
+            stat_patched_sites++;
+            stat_patched_bytes += patch_batch[i].len;
+        }
+    }
+
+    // Remove the write permission.
+    for( size_t first = 0; first < patch_batch_size; )
+    {
+        size_t last = next_patch_window( first, &window_begin, &window_size );
+        stat_mprotect_calls++;
+        if( mprotect( (void*) window_begin, window_size, PROT_READ | PROT_EXEC ) != 0 )
+        {
+            fprintf( stderr,  "Could not remove write permission to memory access rights on position "
+                              "%p", patch_batch[first].ptr );
+        }
+        first = last;
+    }
+
+    patch_batch_size = 0;
+}
+
+/**
+ * Checks whether the given memory range can be read safely, see module_registry_is_mapped.
+ *
+ * @param   address                         Begin of the memory range.
+ * @param   size                            Size of the memory range.
+ * @param   exec                            Whether the range has to be executable.
+ *
+ * @return                                  Whether the range is mapped accordingly.
+ */
+static inline bool is_mapped( uintptr_t                                             address,
+                              size_t                                                size,
+                              bool                                                  exec )
+{
+    return module_registry_is_mapped( address, size, exec );
+}
+
+/**
+ * Checks whether the bytes before the given return address are executable code.
+ *
+ * @param   ip                              The return address to check.
+ *
+ * @return                                  Whether a call in front of ip can be read safely.
+ */
+static inline bool is_code_address( uintptr_t                                       ip )
+{
+    return is_mapped( ip - 6, 6, true );
+}
+
+/**
+ * Follows a PLT entry to the function it jumps to.
+ *
+ * Handles the plain PLT entries (jmp *GOT(%rip)) as well as the ones of the second PLT used with
+ * indirect branch tracking (endbr64, optionally followed by bnd jmp *GOT(%rip)).
+ *
+ * @param   target                          The address called.
+ *
+ * @return                                  The function the PLT entry jumps to, target itself if
+ *                                          it isn't a PLT entry.
+ */
+static const unsigned char* resolve_plt( const unsigned char*                       target )
+{
+    const unsigned char endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+    const unsigned char* jump = target;
+
+    if( !is_mapped( (uintptr_t) target, 11, true ) )
+    {
+        return target;
+    }
+    if( memcmp( jump, endbr64, sizeof( endbr64 ) ) == 0 )
+    {
+        jump += sizeof( endbr64 );
+    }
+    if( jump[0] == 0xf2 )
+    {
+        // bnd prefix
+        jump++;
+    }
+    if( jump[0] != 0xff || jump[1] != 0x25 )
+    {
+        return target;
+    }
+
+    int32_t displacement;
+    memcpy( &displacement, jump + 2, sizeof( displacement ) );
+    const unsigned char* const* slot = (const unsigned char* const*) ( jump + 6 + displacement );
+    if( !is_mapped( (uintptr_t) slot, sizeof( *slot ), false ) )
+    {
+        return target;
+    }
+    return *slot;
+}
+
+/**
+ * Returns the function called or jumped to by the instruction at the given call site.
+ *
+ * Direct calls and jumps (e8, e9) are followed through the PLT. Indirect calls and jumps through
+ * the GOT (ff 15, ff 25) return the function stored in the GOT.
+ *
+ * @param   site                            The call site, has to be readable code.
+ *
+ * @return                                  The called function, NULL if there's no call or jump.
+ */
+static const unsigned char* get_site_target( const unsigned char*                   site )
+{
+    int32_t displacement;
+
+    if( site[0] == 0xe8 || site[0] == 0xe9 )
+    {
+        memcpy( &displacement, site + 1, sizeof( displacement ) );
+        return resolve_plt( site + 5 + displacement );
+    }
+    if( site[0] == 0xff && ( site[1] == 0x15 || site[1] == 0x25 ) )
+    {
+        memcpy( &displacement, site + 2, sizeof( displacement ) );
+        const unsigned char* const* slot = (const unsigned char* const*) ( site + 6 + displacement );
+        if( is_mapped( (uintptr_t) slot, sizeof( *slot ), false ) )
+        {
+            return *slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the call instruction in front of the given return address.
+ *
+ * @param   ip                              The return address.
+ *
+ * @return                                  The call site, NULL if there's no call in front of ip.
+ */
+static inline char* get_return_site( uintptr_t                                      ip )
+{
+    const unsigned char* code = (const unsigned char*) ip;
+    if( !is_code_address( ip ) )
+    {
+        return NULL;
+    }
+    if( code[-5] == 0xe8 )
+    {
+        return (char*) ( code - 5 );
+    }
+    if( code[-6] == 0xff && code[-5] == 0x15 )
+    {
+        return (char*) ( code - 6 );
+    }
+    return NULL;
+}
+
+/**
+ * Returns the function called by the call in front of the given return address.
+ *
+ * @param   ip                              The return address.
+ *
+ * @return                                  The called function, NULL if there's no call.
+ */
+static inline const unsigned char* get_callq_target( uintptr_t                      ip )
+{
+    char* site = get_return_site( ip );
+    return site != NULL ? get_site_target( (const unsigned char*) site ) : NULL;
+}
+
+/**
+ * Returns the upper end of the calling thread's stack.
+ *
+ * The bounds are looked up once per thread. If they can't be determined, 0 is returned, so no
+ * frame passes the checks in fast_call_path.
+ *
+ * @return                                  First address above the stack, 0 if unknown.
+ */
+static uintptr_t get_stack_end( void )
+{
+    if( stack_end == 0 )
+    {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+
+        stack_end = 1;
+        if( pthread_getattr_np( pthread_self( ), &attr ) == 0 )
+        {
+            if( pthread_attr_getstack( &attr, &addr, &size ) == 0 )
+            {
+                stack_end = (uintptr_t) addr + size;
+            }
+            pthread_attr_destroy( &attr );
+        }
+    }
+    return stack_end > 1 ? stack_end : 0;
+}
+
+/**
+ * Collects the return addresses of the current call path by following the frame pointers.
+ *
+ * Only frames that keep a frame pointer are found, so this doesn't necessarily yield every return
+ * address. Each frame is checked for plausibility, the walk stops at the first implausible one.
+ * Frames have to lie above the current one and within the stack of the calling thread, so the
+ * walk never reads unmapped memory and callers fall back to libunwind instead.
+ *
+ * @param   ips                             Returns the return addresses found.
+ *
+ * @return                                  Number of return addresses found.
+ */
+static __attribute__((noinline)) size_t fast_call_path( uintptr_t*                  ips )
+{
+    uintptr_t* frame = __builtin_frame_address( 0 );
+    uintptr_t end = get_stack_end( );
+    size_t cnt = 0;
+
+    while( cnt < FAST_DISCOVERY_DEPTH && (uintptr_t) ( frame + 2 ) <= end )
+    {
+        uintptr_t* next = (uintptr_t*) frame[0];
+        uintptr_t ip = frame[1];
+        if( !is_code_address( ip ) )
+        {
+            break;
+        }
+        ips[cnt++] = ip;
+        if( next <= frame || (uintptr_t) next % sizeof( uintptr_t ) != 0 )
+        {
+            break;
+        }
+        frame = next;
+    }
+    return cnt;
+}
+
+/**
+ * Checks which instrumentation call is used in the binary.
+ *
+ * Walks down the call path and searches for all known instrumentation functions (enter functions,
+ * as this one should be called within a enter instrumentation call). The type found is stored for
+ * later use in get_function_call_ip. The frame pointers are checked first, libunwind is used if
+ * they don't lead to an instrumentation call.
+ *
+ * @param   unknown_ip                      Set if unwinding passed a return address outside of the
+ *                                          objects known to the module registry.
+ *
+ * @return                                  Whether the instrumentation call has been found.
+ */
+static bool find_instrumentation_call_type( bool*                                   unknown_ip )
+{
+    if( fast_discovery )
+    {
+        uintptr_t ips[FAST_DISCOVERY_DEPTH];
+        size_t ip_cnt = fast_call_path( ips );
+        for( size_t i = 0; i < ip_cnt; ++i )
+        {
+            const unsigned char* target = get_callq_target( ips[i] );
+            for( size_t j = 0; target != NULL && j < INSTRUMENTATION_CALL_CNT; ++j )
+            {
+                if( target == instrumentation_calls[j].enter_target )
+                {
+                    used_call = &instrumentation_calls[j];
+                    return true;
+                }
+            }
+        }
+    }
+
+    unw_cursor_t cursor;
+    unw_context_t uc;
+    unw_word_t offset;
+    unw_word_t ip;
+    char sym[256];
+
+    unw_getcontext( &uc );
+    unw_init_local( &cursor, &uc );
+
+    // Step up the call path...
+    while( unw_step( &cursor ) > 0 )
+    {
+        unw_get_reg( &cursor, UNW_REG_IP, &ip );
+        *unknown_ip |= ip != 0 && !is_code_address( ip );
+
+        // ... and check the function name against all know instrumentation call names.
+        unw_get_proc_name( &cursor, sym, sizeof( sym ), &offset );
+
+        for( size_t j = 0; j < INSTRUMENTATION_CALL_CNT; ++j )
+        {
+            if( strncmp( sym, instrumentation_calls[j].enter_name,
+                         strlen( instrumentation_calls[j].enter_name ) ) == 0 )
+            {
+                used_call = &instrumentation_calls[j];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Determines the instrumentation call used, see find_instrumentation_call_type.
+ *
+ * The first instrumented call might come from an object loaded after the last update of the
+ * module registry, which is updated then. Like in get_function_call_ip, that's done once per
+ * generation of the registry at most.
+ */
+static void get_instrumentation_call_type( void )
+{
+    bool unknown_ip = false;
+    if( find_instrumentation_call_type( &unknown_ip ) || !unknown_ip
+        || __atomic_load_n( &call_type_missed_generation, __ATOMIC_RELAXED )
+           == module_registry_generation( ) + 1 )
+    {
+        return;
+    }
+    if( !module_registry_update( ) || !find_instrumentation_call_type( &unknown_ip ) )
+    {
+        __atomic_store_n( &call_type_missed_generation, module_registry_generation( ) + 1,
+                          __ATOMIC_RELAXED );
+    }
+}
+
+/**
+ * Returns the instruction pointer for the given function.
+ *
+ * This method walks down the call path and tries to find a function with the given name and
+ * returns a pointer for the first byte of the call to this function in the current call path.
+ * Note that only the first (beginning from the innermost function) occurrence of the function call
+ * will be handled.
+ *
+ * The frame pointers are followed first, as this is much cheaper than unwinding. If the call isn't
+ * found that way, libunwind is used. The frame pointer based discovery is turned off if it fails
+ * most of the time, e.g. because the binary has been compiled without frame pointers.
+ *
+ * @param   function_name                   The function to look up.
+ * @param   unknown_ip                      Set if unwinding passed a return address outside of the
+ *                                          objects known to the module registry.
+ *
+ * @return                                  Pointer to the first byte of the call to the given
+ *                                          function in the current call path.
+ */
+static inline __attribute__((always_inline)) char* find_function_call_ip( int is_enter,
+                                                                         bool* unknown_ip )
+{
+    if( used_call == NULL )
+    {
+        return (char*) 0;
+    }
+    unsigned char* target_address_scorep = is_enter ? used_call->enter_target : used_call->exit_target;
+    if( target_address_scorep == NULL )
+    {
+        return (char*) 0;
+    }
+
+    if( fast_discovery )
+    {
+        uintptr_t ips[FAST_DISCOVERY_DEPTH];
+        size_t ip_cnt = fast_call_path( ips );
+        for( size_t i = 0; i < ip_cnt; ++i )
+        {
+            if( get_callq_target( ips[i] ) == target_address_scorep )
+            {
+                __atomic_fetch_add( &fast_discovery_hits, 1, __ATOMIC_RELAXED );
+                return get_return_site( ips[i] );
+            }
+        }
+    }
+
+    unw_cursor_t cursor;
+    unw_context_t uc;
+    unw_word_t ip;
+
+    unw_getcontext( &uc );
+    unw_init_local( &cursor, &uc );
+
+    // Step up the call path...
+    while( unw_step( &cursor ) > 0 )
+    {
+        unw_get_reg( &cursor, UNW_REG_IP, &ip );
+
+        if( !is_code_address( ip ) )
+        {
+            *unknown_ip |= ip != 0;
+            continue;
+        }
+        if( get_callq_target( ip ) == target_address_scorep )
+        {
+            if( fast_discovery
+                && __atomic_add_fetch( &fast_discovery_misses, 1, __ATOMIC_RELAXED )
+                   > __atomic_load_n( &fast_discovery_hits, __ATOMIC_RELAXED ) + 32 )
+            {
+                fast_discovery = false;
+            }
+            return get_return_site( ip );
+        }
+    }
+
+    // This shouldn't happen, if we're on this point, we tried to delete a function not present in
+    // the current call path. We return zero in this case because delete_regions wont try to delete
+    // this call in this case and we get no undefined behaviour.
+    return (char*) 0;
+}
+
+/**
+ * Decodes the function holding an enter call site and returns the exit calls belonging to it.
+ *
+ * The function's instrumentation calls are told apart from those of functions inlined into it by
+ * their first argument, the address of the instrumented function (see x86_track_registers). An exit
+ * call with an unknown argument is only taken if the function holds no enter calls of
+ * other functions. The extent of the function is taken from its symbol, functions without a dynamic
+ * symbol can't be searched. The search stops at the first instruction that can't be decoded.
+ *
+ * A function inlined several times into the same caller has further enter calls next to the given
+ * one. Their exit calls are among the returned ones, so these enter calls can be returned as well.
+ *
+ * @param   enter_site                      An enter call site of the function.
+ * @param   tail_calls_only                 Whether only jumps to the exit call are returned, see
+ *                                          find_tail_call_sites.
+ * @param   with_enters                     Whether the other enter calls of the function are
+ *                                          returned as well, told apart by their call target.
+ * @param   sites                           Returns the exit calls (and enter calls).
+ * @param   capacity                        Maximum number of calls returned.
+ * @param   complete                        If not NULL, returns whether the whole function has been
+ *                                          decoded and every exit call in it could be attributed,
+ *                                          i.e. whether the returned exit calls are all of them.
+ *
+ * @return                                  Number of exit calls found.
+ */
+static size_t find_exit_call_sites( const char*                                     enter_site,
+                                    bool                                            tail_calls_only,
+                                    bool                                            with_enters,
+                                    char**                                          sites,
+                                    size_t                                          capacity,
+                                    bool*                                           complete )
+{
+    Dl_info dl_info;
+    const ElfW( Sym )* symbol = NULL;
+
+    if( complete != NULL )
+    {
+        *complete = false;
+    }
+    if( used_call == NULL || used_call->exit_target == NULL || enter_site == NULL
+        || dladdr1( enter_site, &dl_info, (void**) &symbol, RTLD_DL_SYMENT ) == 0
+        || symbol == NULL || dl_info.dli_saddr == NULL || symbol->st_size == 0
+        || !is_mapped( (uintptr_t) dl_info.dli_saddr, symbol->st_size, true ) )
+    {
+        return 0;
+    }
+
+    // Decode the function from its start, so only real calls and jumps are taken. The first pass
+    // looks up the argument of the given enter call, the second one collects the exit calls.
+    const unsigned char* begin = dl_info.dli_saddr;
+    const unsigned char* end = begin + symbol->st_size;
+    uintptr_t function = 0;
+    bool foreign = false;
+    size_t cnt = 0;
+    size_t unknown_cnt = 0;
+    char* unknown[MAX_EXIT_CALL_SITES];
+    bool dropped = false;
+    const unsigned char* code = begin;
+    for( int pass = 0; pass < 2; ++pass )
+    {
+        code = begin;
+        uintptr_t registers[X86_REGISTER_CNT] = { 0 };
+        x86_insn insn;
+        while( code < end && x86_decode( code, end - code, &insn ) )
+        {
+            const unsigned char* site = code + insn.opcode;
+            size_t operand_size = insn.length - insn.opcode;
+            uintptr_t argument = registers[X86_RDI];
+            x86_track_registers( code, &insn, registers );
+            code += insn.length;
+
+            bool is_call = ( site[0] == 0xe8 && operand_size == 5 )
+                           || ( site[0] == 0xff && site[1] == 0x15 && operand_size == 6 );
+            bool is_jump = ( site[0] == 0xe9 && operand_size == 5 )
+                           || ( site[0] == 0xff && site[1] == 0x25 && operand_size == 6 );
+            if( !is_call && !is_jump )
+            {
+                continue;
+            }
+            const unsigned char* target = get_site_target( site );
+            if( pass == 0 && is_call && target == used_call->enter_target )
+            {
+                if( site == (const unsigned char*) enter_site )
+                {
+                    function = argument;
+                }
+            }
+            else if( pass == 1 && is_call && target == used_call->enter_target )
+            {
+                foreign = foreign || ( site != (const unsigned char*) enter_site
+                                       && ( argument == 0 || argument != function ) );
+                if( with_enters && site != (const unsigned char*) enter_site && argument != 0
+                    && argument == function )
+                {
+                    dropped = dropped || cnt == capacity;
+                    if( cnt < capacity )
+                    {
+                        sites[cnt++] = (char*) site;
+                    }
+                }
+            }
+            else if( pass == 1 && target == used_call->exit_target && ( is_jump || !tail_calls_only ) )
+            {
+                if( argument != 0 && argument == function )
+                {
+                    dropped = dropped || cnt == capacity;
+                    if( cnt < capacity )
+                    {
+                        sites[cnt++] = (char*) site;
+                    }
+                }
+                else if( argument == 0 || function == 0 )
+                {
+                    dropped = dropped || unknown_cnt == MAX_EXIT_CALL_SITES;
+                    if( unknown_cnt < MAX_EXIT_CALL_SITES )
+                    {
+                        unknown[unknown_cnt++] = (char*) site;
+                    }
+                }
+            }
+        }
+    }
+    for( size_t i = 0; !foreign && i < unknown_cnt; ++i )
+    {
+        dropped = dropped || cnt == capacity;
+        if( cnt < capacity )
+        {
+            sites[cnt++] = unknown[i];
+        }
+    }
+    if( complete != NULL )
+    {
+        // Exit calls with an unknown argument might belong to one of the other functions.
+        *complete = code >= end && !dropped && ( !foreign || unknown_cnt == 0 );
+    }
+    return cnt;
+}
+
+/**
+ * Searches the function holding the given enter call site for tail calls to the exit
+ * instrumentation call, see find_exit_call_sites.
+ *
+ * With -foptimize-sibling-calls the exit instrumentation call may be a jump, so it never shows up on
+ * the call path.
+ *
+ * @param   enter_site                      An enter call site of the function.
+ * @param   sites                           Returns up to MAX_TAIL_CALL_SITES tail calls.
+ *
+ * @return                                  Number of tail calls found.
+ */
+static size_t find_tail_call_sites( const char*                                     enter_site,
+                                    char**                                          sites )
+{
+    return find_exit_call_sites( enter_site, true, false, sites, MAX_TAIL_CALL_SITES, NULL );
+}
+
+/**
+ * Checks whether the instruction at the given call site is a tail call.
+ */
+static inline bool is_tail_call( const char*                                        site )
+{
+    const unsigned char* code = (const unsigned char*) site;
+    return code != NULL && ( code[0] == 0xe9 || ( code[0] == 0xff && code[1] == 0x25 ) );
+}
+
+/**
+ * Returns the call site of the given instrumentation call, see find_function_call_ip.
+ *
+ * The call might come from an object loaded after the last update of the module registry. Updating
+ * it takes the loader lock, so that's only done if the call path passed code outside the known
+ * objects, and only once per region and generation of the registry.
+ *
+ * The time needed is added to the stats of the calling location if a report is requested.
+ *
+ * @param   region                          The region whose event is handled.
+ * @param   is_enter                        Whether the enter instrumentation call is looked up.
+ *
+ * @return                                  The call site, NULL if it hasn't been found.
+ */
+static char* get_function_call_ip( region_info*                                     region,
+                                   int                                              is_enter )
+{
+    local_info* local = current_local_info( );
+    uint64_t start = create_report && local != NULL ? __rdtsc( ) : 0;
+    bool unknown_ip = false;
+
+    char* site = find_function_call_ip( is_enter, &unknown_ip );
+    if( site == NULL && unknown_ip
+        && __atomic_load_n( &region->missed_generation, __ATOMIC_RELAXED )
+           != module_registry_generation( ) + 1 )
+    {
+        if( module_registry_update( ) )
+        {
+            site = find_function_call_ip( is_enter, &unknown_ip );
+        }
+        if( site == NULL )
+        {
+            __atomic_store_n( &region->missed_generation, module_registry_generation( ) + 1,
+                              __ATOMIC_RELAXED );
+        }
+    }
+
+    if( create_report && local != NULL )
+    {
+        local->stats.discoveries++;
+        local->stats.discovery_cycles += __rdtsc( ) - start;
+    }
+    return site;
+}
+
+/**
+ * Checks whether the cached call sites of a region still call a known pair of instrumentation
+ * calls.
+ *
+ * @param   entry                           The cache entry of the region.
+ *
+ * @return                                  Whether the call sites can be overridden.
+ */
+static bool cached_callqs_valid( const filter_cache_entry*                         entry )
+{
+    const uint64_t* offsets = filter_cache_sites( entry );
+
+    for( size_t i = 0; i < INSTRUMENTATION_CALL_CNT; ++i )
+    {
+        bool valid = entry->enter_cnt > 0 && entry->exit_cnt > 0;
+        for( uint32_t j = 0; valid && j < entry->enter_cnt + entry->exit_cnt; ++j )
+        {
+            uintptr_t site = base_pointer + offsets[j];
+            valid = filter_cache_in_program( site ) && is_mapped( site, 6, true )
+                    && get_site_target( (const unsigned char*) site )
+                       == ( j < entry->enter_cnt ? instrumentation_calls[i].enter_target
+                                                 : instrumentation_calls[i].exit_target );
+        }
+        if( valid )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Gets the return addresses on the call path of the calling thread, innermost first.
+ *
+ * @param   ips                             Returns the return addresses.
+ * @param   max                             Number of entries fitting into ips.
+ *
+ * @return                                  Number of return addresses, max if the call path might
+ *                                          be longer.
+ */
+static size_t get_call_path( uintptr_t*                                             ips,
+                             size_t                                                 max )
+{
+    unw_cursor_t cursor;
+    unw_context_t uc;
+    unw_word_t ip;
+    size_t ip_cnt = 0;
+
+    unw_getcontext( &uc );
+    unw_init_local( &cursor, &uc );
+    while( ip_cnt < max && unw_step( &cursor ) > 0 )
+    {
+        unw_get_reg( &cursor, UNW_REG_IP, &ip );
+        ips[ip_cnt++] = ip;
+    }
+    return ip_cnt;
+}
+
+/**
+ * Deletes the regions stored in the persistent filter cache.
+ *
+ * Regions that are currently active, i.e. that have a return address between their first and last
+ * call site on the current call path, keep their instrumentation. Their enter event has already been
+ * seen, so deleting the exit call would leave the region open.
+ */
+static void apply_filter_cache( void )
+{
+    filter_cache_init( );
+    cache_entry_cnt = filter_cache_load( cache_file );
+    if( cache_entry_cnt == 0 )
+    {
+        return;
+    }
+    cache_state = calloc( cache_entry_cnt, sizeof( unsigned char ) );
+
+    uintptr_t ips[256];
+    size_t ip_cnt = get_call_path( ips, sizeof( ips ) / sizeof( ips[0] ) );
+
+    for( size_t i = 0; i < cache_entry_cnt; ++i )
+    {
+        const filter_cache_entry* entry = filter_cache_get( i );
+        if( !( entry->flags & FILTER_CACHE_DELETED ) || !cached_callqs_valid( entry ) )
+        {
+            continue;
+        }
+
+        const uint64_t* offsets = filter_cache_sites( entry );
+        uintptr_t low = UINTPTR_MAX, high = 0;
+        for( uint32_t j = 0; j < entry->enter_cnt + entry->exit_cnt; ++j )
+        {
+            uintptr_t site = base_pointer + offsets[j];
+            low = site < low ? site : low;
+            high = site + 5 > high ? site + 5 : high;
+        }
+        bool active = false;
+        for( size_t j = 0; j < ip_cnt && !active; ++j )
+        {
+            active = ips[j] > low && ips[j] <= high;
+        }
+        if( active )
+        {
+            continue;
+        }
+
+        for( uint32_t j = 0; j < entry->enter_cnt + entry->exit_cnt; ++j )
+        {
+            queue_callq_override( (char*) ( base_pointer + offsets[j] ) );
+        }
+        cache_state[i] = CACHE_APPLIED;
+    }
+
+    apply_callq_overrides( );
+}
+
+/**
+ * Writes the persistent filter cache.
+ *
+ * All deleted regions with call sites in the binary itself are stored. Cached regions that
+ * haven't been defined in this run are kept.
+ */
+static void store_filter_cache( void )
+{
+    size_t record_capacity = region_count( ) + cache_entry_cnt + 1;
+    filter_cache_record* records = calloc( record_capacity, sizeof( filter_cache_record ) );
+    uint64_t** offsets = calloc( record_capacity, sizeof( uint64_t* ) );
+    size_t record_cnt = 0;
+    region_info* current;
+
+    REGION_ITER( current )
+    {
+        if( !current->inactive || current->optimized || !all_sites_patched( current ) )
+        {
+            continue;
+        }
+
+        uint32_t site_cnt = current->enter_sites.cnt + current->exit_sites.cnt;
+        uint64_t* sites = malloc( site_cnt * sizeof( uint64_t ) );
+        bool in_program = true;
+        for( uint32_t j = 0; j < site_cnt; ++j )
+        {
+            char* site = j < current->enter_sites.cnt
+                         ? CALL_SITE( &current->enter_sites, j )
+                         : CALL_SITE( &current->exit_sites, j - current->enter_sites.cnt );
+            in_program = in_program && filter_cache_in_program( (uintptr_t) site );
+            sites[j] = (uintptr_t) site - base_pointer;
+        }
+        if( !in_program )
+        {
+            free( sites );
+            continue;
+        }
+
+        offsets[record_cnt] = sites;
+        filter_cache_record* record = &records[record_cnt++];
+        record->name = current->region_name;
+        record->sites = sites;
+        record->enter_cnt = current->enter_sites.cnt;
+        record->exit_cnt = current->exit_sites.cnt;
+        record->flags = FILTER_CACHE_DELETED;
+    }
+    for( size_t i = 0; i < cache_entry_cnt; ++i )
+    {
+        if( !( cache_state[i] & CACHE_SEEN ) )
+        {
+            const filter_cache_entry* entry = filter_cache_get( i );
+            filter_cache_record* record = &records[record_cnt++];
+            record->name = filter_cache_name( entry );
+            record->sites = filter_cache_sites( entry );
+            record->enter_cnt = entry->enter_cnt;
+            record->exit_cnt = entry->exit_cnt;
+            record->flags = entry->flags;
+        }
+    }
+
+    if( !filter_cache_store( cache_file, records, record_cnt ) )
+    {
+        fprintf( stderr, "Couldn't write filter cache %s.\n", cache_file );
+    }
+    for( size_t i = 0; i < record_capacity; ++i )
+    {
+        free( offsets[i] );
+    }
+    free( offsets );
+    free( records );
+}
+
+/**
+ * Checks whether the given call site still calls or jumps to an instrumentation call.
+ *
+ * Only the bytes are checked, the call site has to be an instruction boundary already. That holds
+ * for every call site added to a region: return addresses follow their call by construction, the
+ * call site index and find_tail_call_sites decode the functions from their symbols, and the filter
+ * cache only stores such call sites for the same build of the object. Decoding the function again
+ * here would need its symbol, and looking that up takes the loader lock.
+ *
+ * @param   site                            The call site.
+ *
+ * @return                                  Whether the call site may be overridden.
+ */
+static bool is_instrumentation_site( const char*                                    site )
+{
+    if( !is_mapped( (uintptr_t) site, 6, true ) )
+    {
+        return false;
+    }
+    const unsigned char* target = get_site_target( (const unsigned char*) site );
+    for( size_t i = 0; target != NULL && i < INSTRUMENTATION_CALL_CNT; ++i )
+    {
+        if( target == instrumentation_calls[i].enter_target
+            || target == instrumentation_calls[i].exit_target )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Queues all call sites of a set that haven't been overridden yet.
+ *
+ * Call sites not holding an instrumentation call (anymore) are skipped, so no other code is ever
+ * overridden, e.g. after an object has been replaced by another one at the same addresses.
+ *
+ * @param   set                             The set of call sites.
+ */
+static void queue_call_sites( call_sites*                                           set )
+{
+    for( uint32_t i = set->patched; i < set->cnt; ++i )
+    {
+        if( is_instrumentation_site( CALL_SITE( set, i ) ) )
+        {
+            queue_callq_override( CALL_SITE( set, i ) );
+        }
+    }
+    set->patched = set->cnt;
+}
+
+/**
+ * Removes the call sites within objects unloaded after the given generation from a set.
+ *
+ * The overridden call sites stay in front of the others.
+ *
+ * @param   set                             The set of call sites.
+ * @param   generation                      Generation of the module registry checked last.
+ *
+ * @return                                  Number of removed call sites.
+ */
+static uint32_t drop_unloaded_sites( call_sites*                                    set,
+                                     uint64_t                                       generation )
+{
+    uint32_t kept = 0, kept_patched = 0;
+    for( uint32_t i = 0; i < set->cnt; ++i )
+    {
+        char* site = CALL_SITE( set, i );
+        if( module_registry_unloaded_since( (uintptr_t) site, generation ) )
+        {
+            continue;
+        }
+        if( i < set->patched )
+        {
+            kept_patched++;
+        }
+        if( kept < INLINE_CALL_SITES )
+        {
+            set->sites[kept] = site;
+        }
+        else
+        {
+            set->spilled[kept - INLINE_CALL_SITES] = site;
+        }
+        kept++;
+    }
+    uint32_t dropped = set->cnt - kept;
+    set->cnt = kept;
+    set->patched = kept_patched;
+    return dropped;
+}
+
+/**
+ * Drops all call sites within objects unloaded since the last check, see module-registry.h.
+ *
+ * The addresses might belong to another object by now, so neither the call sites nor their saved
+ * original instructions must be written anymore. Regions that lost their call sites are treated
+ * like regions whose call sites haven't been discovered yet. The tables of the other threads may
+ * be modified by their owners meanwhile, so the call sites discovered by them are dropped later on,
+ * see drop_unloaded_local_sites. Only called by the main thread.
+ */
+static void drop_unloaded_call_sites( void )
+{
+    module_registry_update( );
+    uint64_t generation = module_registry_generation( );
+    if( generation == checked_generation )
+    {
+        return;
+    }
+
+    region_vector* list = __atomic_load_n( &region_list, __ATOMIC_ACQUIRE );
+    for( uint32_t i = 0; list != NULL && i < list->size; ++i )
+    {
+        stat_dropped_sites += drop_unloaded_sites( &list->slot[i]->enter_sites, checked_generation );
+        stat_dropped_sites += drop_unloaded_sites( &list->slot[i]->exit_sites, checked_generation );
+    }
+
+    size_t kept = 0;
+    for( size_t i = 0; i < saved_callq_cnt; ++i )
+    {
+        if( !module_registry_unloaded_since( (uintptr_t) saved_callqs[i].ptr, checked_generation ) )
+        {
+            saved_callqs[kept++] = saved_callqs[i];
+        }
+    }
+    saved_callq_cnt = kept;
+    checked_generation = generation;
+}
+
+/**
+ * Drops the call sites discovered by another thread within objects unloaded before the last check,
+ * see drop_unloaded_call_sites.
+ *
+ * The call sites discovered by the thread have been valid when the registry had the generation the
+ * tables are stamped with. Call sites found in an object loaded to the addresses of an unloaded one
+ * afterwards are dropped as well, they are just discovered again. Only called by on_join, while
+ * the thread doesn't touch its tables.
+ *
+ * @param   thread                          The thread local info of the thread.
+ * @param   region_cnt                      Number of defined regions.
+ */
+static void drop_unloaded_local_sites( local_info*                                  thread,
+                                       uint32_t                                     region_cnt )
+{
+    if( thread->generation >= checked_generation )
+    {
+        return;
+    }
+
+    for( uint32_t j = 0; j < region_cnt; ++j )
+    {
+        if( !local_info_has( thread, j ) )
+        {
+            continue;
+        }
+        local_region_meta* info = LOCAL_META( thread, j );
+        if( info->enter_func != NULL
+            && module_registry_unloaded_since( (uintptr_t) info->enter_func, thread->generation ) )
+        {
+            info->enter_func = NULL;
+        }
+        if( info->exit_func != NULL
+            && module_registry_unloaded_since( (uintptr_t) info->exit_func, thread->generation ) )
+        {
+            info->exit_func = NULL;
+        }
+    }
+    thread->generation = checked_generation;
+}
+
+/**
+ * Checks whether all call sites of a set that haven't been overridden yet can be overridden while
+ * other threads are running.
+ *
+ * @param   set                             The set of call sites.
+ */
+static bool call_sites_concurrently_patchable( const call_sites*                    set )
+{
+    for( uint32_t i = set->patched; i < set->cnt; ++i )
+    {
+        if( !callq_concurrently_patchable( CALL_SITE( set, i ) ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Adds a newly discovered call site to a region.
+ *
+ * If the region has already been deleted, the call site has been missed so far, so the region is
+ * queued again for overriding it. A new enter call might be in another function, whose exit calls
+ * have to be searched first (see complete_exit_sites).
+ *
+ * @param   region                          The region.
+ * @param   site                            The call site.
+ * @param   is_enter                        Whether it is a call site of the enter function.
+ */
+static void add_call_site( region_info*                                             region,
+                           char*                                                    site,
+                           bool                                                     is_enter )
+{
+    if( site == NULL || !call_sites_add( is_enter ? &region->enter_sites : &region->exit_sites, site ) )
+    {
+        return;
+    }
+    if( is_enter && !region->indexed )
+    {
+        region->exits_complete = false;
+    }
+    if( region->inactive )
+    {
+        enqueue_pending( region );
+    }
+}
+
+/**
+ * Adds a call site discovered by an event of the main thread, see add_call_site.
+ *
+ * An event from an overridden call site means that the call has been written again, i.e. its
+ * object has been unloaded and loaded again to the same addresses. The module registry reports such
+ * an object as unloaded on its next update, so the call sites within it are dropped and the call
+ * site is added as a new one. The registry is checked at most once per region and generation.
+ *
+ * @param   region                          The region.
+ * @param   site                            The call site.
+ * @param   is_enter                        Whether the call site is an enter call.
+ */
+static void add_discovered_call_site( region_info*                                  region,
+                                      char*                                         site,
+                                      bool                                          is_enter )
+{
+    const call_sites* set = is_enter ? &region->enter_sites : &region->exit_sites;
+    for( uint32_t i = 0; site != NULL && i < set->patched; ++i )
+    {
+        if( CALL_SITE( set, i ) == site
+            && __atomic_load_n( &region->missed_generation, __ATOMIC_RELAXED )
+               != module_registry_generation( ) + 1 )
+        {
+            uint64_t generation = module_registry_generation( );
+            pthread_mutex_lock( &thread_ctr_mtx );
+            drop_unloaded_call_sites( );
+            pthread_mutex_unlock( &thread_ctr_mtx );
+            if( module_registry_generation( ) == generation )
+            {
+                __atomic_store_n( &region->missed_generation, generation + 1, __ATOMIC_RELAXED );
+            }
+            break;
+        }
+    }
+    add_call_site( region, site, is_enter );
+}
+
+/**
+ * Adds all tail calls to the exit instrumentation call of a region's function, see
+ * find_tail_call_sites.
+ *
+ * @param   region                          The region.
+ * @param   enter_site                      An enter call site of the region.
+ *
+ * @return                                  Whether a tail call has been found.
+ */
+static bool add_tail_call_sites( region_info*                                       region,
+                                 const char*                                        enter_site )
+{
+    char* sites[MAX_TAIL_CALL_SITES];
+    size_t cnt = find_tail_call_sites( enter_site, sites );
+    for( size_t i = 0; i < cnt; ++i )
+    {
+        add_call_site( region, sites[i], false );
+    }
+    return cnt > 0;
+}
+
+/**
+ * Adds all exit calls of a region's function before its enter calls are deleted.
+ *
+ * Call site discovery only finds the exit calls that have been executed, a function with several
+ * returns would keep the others. These are searched next to every known enter call, see
+ * find_exit_call_sites. The other enter calls found there are added as well, as their exit calls
+ * are going to be deleted. If a search can't tell whether it found all exit calls, a remaining one
+ * would produce exit events without enter events once the enter calls are deleted. The region is
+ * then marked as optimized and keeps its instrumentation.
+ *
+ * @param   region                          The region.
+ */
+static void complete_exit_sites( region_info*                                       region )
+{
+    char* sites[MAX_EXIT_CALL_SITES];
+    bool complete = true;
+    // The exit calls of already deleted enter calls are known, their calls can't be decoded anymore.
+    for( uint32_t i = region->enter_sites.patched; i < region->enter_sites.cnt; ++i )
+    {
+        bool searched;
+        size_t cnt = find_exit_call_sites( CALL_SITE( &region->enter_sites, i ), false, true,
+                                           sites, MAX_EXIT_CALL_SITES, &searched );
+        complete = complete && searched;
+        for( size_t j = 0; j < cnt; ++j )
+        {
+            bool is_enter = get_site_target( (const unsigned char*) sites[j] )
+                            == used_call->enter_target;
+            add_call_site( region, sites[j], is_enter );
+        }
+    }
+    region->exits_complete = complete;
+    if( !complete )
+    {
+        region->optimized = true;
+#ifdef DYNAMIC_FILTERING_DEBUG
+        fprintf( stderr, "Not all exit calls of region %s are known, keeping it!\n",
+                 region->region_name );
+#endif
+    }
+}
+
+/**
+ * Queues the overridden call sites of a set for being restored.
+ *
+ * @param   set                             The set of call sites.
+ */
+static void queue_call_sites_restore( call_sites*                                   set )
+{
+    for( uint32_t i = 0; i < set->patched; ++i )
+    {
+        queue_callq_restore( CALL_SITE( set, i ) );
+    }
+    set->patched = 0;
+}
+
+/**
+ * Restores the instrumentation of a deleted or deletable region.
+ *
+ * The region is measured from scratch afterwards, i.e. its global statistics are reset and its
+ * filter criteria are evaluated again. The call sites are only queued, see delete_regions.
+ *
+ * @param   region                          The region to restore.
+ * @param   timestamp                       Time of the event triggering the restore.
+ */
+static void restore_region( region_info*                                            region,
+                            uint64_t                                                timestamp )
+{
+    if( region->optimized || !region->deletable )
+    {
+        return;
+    }
+    queue_call_sites_restore( &region->enter_sites );
+    queue_call_sites_restore( &region->exit_sites );
+
+    region->call_cnt = 0;
+    region->sampled_cnt = 0;
+    region->duration = 0;
+    region->exclusive_duration = 0;
+    region->eval_cnt = 0;
+    region->eval_time = timestamp;
+    region->deletable = false;
+    region->inactive = false;
+    region->early_failed = false;
+    region->early_max = 0;
+    region->deleted_at = 0;
+    region->mean_duration = 0;
+    if( !region->in_mean )
+    {
+        region->in_mean = true;
+        __atomic_fetch_add( &mean_duration_cnt, 1, __ATOMIC_RELAXED );
+        update_mean_duration( );
+    }
+    stat_restored_regions++;
+#ifdef DYNAMIC_FILTERING_DEBUG
+    fprintf( stderr, "Restored instrumentation calls for region %s!\n", region->region_name );
+#endif
+}
+
+/**
+ * Takes the pending restore requests and adds the requested regions to the waiting ones, see
+ * restore_waiting_regions.
+ */
+static void take_restore_requests( void )
+{
+    region_info* current;
+
+    pthread_mutex_lock( &restore_mtx );
+    __atomic_store_n( &restore_pending, false, __ATOMIC_RELAXED );
+    bool all = __atomic_exchange_n( &restore_all, false, __ATOMIC_RELAXED );
+    REGION_ITER( current )
+    {
+        bool requested = all;
+        for( size_t i = 0; !requested && i < restore_name_cnt; ++i )
+        {
+            requested = strcmp( current->region_name, restore_names[i] ) == 0;
+        }
+        if( requested && !current->optimized && current->deletable && !current->restore_waiting )
+        {
+            if( restore_waiting_cnt == restore_waiting_capacity )
+            {
+                restore_waiting_capacity = restore_waiting_capacity == 0 ? 16 : 2 * restore_waiting_capacity;
+                restore_waiting = realloc( restore_waiting, restore_waiting_capacity * sizeof( region_info* ) );
+            }
+            restore_waiting[restore_waiting_cnt++] = current;
+            current->restore_waiting = true;
+            restore_retry = true;
+        }
+    }
+    for( size_t i = 0; i < restore_name_cnt; ++i )
+    {
+        free( restore_names[i] );
+    }
+    restore_name_cnt = 0;
+    pthread_mutex_unlock( &restore_mtx );
+}
+
+/**
+ * Checks whether the given return address lies within the code of a region, i.e. between its first
+ * and last call site.
+ *
+ * @param   region                          The region.
+ * @param   ip                              The return address.
+ */
+static bool is_region_return_address( const region_info*                             region,
+                                      uintptr_t                                      ip )
+{
+    uintptr_t low = UINTPTR_MAX, high = 0;
+    for( uint32_t i = 0; i < region->enter_sites.cnt + region->exit_sites.cnt; ++i )
+    {
+        uintptr_t site = (uintptr_t) ( i < region->enter_sites.cnt
+                                       ? CALL_SITE( &region->enter_sites, i )
+                                       : CALL_SITE( &region->exit_sites, i - region->enter_sites.cnt ) );
+        low = site < low ? site : low;
+        high = site + 5 > high ? site + 5 : high;
+    }
+    return ip > low && ip <= high;
+}
+
+/**
+ * Restores the waiting regions that aren't active anymore.
+ *
+ * The activations of a deleted region aren't recorded, so the call path of the main thread is
+ * searched for return addresses within a waiting region's code, like apply_filter_cache does.
+ * Restoring the exit calls of an active region would produce exit events without enter events, and
+ * restoring only its enter calls would produce enter events of new activations whose exit calls
+ * are still deleted. So active regions keep waiting and are checked again later.
+ * Other threads could enter a deleted region right after any check, so regions are only restored
+ * if no team is running. The call sites are only queued, see delete_regions.
+ *
+ * @param   single_threaded                 Whether there's only one thread present.
+ * @param   timestamp                       Time of the event triggering the restore.
+ */
+static void restore_waiting_regions( bool                                           single_threaded,
+                                     uint64_t                                       timestamp )
+{
+    // A join checks the waiting regions again, see on_join.
+    restore_retry = false;
+    if( !single_threaded || restore_waiting_cnt == 0 )
+    {
+        return;
+    }
+
+    uintptr_t ips[256];
+    size_t ip_cnt = get_call_path( ips, sizeof( ips ) / sizeof( ips[0] ) );
+    bool complete = ip_cnt < sizeof( ips ) / sizeof( ips[0] );
+
+    size_t kept = 0;
+    for( size_t i = 0; i < restore_waiting_cnt; ++i )
+    {
+        region_info* region = restore_waiting[i];
+        bool active = !complete;
+        for( size_t j = 0; j < ip_cnt && !active; ++j )
+        {
+            active = is_region_return_address( region, ips[j] );
+        }
+        if( active )
+        {
+            restore_waiting[kept++] = region;
+            continue;
+        }
+        region->restore_waiting = false;
+        restore_region( region, timestamp );
+    }
+    restore_waiting_cnt = kept;
+}
+
+void scorep_dynamic_filtering_restore( const char*                                  region_name )
+{
+    pthread_mutex_lock( &restore_mtx );
+    if( region_name == NULL )
+    {
+        __atomic_store_n( &restore_all, true, __ATOMIC_RELAXED );
+    }
+    else
+    {
+        if( restore_name_cnt == restore_name_capacity )
+        {
+            restore_name_capacity = restore_name_capacity == 0 ? 16 : 2 * restore_name_capacity;
+            restore_names = realloc( restore_names, restore_name_capacity * sizeof( char* ) );
+        }
+        restore_names[restore_name_cnt++] = strdup( region_name );
+    }
+    __atomic_store_n( &restore_pending, true, __ATOMIC_RELEASE );
+    pthread_mutex_unlock( &restore_mtx );
+}
+
+/**
+ * Handler of the restore signal, requests restoring all deleted regions.
+ *
+ * Only sets flags, the request is taken by the main thread at its next chance to patch.
+ */
+static void on_restore_signal( __attribute__((unused)) int                          signal )
+{
+    __atomic_store_n( &restore_all, true, __ATOMIC_RELAXED );
+    __atomic_store_n( &restore_pending, true, __ATOMIC_RELEASE );
+}
+
+/**
+ * Checks whether delete_regions might patch call sites of the given pending region right now.
+ *
+ * @param   region                          The pending region.
+ * @param   single_threaded                 Whether there's only one thread present.
+ *
+ * @return                                  Whether call sites of the region might be patched.
+ */
+static inline bool region_may_be_patched( const region_info*                        region,
+                                          bool                                      single_threaded )
+{
+    if( region->optimized || !region->deletable
+        || ( region->inactive && all_sites_patched( region ) )
+        || region->enter_sites.cnt == 0 || region->exit_sites.cnt == 0
+        || region_is_active_on_main( region ) )
+    {
+        return false;
+    }
+    return single_threaded || region->enter_sites.patched < region->enter_sites.cnt
+           || region->patch_generation <= grace_completed;
+}
+
+/**
+ * Remove all unwanted regions.
+ *
+ * This function drains the queue of pending deletions and deletes all regions in it that can be
+ * deleted right now. Regions that can't be deleted yet are put back onto the queue. The queue isn't
+ * guarded by locks because it's only accessed by the main thread, the regions handed over by other
+ * threads are appended first (see hand_over_pending). The main thread calls this function while
+ * holding thread_ctr_mtx, so no team can start meanwhile.
+ *
+ * While other threads are running (only with concurrent_patching), a region is deleted in two
+ * steps: First its enter call is deleted. Threads might have been just about to call the enter
+ * function, so the exit call is deleted only after a grace period, in which every thread handled
+ * another event, and when no thread has the region on its shadow call stack anymore. Otherwise an
+ * exit event could be lost or an exit call could be deleted whose enter call was already executed.
+ *
+ * Pending restore requests are taken first, so the restored call sites are written within the same
+ * batch. Restored regions are dropped from the queue. Requested regions that might still be active
+ * wait, see restore_waiting_regions.
+ *
+ * @param   single_threaded                 Whether there's only one thread present.
+ * @param   timestamp                       Time of the event triggering the deletion.
+ */
+static void delete_regions( bool                                                    single_threaded,
+                            uint64_t                                                timestamp )
+{
+    take_handed_over( );
+    region_info* current = pending_head;
+    bool patched_enter = false;
+
+    bool sites_checked = false;
+
+    pending_head = NULL;
+    pending_tail = &pending_head;
+
+    location_reclaim( );
+
+    if( __atomic_load_n( &restore_pending, __ATOMIC_ACQUIRE ) )
+    {
+        take_restore_requests( );
+    }
+    if( restore_retry )
+    {
+        if( single_threaded && restore_waiting_cnt > 0 )
+        {
+            drop_unloaded_call_sites( );
+            sites_checked = true;
+        }
+        restore_waiting_regions( single_threaded, timestamp );
+    }
+
+    if( single_threaded )
+    {
+        // No thread can be in flight anymore.
+        grace_completed = grace_needed;
+        grace_running = false;
+    }
+    else
+    {
+        check_grace_period( );
+    }
+
+    while( current != NULL )
+    {
+        region_info* next = current->next_pending;
+        current->queued = false;
+
+        // No enter call is deleted before all exit calls are known.
+        if( !current->exits_complete && current->deletable && !current->optimized
+            && current->enter_sites.cnt > 0 )
+        {
+            complete_exit_sites( current );
+        }
+
+        // Call sites are only read and written if their objects are still loaded. The module
+        // registry is updated at most once per pass and only if something is going to be patched.
+        if( !sites_checked && region_may_be_patched( current, single_threaded ) )
+        {
+            drop_unloaded_call_sites( );
+            sites_checked = true;
+        }
+
+        if( current->optimized || !current->deletable
+            || ( current->inactive && all_sites_patched( current ) ) )
+        {
+            // Already deleted, never deletable or restored, so just drop it from the queue.
+        }
+        // Only delete the function calls if the addresses of the entry function calls and the
+        // addresses of the exit function calls are correctly set and the call stack depth for the
+        // function is zero (we're not currently in a recursive call of that function).
+        else if( current->enter_sites.cnt == 0 || current->exit_sites.cnt == 0
+                 || region_is_active_on_main( current ) )
+        {
+            // Try again later.
+            enqueue_pending( current );
+        }
+        else if( single_threaded )
+        {
+            queue_call_sites( &current->enter_sites );
+            queue_call_sites( &current->exit_sites );
+            current->inactive = true;
+            current->deleted_at = timestamp;
+            remove_from_mean_duration( current );
+#ifdef DYNAMIC_FILTERING_DEBUG
+            fprintf( stderr, "Deleted instrumentation calls for region %s!\n",
+                                                                        current->region_name );
+#endif
+        }
+        else if( current->enter_sites.patched < current->enter_sites.cnt )
+        {
+            if( call_sites_concurrently_patchable( &current->enter_sites ) )
+            {
+                queue_call_sites( &current->enter_sites );
+                current->patch_generation = grace_generation + 1;
+                grace_needed = current->patch_generation;
+                patched_enter = true;
+            }
+            enqueue_pending( current );
+        }
+        else if( current->patch_generation <= grace_completed
+                 && call_sites_concurrently_patchable( &current->exit_sites )
+                 && !region_is_active( current ) )
+        {
+            queue_call_sites( &current->exit_sites );
+            current->inactive = true;
+            current->deleted_at = timestamp;
+            remove_from_mean_duration( current );
+#ifdef DYNAMIC_FILTERING_DEBUG
+            fprintf( stderr, "Deleted instrumentation calls for region %s!\n",
+                                                                        current->region_name );
+#endif
+        }
+        else
+        {
+            enqueue_pending( current );
+        }
+
+        current = next;
+    }
+
+    // Write all NOPs (and restored call sites) at once.
+    apply_callq_overrides( );
+
+    // The grace period must only start after the enter calls have been deleted.
+    if( patched_enter && !grace_running )
+    {
+        start_grace_period( );
+    }
+}
+
+/**
+ * Team begin event.
+ *
+ * As long as there's multithreaded execution, there's no safe way to filter functions. So we've to
+ * notice the begin of a multithreaded part of execution to stop filtering.
+ *
+ * @param   scorep_location                 unused
+ * @param   timestamp                       unused
+ * @param   scorep_paradigm                 unused
+ * @param   scorep_thread_team              unused
+ */
+static void on_team_begin( __attribute__((unused)) struct SCOREP_Location*          scorep_location,
+                           __attribute__((unused)) uint64_t                         timestamp,
+                           __attribute__((unused)) SCOREP_ParadigmType              scorep_paradigm,
+                           __attribute__((unused)) SCOREP_InterimCommunicatorHandle scorep_thread_team )
+{
+    pthread_mutex_lock( &thread_ctr_mtx );
+    thread_ctr++;
+    pthread_mutex_unlock( &thread_ctr_mtx );
+}
+
+/**
+ * Team end event.
+ *
+ * See on_team_begin.
+ *
+ * @param   scorep_location                 unused
+ * @param   timestamp                       unused
+ * @param   scorep_paradigm                 unused
+ * @param   scorep_thread_team              unused
+ */
+static void on_team_end( __attribute__((unused)) struct SCOREP_Location*            scorep_location,
+                         __attribute__((unused)) uint64_t                           timestamp,
+                         __attribute__((unused)) SCOREP_ParadigmType                scorep_paradigm,
+                         __attribute__((unused)) SCOREP_InterimCommunicatorHandle   scorep_thread_team )
+{
+    pthread_mutex_lock( &thread_ctr_mtx );
+    thread_ctr--;
+    pthread_mutex_unlock( &thread_ctr_mtx );
+}
+
+/**
+ * Thread join event.
+ *
+ * This is emitted when all threads finished on_team_end. As all information is gathered in the
+ * global storage, the main thread can recalculate the metrics. Only the entries on the dirty lists
+ * of the threads are merged, so the work depends on the regions touched by the threads and not on
+ * the number of defined regions.
+ *
+ * @param scorep_location                   unused
+ * @param timestamp                         Time of the join.
+ * @param scorep_paradigm                   unused
+ */
+void on_join( __attribute__((unused)) struct SCOREP_Location*                       scorep_location,
+              uint64_t                                                              timestamp,
+              __attribute__((unused)) SCOREP_ParadigmType                           paradigm_type )
+{
+    uint64_t start = create_report ? __rdtsc( ) : 0;
+    region_vector* list = __atomic_load_n( &region_list, __ATOMIC_ACQUIRE );
+    local_info* thread;
+    size_t dirty_cnt = 0;
+
+    // The tables of the threads are walked with thread_ctr_mtx held, see location_reclaim.
+    pthread_mutex_lock( &thread_ctr_mtx );
+    location_reclaim( );
+
+    // Take the per call costs measured by the threads into account.
+    LOCATION_ITER( thread )
+    {
+        if( thread->stack != NULL && thread->min_leaf_duration < call_cost )
+        {
+            call_cost = thread->min_leaf_duration;
+        }
+        dirty_cnt += thread->dirty_cnt;
+    }
+    if( dirty_cnt > joined_capacity )
+    {
+        joined_capacity = dirty_cnt > 2 * joined_capacity ? dirty_cnt : 2 * joined_capacity;
+        joined_regions = realloc( joined_regions, joined_capacity * sizeof( region_info* ) );
+    }
+
+    // Combine the locally gathered information with the global ones. Call sites of unloaded
+    // objects mustn't be merged. Without any defined region, there's nothing to merge.
+    size_t joined_cnt = 0;
+    LOCATION_ITER( thread )
+    {
+        drop_unloaded_local_sites( thread, list != NULL ? list->size : 0 );
+        for( uint32_t j = 0; j < thread->dirty_cnt; ++j )
+        {
+            uint32_t index = thread->dirty[j];
+            region_info* to_change = list->slot[index];
+            local_region_meta* local = LOCAL_META( thread, index );
+
+            uint64_t sampled_before = to_change->sampled_cnt;
+            to_change->call_cnt += LOCAL_CALL_CNT( thread, index );
+            LOCAL_CALL_CNT( thread, index ) = 0;
+            to_change->sampled_cnt += LOCAL_SAMPLED_CNT( thread, index );
+            LOCAL_SAMPLED_CNT( thread, index ) = 0;
+            to_change->duration += LOCAL_DURATION( thread, index );
+            LOCAL_DURATION( thread, index ) = 0;
+            to_change->exclusive_duration += LOCAL_EXCLUSIVE( thread, index );
+            LOCAL_EXCLUSIVE( thread, index ) = 0;
+            local->dirty = false;
+
+            // The rule applies to the activations of other threads as well.
+            if( early_calls != 0 && to_change->sampled_cnt > sampled_before )
+            {
+                check_early_deletion( to_change, sampled_before, local->early_max, method );
+            }
+            local->early_max = 0;
+
+            // Threads may have discovered further call sites of the region.
+            add_call_site( to_change, local->enter_func, true );
+            add_call_site( to_change, local->exit_func, false );
+            if( is_tail_call( local->exit_func ) )
+            {
+                add_tail_call_sites( to_change, local->enter_func );
+            }
+            if ( !to_change->optimized && local->optimized )
+            {
+                to_change->optimized = true;
+            }
+
+            if( !to_change->joined )
+            {
+                to_change->joined = true;
+                joined_regions[joined_cnt++] = to_change;
+            }
+        }
+        thread->dirty_cnt = 0;
+    }
+
+    // Recalculate the filter decisions of the touched regions.
+    for( size_t i = 0; i < joined_cnt; ++i )
+    {
+        joined_regions[i]->joined = false;
+        update_filter_decision( joined_regions[i] );
+    }
+    if( method == FILTERING_BUDGET )
+    {
+        update_budget_threshold( timestamp );
+    }
+    if( create_report )
+    {
+        stat_joins++;
+        stat_join_cycles += __rdtsc( ) - start;
+    }
+    restore_retry = restore_waiting_cnt > 0;
+    if( thread_ctr == 0 )
+    {
+        // Single threaded execution, time for filtering.
+        delete_regions( true, timestamp );
+    }
+    else if( concurrent_patching_possible( ) )
+    {
+        delete_regions( false, timestamp );
+    }
+    pthread_mutex_unlock( &thread_ctr_mtx );
+}
+
+/**
+ * Checks whether the events of the main thread still update the metrics of the region.
+ *
+ * Regions marked as deletable or deleted aren't measured anymore. With debugging enabled, deletable
+ * regions are measured until they're deleted.
+ */
+static inline bool region_is_measured( const region_info*                           region )
+{
+#ifdef DYNAMIC_FILTERING_DEBUG
+    return !region->inactive;
+#else
+    return !region->deletable && !region->inactive;
+#endif
+}
+
+/**
+ * Enter region.
+ *
+ * This updates the region info (call counter) and decides whether or not the region instrumentation
+ * should be overwritten. If so, it checks if we're in a multi threaded environment and acts
+ * accordingly:
+ *
+ *  * multithreaded: Skip deletion and wait untill all threads are joined.
+ *  * singlethreaded: Mark the state as deletion ready and hold a mutex so that no new spawned
+ *    thread can enter a possibly deleted region.
+ *
+ * @param   timestamp                       The timestamp of the entry event.
+ * @param   region_handle                   The region that is entered.
+ * @param   is_main                         Whether the calling thread is the main thread, always
+ *                                          a constant (see on_enter_region).
+ */
+static inline __attribute__((always_inline)) void handle_enter_region( uint64_t     timestamp,
+                                                                       SCOREP_RegionHandle region_handle,
+                                                                       bool         is_main )
+{
+    // Skip the undeletable functions! Only compiler regions are defined (see on_define_region), so
+    // the lookup fails for all others.
+    if( !is_compiler_region( region_handle ) )
+    {
+        return;
+    }
+    region_info* region = lookup_region( region_handle );
+    local_info* local = current_local_info( );
+    if( region == NULL || local == NULL )
+    {
+        return;
+    }
+
+    // Once per runtime determine which instrumentation calls are used in this binary.
+    if( used_call == NULL )
+    {
+        get_instrumentation_call_type( );
+    }
+
+    // Untimed activations are only counted, without touching the shadow call stack. The count of
+    // open ones is read by region_is_active and handle_exit_region.
+    local_info_touch( local, region->index );
+    if( !sample_call( local, region->index ) )
+    {
+        uint32_t* unsampled = &LOCAL_UNSAMPLED( local, region->index );
+        __atomic_store_n( unsampled, *unsampled + 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    // Every timed activation is recorded, so that the durations of nested and recursive calls are
+    // right. The frame takes over the open untimed activations, they're restored on its exit.
+    uint32_t unsampled = sampling_interval > 1 ? LOCAL_UNSAMPLED( local, region->index ) : 0;
+    if( shadow_stack_push( local, region, timestamp, unsampled ) && unsampled > 0 )
+    {
+        __atomic_store_n( &LOCAL_UNSAMPLED( local, region->index ), 0, __ATOMIC_RELAXED );
+    }
+    count_event( local );
+
+    // The function could be overwritten. Process it further.
+    if( is_main )
+    {
+        if (region->optimized)
+            return;
+
+        // Check for missing instruction pointer. An enter event of a deleted region comes from a
+        // call site that hasn't been discovered so far.
+        if( !region->indexed && ( region->enter_sites.cnt == 0 || region->inactive ) )
+        {
+            char* site = get_function_call_ip( region, 1 );
+            if ( site == NULL && region->enter_sites.cnt == 0 )
+                region->optimized = true;
+            add_discovered_call_site( region, site, true );
+        }
+
+        // The depth is kept for deleted regions as well, as they might have undeleted call sites.
+        // The main thread's info is only written by the main thread itself, so there's no need for
+        // locking.
+        LOCAL_DEPTH( &main_info, region->index )++;
+    }
+    else
+    {
+        local_region_meta* info = LOCAL_META( local, region->index );
+        if (info->optimized)
+            return;
+
+        // Check for missing instruction pointer. Further call sites of deleted regions are
+        // collected in on_join. Indexed regions know all of their call sites already.
+        if( !region->indexed && ( !info->enter_func || region->inactive ) )
+        {
+            char* site = get_function_call_ip( region, 1 );
+            if ( site == NULL && !info->enter_func )
+                info->optimized = true;
+            else if ( site != NULL )
+                info->enter_func = site;
+            mark_dirty( local, region->index );
+        }
+    }
+}
+
+/**
+ * Exit region.
+ *
+ * This method contains the code for calculating metrics (see on_enter as well) and the actual
+ * instrumentation override code.
+ *
+ * @param   timestamp                       Time of the exit from the region.
+ * @param   region_handle                   The region that is exited.
+ * @param   is_main                         Whether the calling thread is the main thread, always
+ *                                          a constant (see DEFINE_EXIT_CALLBACKS).
+ * @param   handler_method                  The filtering method, always a constant.
+ */
+static inline __attribute__((always_inline)) void handle_exit_region( uint64_t      timestamp,
+                                                                      SCOREP_RegionHandle region_handle,
+                                                                      bool          is_main,
+                                                                      filtering_method handler_method )
+{
+    // Skip the undeletable functions, see on_enter_region.
+    if( !is_compiler_region( region_handle ) )
+    {
+        return;
+    }
+    region_info* region = lookup_region( region_handle );
+    local_info* local = current_local_info( );
+    if( region == NULL || local == NULL )
+    {
+        return;
+    }
+
+    // Exits are in reverse order of the enters, so as long as there are untimed activations above
+    // the topmost timed one, an untimed one is left. That's only counted like its enter.
+    uint32_t* unsampled = sampling_interval > 1 && local_info_has( local, region->index )
+                          ? &LOCAL_UNSAMPLED( local, region->index ) : NULL;
+    if( unsampled != NULL && *unsampled > 0 )
+    {
+        __atomic_store_n( unsampled, *unsampled - 1, __ATOMIC_RELAXED );
+        if( is_main && !region->optimized && region_is_measured( region ) )
+        {
+            region->call_cnt++;
+        }
+        else if( !is_main && !LOCAL_META( local, region->index )->optimized )
+        {
+            LOCAL_CALL_CNT( local, region->index )++;
+            mark_dirty( local, region->index );
+        }
+        return;
+    }
+
+    uint64_t duration, exclusive;
+    uint32_t open_unsampled;
+    bool timed = shadow_stack_pop( local, region, timestamp, &duration, &exclusive, &open_unsampled );
+    if( timed && open_unsampled > 0 )
+    {
+        __atomic_store_n( &LOCAL_UNSAMPLED( local, region->index ), open_unsampled, __ATOMIC_RELAXED );
+    }
+    count_event( local );
+
+    // This function could be overwritten. Process it further.
+    if( is_main )
+    {
+        if (region->optimized || !local_info_has( &main_info, region->index ))
+            return;
+
+        if( LOCAL_DEPTH( &main_info, region->index ) > 0 )
+        {
+            LOCAL_DEPTH( &main_info, region->index )--;
+        }
+
+        // Check for missing instruction pointer, see on_enter_region.
+        if( !region->indexed && ( region->exit_sites.cnt == 0 || region->inactive ) )
+        {
+            char* site = get_function_call_ip( region, 0 );
+            if ( site == NULL && region->exit_sites.cnt == 0
+                 && !add_tail_call_sites( region, region->enter_sites.cnt > 0
+                                                  ? CALL_SITE( &region->enter_sites, 0 ) : NULL ) )
+                region->optimized = true;
+            add_discovered_call_site( region, site, false );
+        }
+
+        // If the region already has been deleted or marked as deletable, skip the next steps.
+        if( region_is_measured( region ) && timed )
+        {
+            region->call_cnt++;
+            region->sampled_cnt++;
+            region->duration += duration;
+            region->exclusive_duration += exclusive;
+
+            if( evaluation_due( region, timestamp ) )
+            {
+                apply_filter_method( region, handler_method );
+            }
+            if( early_calls != 0 )
+            {
+                check_early_deletion( region, region->sampled_cnt - 1,
+                                      handler_method == FILTERING_EXCLUSIVE ? exclusive : duration,
+                                      handler_method );
+            }
+        }
+        if( handler_method == FILTERING_BUDGET && --budget_countdown == 0 )
+        {
+            budget_countdown = BUDGET_CHECK_EVENTS;
+            update_budget_threshold( timestamp );
+        }
+        if( restore_waiting_cnt > 0 && --restore_countdown == 0 )
+        {
+            restore_countdown = RESTORE_RETRY_EVENTS;
+            restore_retry = true;
+        }
+
+        // Only look for something to delete if there is something to delete or restore.
+        if( pending_head != NULL || __atomic_load_n( &handed_over, __ATOMIC_RELAXED ) != NULL
+            || restore_retry || __atomic_load_n( &restore_pending, __ATOMIC_RELAXED ) )
+        {
+            pthread_mutex_lock( &thread_ctr_mtx );
+            if( thread_ctr == 0 )
+            {
+                // Single threaded execution, time for filtering.
+                delete_regions( true, timestamp );
+            }
+            else if( concurrent_patching_possible( ) )
+            {
+                delete_regions( false, timestamp );
+            }
+            pthread_mutex_unlock( &thread_ctr_mtx );
+        }
+    }
+    else if( local_info_has( local, region->index ) )
+    {
+        local_region_meta* info = LOCAL_META( local, region->index );
+        if (info->optimized)
+            return;
+        mark_dirty( local, region->index );
+        // Region not (yet) ready for deletion so update the metrics.
+        if( timed )
+        {
+            LOCAL_CALL_CNT( local, region->index )++;
+            LOCAL_SAMPLED_CNT( local, region->index )++;
+            LOCAL_DURATION( local, region->index ) += duration;
+            LOCAL_EXCLUSIVE( local, region->index ) += exclusive;
+
+            // Only the first activations since the last join are of interest for the early rule.
+            uint64_t value = handler_method == FILTERING_EXCLUSIVE ? exclusive : duration;
+            if( early_calls != 0 && LOCAL_SAMPLED_CNT( local, region->index ) <= early_calls
+                && value > info->early_max )
+            {
+                info->early_max = value;
+            }
+        }
+
+        // Check for missing instruction pointer, see on_enter_region.
+        if( !region->indexed && ( !info->exit_func || region->inactive ) )
+        {
+            char* site = get_function_call_ip( region, 0 );
+            char* tail_calls[MAX_TAIL_CALL_SITES];
+            if ( site == NULL && !info->exit_func && find_tail_call_sites( info->enter_func, tail_calls ) > 0 )
+                info->exit_func = tail_calls[0];
+            else if ( site == NULL && !info->exit_func )
+                info->optimized = true;
+            else if ( site != NULL )
+                info->exit_func = site;
+        }
+    }
+}
+
+/**
+ * Adds the costs of one event callback to the stats of the calling location.
+ *
+ * @param   start                           Cycle counter when the callback was entered.
+ * @param   timestamp                       Time of the event.
+ * @param   is_main                         Whether the calling thread is the main thread.
+ */
+static inline __attribute__((always_inline)) void count_callback( uint64_t          start,
+                                                                  uint64_t          timestamp,
+                                                                  bool              is_main )
+{
+    local_info* local = current_local_info( );
+    if( local != NULL )
+    {
+        local->stats.events++;
+        local->stats.callback_cycles += __rdtsc( ) - start;
+    }
+    if( is_main )
+    {
+        if( stat_first_timestamp == 0 )
+        {
+            stat_first_timestamp = timestamp;
+        }
+        stat_last_timestamp = timestamp;
+    }
+}
+
+/**
+ * Signature of the enter and exit region callbacks.
+ */
+typedef void ( *region_callback )( struct SCOREP_Location*, uint64_t, SCOREP_RegionHandle, uint64_t* );
+
+/**
+ * Enter region callback, see handle_enter_region.
+ *
+ * The main thread and the other threads run separately specialized handlers.
+ */
+static void on_enter_region( __attribute__((unused)) struct SCOREP_Location*        scorep_location,
+                             uint64_t                                               timestamp,
+                             SCOREP_RegionHandle                                    region_handle,
+                             __attribute__((unused)) uint64_t*                      metric_values )
+{
+    if( main_thread )
+    {
+        handle_enter_region( timestamp, region_handle, true );
+    }
+    else
+    {
+        handle_enter_region( timestamp, region_handle, false );
+    }
+}
+
+/**
+ * Enter region callback measuring the costs of the plugin, used if a report is requested.
+ */
+static void on_enter_region_report( __attribute__((unused)) struct SCOREP_Location* scorep_location,
+                                    uint64_t                                        timestamp,
+                                    SCOREP_RegionHandle                             region_handle,
+                                    __attribute__((unused)) uint64_t*               metric_values )
+{
+    uint64_t start = __rdtsc( );
+    if( main_thread )
+    {
+        handle_enter_region( timestamp, region_handle, true );
+        count_callback( start, timestamp, true );
+    }
+    else
+    {
+        handle_enter_region( timestamp, region_handle, false );
+        count_callback( start, timestamp, false );
+    }
+}
+
+/**
+ * Defines the exit region callbacks of one filtering method, see handle_exit_region.
+ *
+ * on_exit_region_<name> only handles the event, on_exit_region_<name>_report measures the costs of
+ * the plugin as well. The filtering method and the thread role are constants in both, so the
+ * compiler drops the code of the other methods and roles. event_functions picks the callbacks
+ * matching the configuration.
+ *
+ * @param   name                            Suffix of the callbacks.
+ * @param   handler_method                  The filtering method.
+ */
+#define DEFINE_EXIT_CALLBACKS( name, handler_method )                                                   \
+    static void on_exit_region_##name( __attribute__((unused)) struct SCOREP_Location* scorep_location, \
+                                       uint64_t timestamp, SCOREP_RegionHandle region_handle,          \
+                                       __attribute__((unused)) uint64_t* metric_values )               \
+    {                                                                                                   \
+        if( main_thread )                                                                               \
+        {                                                                                               \
+            handle_exit_region( timestamp, region_handle, true, handler_method );                       \
+        }                                                                                               \
+        else                                                                                            \
+        {                                                                                               \
+            handle_exit_region( timestamp, region_handle, false, handler_method );                      \
+        }                                                                                               \
+    }                                                                                                   \
+                                                                                                        \
+    static void on_exit_region_##name##_report( __attribute__((unused)) struct SCOREP_Location* scorep_location, \
+                                                uint64_t timestamp, SCOREP_RegionHandle region_handle, \
+                                                __attribute__((unused)) uint64_t* metric_values )      \
+    {                                                                                                   \
+        uint64_t start = __rdtsc( );                                                                    \
+        if( main_thread )                                                                               \
+        {                                                                                               \
+            handle_exit_region( timestamp, region_handle, true, handler_method );                       \
+            count_callback( start, timestamp, true );                                                   \
+        }                                                                                               \
+        else                                                                                            \
+        {                                                                                               \
+            handle_exit_region( timestamp, region_handle, false, handler_method );                      \
+            count_callback( start, timestamp, false );                                                  \
+        }                                                                                               \
+    }
+
+DEFINE_EXIT_CALLBACKS( absolute, FILTERING_ABSOLUTE )
+DEFINE_EXIT_CALLBACKS( relative, FILTERING_RELATIVE )
+DEFINE_EXIT_CALLBACKS( exclusive, FILTERING_EXCLUSIVE )
+DEFINE_EXIT_CALLBACKS( budget, FILTERING_BUDGET )
+
+/** Exit region callbacks per filtering method, without and with measuring the plugin's costs */
+static const region_callback exit_callbacks[][2] =
+{
+    [FILTERING_ABSOLUTE]  = { on_exit_region_absolute, on_exit_region_absolute_report },
+    [FILTERING_RELATIVE]  = { on_exit_region_relative, on_exit_region_relative_report },
+    [FILTERING_EXCLUSIVE] = { on_exit_region_exclusive, on_exit_region_exclusive_report },
+    [FILTERING_BUDGET]    = { on_exit_region_budget, on_exit_region_budget_report }
+};
+
+/**
+ * Hashes a region name for the consensus (FNV-1a).
+ *
+ * @param   name                            The region name.
+ *
+ * @return                                  The hash of the name.
+ */
+static uint64_t hash_region_name( const char*                                       name )
+{
+    uint64_t hash = 14695981039346656037ull;
+    for( const unsigned char* c = (const unsigned char*) name; *c != '\0'; ++c )
+    {
+        hash = ( hash ^ *c ) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Call on Score-P's region definition event.
+ *
+ * Creates a new region_info struct in the global regions table for the newly defined region. Also
+ * notes the order of the first interim communicators, to tell which one belongs to MPI_COMM_WORLD
+ * (see on_mpi_collective_end).
+ *
+ * @param   handle                          Generic handle type identifying the region.
+ * @param   type                            Type specifier for the handle.
+ */
+static void on_define_region( SCOREP_AnyHandle                                      handle,
+                              SCOREP_HandleType                                     type )
+{
+    if( type == SCOREP_HANDLE_TYPE_INTERIM_COMMUNICATOR )
+    {
+        uint32_t position = __atomic_fetch_add( &early_comm_cnt, 1, __ATOMIC_RELAXED );
+        if( position < EARLY_COMMUNICATOR_CNT )
+        {
+            __atomic_store_n( &early_comms[position], handle, __ATOMIC_RELEASE );
+        }
+        return;
+    }
+
+    // This plugin can only handle compiler instrumentation, so we can safely ignore all other
+    // regions.
+    if( type != SCOREP_HANDLE_TYPE_REGION
+        || callbacks->SCOREP_RegionHandle_GetParadigmType( handle ) != SCOREP_PARADIGM_COMPILER )
+    {
+        return;
+    }
+
+    // Check if this region handle is already registered, as this shouldn't happen.
+    region_info* new = lookup_region( handle );
+    if( new == NULL )
+    {
+        const char* region_name = callbacks->SCOREP_RegionHandle_GetCanonicalName( handle );
+
+        size_t name_size = strlen( region_name ) + 1;
+
+        new = definition_arena_alloc( sizeof( region_info ), __alignof__( region_info ) );
+        new->region_handle = handle;
+        new->in_mean = true;
+        __atomic_fetch_add( &mean_duration_cnt, 1, __ATOMIC_RELAXED );
+        new->region_name = definition_arena_alloc( name_size, 1 );
+        memcpy( new->region_name, region_name, name_size );
+        if( consensus )
+        {
+            new->consensus_slot = hash_region_name( region_name ) % consensus_slot_cnt;
+        }
+
+        // Regions deleted on startup because of the filter cache are known to be deleted.
+        if( cache_entry_cnt > 0 )
+        {
+            size_t cached = filter_cache_lookup( region_name );
+            if( cached != SIZE_MAX )
+            {
+                cache_state[cached] |= CACHE_SEEN;
+                if( cache_state[cached] & CACHE_APPLIED )
+                {
+                    const filter_cache_entry* entry = filter_cache_get( cached );
+                    const uint64_t* offsets = filter_cache_sites( entry );
+                    for( uint32_t i = 0; i < entry->enter_cnt + entry->exit_cnt; ++i )
+                    {
+                        call_sites_add( i < entry->enter_cnt ? &new->enter_sites : &new->exit_sites,
+                                        (char*) ( base_pointer + offsets[i] ) );
+                    }
+                    new->enter_sites.patched = new->enter_sites.cnt;
+                    new->exit_sites.patched = new->exit_sites.cnt;
+                    new->deletable = true;
+                    new->inactive = true;
+                    remove_from_mean_duration( new );
+                }
+            }
+        }
+
+        // Take the call sites from the index, so they don't have to be discovered at runtime. They
+        // come after the cached ones, so sites the cache doesn't know are deleted later on.
+        char* const* enter_sites;
+        char* const* exit_sites;
+        size_t enter_cnt, exit_cnt;
+        bool index_added = false;
+        if( use_callsite_index
+            && callsite_index_lookup( region_name, &enter_sites, &enter_cnt, &exit_sites, &exit_cnt ) )
+        {
+            for( size_t i = 0; i < enter_cnt; ++i )
+            {
+                index_added |= call_sites_add( &new->enter_sites, enter_sites[i] );
+            }
+            for( size_t i = 0; i < exit_cnt; ++i )
+            {
+                index_added |= call_sites_add( &new->exit_sites, exit_sites[i] );
+            }
+            new->exits_complete = true;
+            new->indexed = true;
+        }
+
+        // Append the region to the list of all regions ...
+        new->index = region_count( );
+        region_vector_reserve( &region_list, new->index + 1, UINT32_MAX );
+        region_list->slot[new->index] = new;
+        __atomic_store_n( &region_list->size, new->index + 1, __ATOMIC_RELEASE );
+
+        // ... and make it available for lookups.
+        if( handle < DENSE_REGION_LIMIT )
+        {
+            region_vector_reserve( &region_table, handle + 1, DENSE_REGION_LIMIT );
+            __atomic_store_n( &region_table->slot[handle], new, __ATOMIC_RELEASE );
+            mark_compiler_region( handle );
+        }
+        else
+        {
+            region_hash_add( new );
+        }
+
+        // A cached region with further call sites has to be deleted again. The queue belongs to the
+        // main thread, other threads hand the region over.
+        if( index_added && new->inactive )
+        {
+            if( main_thread )
+            {
+                enqueue_pending( new );
+            }
+            else
+            {
+                hand_over_pending( new );
+            }
+        }
+    }
+    else
+    {
+        exit( EXIT_FAILURE );
+    }
+}
+
+/**
+ * Called whenever a location is created.
+ *
+ * When a location (e.g. an OpenMP thread) is created, we have to copy all region definitions into
+ * a location-local storage to gain a lock free data access.
+ *
+ * @param   location                        The location which is created (unused).
+ * @param   parent_location                 The location's parent location (unused).
+ */
+void on_create_location( const struct SCOREP_Location*                                    location,
+                         __attribute__((unused)) const struct SCOREP_Location*            parent_location )
+{
+    if( callbacks->SCOREP_Location_GetId( location ) == 0 )
+    {
+        // Mark the main thread as the main thread.
+        main_thread = true;
+        shadow_stack_alloc( &main_info );
+    }
+    else
+    {
+        // All other threads store their info in a slot of the location registry to avoid
+        // synchronization. Their tables are allocated on demand, see local_info_touch.
+        pthread_mutex_lock( &num_threads_mtx );
+        local_info* local = location_acquire( );
+        local->location_id = callbacks->SCOREP_Location_GetId( location );
+        local->generation = module_registry_generation( );
+        shadow_stack_alloc( local );
+        num_threads++;
+        pthread_mutex_unlock( &num_threads_mtx );
+
+        current_local = local;
+    }
+}
+
+/**
+ * Called whenever a location is deleted.
+ *
+ * If a location (e.g. a OpenMP thread) is deleted, its data is not needed any longer. So it can
+ * safely be deleted and its slot of the location registry can be reused. The location is looked up
+ * by its id, as this isn't necessarily called by the thread of the location.
+ *
+ * @param   location                        The location which is deleted.
+ */
+void on_delete_location( const struct SCOREP_Location*                                    location )
+{
+    uint64_t id = callbacks->SCOREP_Location_GetId( location );
+    local_info* local;
+    if( id == 0 )
+    {
+        return;
+    }
+
+    // The stack and tables are only freed by location_reclaim, the main thread might be reading them.
+    pthread_mutex_lock( &num_threads_mtx );
+    LOCATION_ITER( local )
+    {
+        if( local->stack != NULL && local->location_id == id )
+        {
+            retired_stats.events += local->stats.events;
+            retired_stats.callback_cycles += local->stats.callback_cycles;
+            retired_stats.discoveries += local->stats.discoveries;
+            retired_stats.discovery_cycles += local->stats.discovery_cycles;
+            location_retire( local );
+            num_threads--;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &num_threads_mtx );
+}
+
+/**
+ * The plugin's initialization method.
+ *
+ * Just sets some default values and reads some environment variables.
+ */
+static int init( void )
+{
+    // Get the threshold for filtering.
+    char* env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_THRESHOLD" );
+    if( env_str != NULL )
+    {
+        threshold = strtoull( env_str, NULL, 10 );
+        if( threshold == 0 )
+        {
+            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_THRESHOLD or set "
+                             "to 0.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    // Get the number of calls between two evaluations of the filter criteria.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_EVAL_INTERVAL" );
+    if( env_str != NULL )
+    {
+        eval_interval = strtoull( env_str, NULL, 10 );
+    }
+
+    // Get the number of activations per timed one.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_SAMPLING_INTERVAL" );
+    if( env_str != NULL )
+    {
+        sampling_interval = strtoul( env_str, NULL, 10 );
+    }
+
+    // Get the time between two evaluations of the filter criteria.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_EVAL_TIME" );
+    if( env_str != NULL )
+    {
+        eval_time = strtoull( env_str, NULL, 10 );
+    }
+
+    // Get the size of the shadow call stacks.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_STACK_SIZE" );
+    if( env_str != NULL )
+    {
+        stack_size = strtoul( env_str, NULL, 10 );
+        if( stack_size == 0 )
+        {
+            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_STACK_SIZE or set "
+                             "to 0.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    // Get the wanted filtering method.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_METHOD" );
+    method = FILTERING_ABSOLUTE;
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "relative" ) == 0 || strcmp( env_str, "dynamic" ) == 0 )
+        {
+            method = FILTERING_RELATIVE;
         }
-        if( filtering_absolute )
+        else if( strcmp( env_str, "exclusive" ) == 0 )
         {
-            // We're filtering absolute so just compare this region's mean duration with the
-            // threshold.
-            if( ( (float) to_change->duration / to_change->call_cnt ) < threshold )
+            // This method needs the exclusive durations.
+            method = FILTERING_EXCLUSIVE;
+            exclusive_time = true;
+        }
+        else if( strcmp( env_str, "budget" ) == 0 )
+        {
+            // This method needs the per call costs, which are measured with the exclusive durations.
+            method = FILTERING_BUDGET;
+            exclusive_time = true;
+        }
+    }
+
+    // Untimed calls don't show up on the shadow call stack, so their time isn't subtracted from the
+    // exclusive durations of their parents. The exclusive method would filter by the wrong values.
+    if( method == FILTERING_EXCLUSIVE && sampling_interval > 1 )
+    {
+        fprintf( stderr, "The exclusive filtering method times every call, "
+                         "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_SAMPLING_INTERVAL is ignored.\n" );
+        sampling_interval = 1;
+    }
+
+    // Get the share of the runtime the instrumentation may take with the budget method.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_OVERHEAD_BUDGET" );
+    if( env_str != NULL )
+    {
+        overhead_budget = strtof( env_str, NULL );
+        if( overhead_budget <= 0 )
+        {
+            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_OVERHEAD_BUDGET or "
+                             "set to 0.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+    if( method == FILTERING_BUDGET )
+    {
+        calibrate_call_cost( );
+    }
+
+    // Get the ratio of own work to instrumentation costs used by the exclusive method.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_COST_FACTOR" );
+    if( env_str != NULL )
+    {
+        cost_factor = strtof( env_str, NULL );
+        if( cost_factor <= 0 )
+        {
+            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_COST_FACTOR or set "
+                             "to 0.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    // Get the number of short calls after which a region is filtered right away.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_EARLY_CALLS" );
+    if( env_str != NULL )
+    {
+        early_calls = strtoull( env_str, NULL, 10 );
+    }
+
+    // Get the share of the threshold these calls have to stay below.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_EARLY_FRACTION" );
+    if( env_str != NULL )
+    {
+        early_fraction = strtof( env_str, NULL );
+        if( early_fraction <= 0 )
+        {
+            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_EARLY_FRACTION or "
+                             "set to 0.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    // Get the per call costs, if the user doesn't want them to be measured.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CALL_COST" );
+    if( env_str != NULL )
+    {
+        fixed_call_cost = strtoull( env_str, NULL, 10 );
+    }
+
+    // SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONTINUE_DESPITE_FAILURE is still accepted, but the plugin
+    // always continues, regions that can't be re-written are only reported.
+
+    // Check whether exclusive durations should be gathered.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_EXCLUSIVE_TIME" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
+        {
+            exclusive_time = true;
+        }
+    }
+
+    // Get the wanted filtering method.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CREATE_REPORT" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
+        {
+            create_report = true;
+        }
+    }
+
+    // Get the output format of the report.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_REPORT_FORMAT" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "csv" ) == 0 )
+        {
+            output_format = REPORT_CSV;
+        }
+        else if( strcmp( env_str, "json" ) == 0 )
+        {
+            output_format = REPORT_JSON;
+        }
+    }
+
+    // Get the wanted filtering method.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CREATE_FILTER_FILE" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
+        {
+            create_filter = true;
+        }
+    }
+
+    // Check whether all ranks should agree on one filter file.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONSENSUS" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
+        {
+            consensus = true;
+        }
+    }
+
+    // Get the number of collectives between two exchanges of the statistics during the run.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONSENSUS_INTERVAL" );
+    if( env_str != NULL )
+    {
+        consensus_interval = strtoull( env_str, NULL, 10 );
+        consensus_countdown = consensus_interval;
+    }
+
+    // Get the number of slots the statistics are reduced into, three sums per slot have to fit into
+    // one reduction.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONSENSUS_SLOTS" );
+    if( env_str != NULL )
+    {
+        unsigned long long slots = strtoull( env_str, NULL, 10 );
+        if( slots == 0 || slots > INT32_MAX / 3 )
+        {
+            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONSENSUS_SLOTS or "
+                             "out of range.\n" );
+            exit( EXIT_FAILURE );
+        }
+        consensus_slot_cnt = slots;
+    }
+
+    // Check whether call sites should be patched while other threads are running.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONCURRENT_PATCHING" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
+        {
+            concurrent_patching = true;
+        }
+    }
+
+    // Modified code has to be made visible to all cores, which requires membarrier.
+    if( concurrent_patching )
+    {
+        long supported = syscall( __NR_membarrier, MEMBARRIER_CMD_QUERY, 0 );
+        if( supported > 0 && ( supported & MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE )
+            && syscall( __NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0 ) == 0 )
+        {
+            membarrier_cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE;
+        }
+        // The interrupt used for the expedited barrier serializes the cores on x86 as well.
+        else if( supported > 0 && ( supported & MEMBARRIER_CMD_PRIVATE_EXPEDITED )
+                 && syscall( __NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0 ) == 0 )
+        {
+            membarrier_cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+        }
+        else
+        {
+            fprintf( stderr, "Concurrent patching is not supported by the kernel, call sites will "
+                             "only be patched during single threaded execution.\n" );
+            concurrent_patching = false;
+        }
+    }
+
+    // Check whether deleted regions should be restored on a signal.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_RESTORE_SIGNAL" );
+    if( env_str != NULL )
+    {
+        struct sigaction action;
+        memset( &action, 0, sizeof( action ) );
+        action.sa_handler = on_restore_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset( &action.sa_mask );
+        int restore_signal = atoi( env_str );
+        if( restore_signal <= 0 || sigaction( restore_signal, &action, NULL ) != 0 )
+        {
+            fprintf( stderr, "Could not install the handler for the restore signal %s.\n", env_str );
+        }
+    }
+
+    // Score-P opens the plugin without RTLD_GLOBAL, which hides scorep_dynamic_filtering_restore
+    // from the application. Opening it again with RTLD_GLOBAL adds it to the global scope.
+    Dl_info self_info;
+    if( dladdr( &restore_mtx, &self_info ) != 0 && self_info.dli_fname != NULL )
+    {
+        global_handle = dlopen( self_info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_GLOBAL );
+    }
+    if( global_handle == NULL )
+    {
+        fprintf( stderr, "Could not make scorep_dynamic_filtering_restore visible to the "
+                         "application.\n" );
+    }
+
+    // Get the page size of the system we're running on.
+    page_size = sysconf( _SC_PAGE_SIZE );
+
+    // Resolve the known instrumentation calls once, instead of on every call site lookup.
+    for( size_t i = 0; i < INSTRUMENTATION_CALL_CNT; ++i )
+    {
+        instrumentation_calls[i].enter_target = dlsym( RTLD_DEFAULT, instrumentation_calls[i].enter_name );
+        instrumentation_calls[i].exit_target = dlsym( RTLD_DEFAULT, instrumentation_calls[i].exit_name );
+    }
+    module_registry_init( );
+    checked_generation = module_registry_generation( );
+
+    // Check whether the call sites should be collected ahead of time.
+    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CALLSITE_INDEX" );
+    if( env_str != NULL )
+    {
+        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
+        {
+            void* enter_targets[INSTRUMENTATION_CALL_CNT];
+            void* exit_targets[INSTRUMENTATION_CALL_CNT];
+            for( size_t i = 0; i < INSTRUMENTATION_CALL_CNT; ++i )
             {
-                to_change->deletable = true;
+                enter_targets[i] = instrumentation_calls[i].enter_target;
+                exit_targets[i] = instrumentation_calls[i].exit_target;
             }
+            use_callsite_index = callsite_index_build( enter_targets, exit_targets,
+                                                       INSTRUMENTATION_CALL_CNT ) > 0;
         }
-        else
+    }
+
+    base_pointer = module_registry_program( ) != NULL ? module_registry_program( )->begin : 0;
+
+    // Delete the regions known from previous runs right away.
+    cache_file = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CACHE_FILE" );
+    if( cache_file != NULL )
+    {
+        apply_filter_cache( );
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the internal Score-P id for this plugin.
+ *
+ * The id is needed in order to give a proper return value in the finalizing method.
+ *
+ * @param   s_id                            Score-Ps internal id for this plugin.
+ */
+static void assign( size_t                                                          s_id )
+{
+    id = s_id;
+}
+
+/**
+ * Returns the status of a region shown in the report.
+ */
+static const char* region_status( const region_info*                                region )
+{
+    return region->optimized ? "compiler-optimized"
+                             : region->deletable ? ( region->inactive ? "deleted" : "deletable" ) : "";
+}
+
+/**
+ * Appends one row of the plugin statistics to the report and adds it to the given total.
+ */
+static void print_location_stats( output_buffer*                                    out,
+                                  const char*                                       name,
+                                  const plugin_stats*                               stats,
+                                  plugin_stats*                                     total )
+{
+    output_buffer_printf( out, "| %-12s | %12lu | %18lu | %12lu | %18lu |\n",
+                          name, stats->events, stats->callback_cycles, stats->discoveries,
+                          stats->discovery_cycles );
+    total->events += stats->events;
+    total->callback_cycles += stats->callback_cycles;
+    total->discoveries += stats->discoveries;
+    total->discovery_cycles += stats->discovery_cycles;
+}
+
+/**
+ * Estimates the calls avoided by deleting regions.
+ *
+ * A deleted region is assumed to be called as often after its deletion as before, measured from the
+ * first event of the main thread.
+ */
+static double estimate_avoided_calls( void )
+{
+    double avoided_calls = 0;
+    region_info* current;
+    REGION_ITER( current )
+    {
+        if( current->inactive && current->call_cnt > 0 && current->deleted_at > stat_first_timestamp
+            && stat_last_timestamp > current->deleted_at )
         {
-            // We're filtering relative so first update all regions' mean durations and then
-            // compare the duration of this region with the mean of all regions.
-            if( to_change->call_cnt == 0 )
+            avoided_calls += (double) current->call_cnt * ( stat_last_timestamp - current->deleted_at )
+                             / ( current->deleted_at - stat_first_timestamp );
+        }
+    }
+    return avoided_calls;
+}
+
+/**
+ * Appends the costs of the plugin itself and an estimate of the costs avoided by deleting regions
+ * to the report.
+ *
+ * Every avoided call (see estimate_avoided_calls) is assumed to cost the per call costs (see
+ * get_call_cost).
+ */
+static void print_plugin_stats( output_buffer*                                      out )
+{
+    plugin_stats total;
+    local_info* local;
+    char name[32];
+
+    memset( &total, 0, sizeof( total ) );
+    output_buffer_printf( out, "\nPlugin statistics:\n\n" );
+    output_buffer_printf( out, "|   Location   |    Events    |  Callback cycles   |  Discoveries |  Discovery cycles  |\n" );
+    print_location_stats( out, "main", &main_info.stats, &total );
+    LOCATION_ITER( local )
+    {
+        if( local->stack != NULL )
+        {
+            snprintf( name, sizeof( name ), "%lu", local->location_id );
+            print_location_stats( out, name, &local->stats, &total );
+        }
+    }
+    if( retired_stats.events > 0 )
+    {
+        print_location_stats( out, "deleted", &retired_stats, &total );
+    }
+    print_location_stats( out, "total", &total, &( plugin_stats ){ 0 } );
+
+    output_buffer_printf( out, "\nmprotect calls: %lu\n", stat_mprotect_calls );
+    output_buffer_printf( out, "Overridden call sites: %lu (%lu bytes)\n", stat_patched_sites,
+                          stat_patched_bytes );
+    output_buffer_printf( out, "Restored regions: %lu\n", stat_restored_regions );
+    output_buffer_printf( out, "Regions filtered early: %lu\n", stat_early_regions );
+    output_buffer_printf( out, "Call sites of unloaded objects: %lu\n", stat_dropped_sites );
+    output_buffer_printf( out, "Joins: %lu (%lu cycles)\n", stat_joins, stat_join_cycles );
+
+    double avoided_calls = estimate_avoided_calls( );
+    output_buffer_printf( out, "Estimated avoided calls: %.0f\n", avoided_calls );
+    uint64_t cost = get_call_cost( );
+    if( cost != UINT64_MAX )
+    {
+        output_buffer_printf( out, "Estimated avoided instrumentation costs: %.0f ticks (%lu per call)\n",
+                              avoided_calls * cost, cost );
+    }
+    output_buffer_printf( out, "\n" );
+}
+
+/**
+ * Appends the report as ASCII tables.
+ */
+static void print_table_report( output_buffer*                                      out )
+{
+    region_info* current;
+
+    output_buffer_printf( out, "\n\nFinalizing.\n\n\n" );
+    output_buffer_printf( out, "Global mean duration: %f\n\n", mean_duration );
+    if( method == FILTERING_EXCLUSIVE )
+    {
+        output_buffer_printf( out, "Per call costs: %lu\n\n", get_call_cost( ) );
+    }
+    if( method == FILTERING_BUDGET )
+    {
+        output_buffer_printf( out, "Overhead budget: %.2f%%, estimated overhead at the last check: %.2f%%\n",
+                              overhead_budget, budget_overhead * 100 );
+        output_buffer_printf( out, "Cut-off: %.2f, calibrated plugin costs: %lu cycles per call\n\n",
+                              budget_threshold, calibrated_cycles );
+    }
+    output_buffer_printf( out, "|                  Region Name                  "
+                               "| Region handle "
+                               "| Call count "
+                               "|        Duration        "
+                               "%s"
+                               "|   Mean duration  "
+                               "|       Status       |\n",
+                               exclusive_time ? "|   Exclusive duration   " : "" );
+    REGION_ITER( current )
+    {
+        output_buffer_printf( out, "| %-45s | %13d | %10lu | %22lu ",
+                              current->region_name,
+                              current->region_handle,
+                              current->call_cnt,
+                              current->duration );
+        if( exclusive_time )
+        {
+            output_buffer_printf( out, "| %22lu ", current->exclusive_duration );
+        }
+        output_buffer_printf( out, "| %16.2f | %-18s |\n",
+                              current->mean_duration,
+                              region_status( current ) );
+    }
+    print_plugin_stats( out );
+}
+
+/**
+ * Appends the report as CSV, one line per region.
+ */
+static void print_csv_report( output_buffer*                                        out )
+{
+    region_info* current;
+
+    output_buffer_printf( out, "name,handle,call_count,sampled_count,duration,exclusive_duration,"
+                               "mean_duration,status\n" );
+    REGION_ITER( current )
+    {
+        output_buffer_csv_string( out, current->region_name );
+        output_buffer_printf( out, ",%u,%lu,%lu,%lu,%lu,%.2f,%s\n",
+                              current->region_handle,
+                              current->call_cnt,
+                              current->sampled_cnt,
+                              current->duration,
+                              current->exclusive_duration,
+                              current->mean_duration,
+                              region_status( current ) );
+    }
+}
+
+/**
+ * Appends the statistics of one location to the JSON report.
+ */
+static void print_json_location( output_buffer*                                     out,
+                                 uint64_t                                           location_id,
+                                 const plugin_stats*                                stats,
+                                 bool                                               first )
+{
+    output_buffer_printf( out, "%s\n    { \"location\": %lu, \"events\": %lu, \"callback_cycles\": %lu, "
+                               "\"discoveries\": %lu, \"discovery_cycles\": %lu }",
+                          first ? "" : ",", location_id, stats->events, stats->callback_cycles,
+                          stats->discoveries, stats->discovery_cycles );
+}
+
+/**
+ * Appends the report as JSON object with the settings, the regions and the plugin statistics.
+ */
+static void print_json_report( output_buffer*                                       out )
+{
+    const char* method_names[] = { "absolute", "relative", "exclusive", "budget" };
+    region_info* current;
+    local_info* local;
+    bool first = true;
+
+    output_buffer_printf( out, "{\n  \"method\": \"%s\",\n  \"threshold\": %llu,\n"
+                               "  \"mean_duration\": %f,\n",
+                          method_names[method], threshold, mean_duration );
+    uint64_t cost = get_call_cost( );
+    if( cost != UINT64_MAX )
+    {
+        output_buffer_printf( out, "  \"call_cost\": %lu,\n", cost );
+    }
+    if( method == FILTERING_BUDGET )
+    {
+        output_buffer_printf( out, "  \"overhead_budget\": %f,\n  \"estimated_overhead\": %f,\n"
+                                   "  \"cut_off\": %f,\n  \"calibrated_cycles\": %lu,\n",
+                              overhead_budget / 100, budget_overhead, budget_threshold,
+                              calibrated_cycles );
+    }
+
+    output_buffer_printf( out, "  \"regions\": [" );
+    REGION_ITER( current )
+    {
+        output_buffer_printf( out, "%s\n    { \"name\": ", first ? "" : "," );
+        output_buffer_json_string( out, current->region_name );
+        output_buffer_printf( out, ", \"handle\": %u, \"call_count\": %lu, \"sampled_count\": %lu, "
+                                   "\"duration\": %lu, \"exclusive_duration\": %lu, "
+                                   "\"mean_duration\": %.2f, \"status\": \"%s\" }",
+                              current->region_handle, current->call_cnt, current->sampled_cnt,
+                              current->duration, current->exclusive_duration,
+                              current->mean_duration, region_status( current ) );
+        first = false;
+    }
+
+    output_buffer_printf( out, "\n  ],\n  \"locations\": [" );
+    print_json_location( out, 0, &main_info.stats, true );
+    LOCATION_ITER( local )
+    {
+        if( local->stack != NULL )
+        {
+            print_json_location( out, local->location_id, &local->stats, false );
+        }
+    }
+    output_buffer_printf( out, "\n  ],\n  \"deleted_locations\": { \"events\": %lu, "
+                               "\"callback_cycles\": %lu, \"discoveries\": %lu, "
+                               "\"discovery_cycles\": %lu },\n",
+                          retired_stats.events, retired_stats.callback_cycles,
+                          retired_stats.discoveries, retired_stats.discovery_cycles );
+    output_buffer_printf( out, "  \"mprotect_calls\": %lu,\n  \"overridden_sites\": %lu,\n"
+                               "  \"overridden_bytes\": %lu,\n  \"restored_regions\": %lu,\n"
+                               "  \"early_regions\": %lu,\n  \"dropped_sites\": %lu,\n"
+                               "  \"joins\": %lu,\n  \"join_cycles\": %lu,\n"
+                               "  \"estimated_avoided_calls\": %.0f\n}\n",
+                          stat_mprotect_calls, stat_patched_sites, stat_patched_bytes,
+                          stat_restored_regions, stat_early_regions, stat_dropped_sites, stat_joins, stat_join_cycles,
+                          estimate_avoided_calls( ) );
+}
+
+/**
+ * Writes the report in the configured format.
+ *
+ * The whole report is built in memory first. Tables are written to stderr with a single write call,
+ * CSV and JSON reports to df-report.<pid>.csv or .json in the experiment directory.
+ */
+static void write_report( void )
+{
+    output_buffer out = { NULL, 0, 0 };
+    char filename[1024];
+
+    switch( output_format )
+    {
+        case REPORT_TABLE:
+            print_table_report( &out );
+            output_buffer_write( &out, STDERR_FILENO );
+            break;
+        case REPORT_CSV:
+        case REPORT_JSON:
+        {
+            if( output_format == REPORT_CSV )
             {
-                to_change->mean_duration = 0;
+                print_csv_report( &out );
             }
             else
             {
-                to_change->mean_duration = (float) to_change->duration / to_change->call_cnt;
+                print_json_report( &out );
             }
-
-            update_mean_duration( );
-
-            if( to_change->mean_duration < mean_duration - threshold )
+            snprintf( filename, sizeof( filename ), "%s/df-report.%d.%s",
+                      callbacks->SCOREP_GetExperimentDirName( ), getpid( ),
+                      output_format == REPORT_CSV ? "csv" : "json" );
+            int fd = open( filename, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR );
+            if( fd < 0 || !output_buffer_write( &out, fd ) )
+            {
+                fprintf( stderr, "Couldn't write report %s.\n", filename );
+            }
+            if( fd >= 0 )
             {
-                to_change->deletable = true;
+                close( fd );
             }
+            break;
         }
     }
-    pthread_mutex_lock( &thread_ctr_mtx );
-    if( thread_ctr == 0 )
-    {
-        // Single threaded execution, time for filtering.
-        delete_regions( );
-    }
-    pthread_mutex_unlock( &thread_ctr_mtx );
+    output_buffer_free( &out );
 }
 
 /**
- * Enter region.
- *
- * This updates the region info (call counter) and decides whether or not the region instrumentation
- * should be overwritten. If so, it checks if we're in a multi threaded environment and acts
- * accordingly:
+ * Compares two region names, for sorting an array of them.
+ */
+static int compare_region_name( const void*                                         a,
+                                const void*                                         b )
+{
+    return strcmp( *(char* const*) a, *(char* const*) b );
+}
+
+/**
+ * Reduces the region statistics of all ranks and decides which slots are excluded.
  *
- *  * multithreaded: Skip deletion and wait untill all threads are joined.
- *  * singlethreaded: Mark the state as deletion ready and hold a mutex so that no new spawned
- *    thread can enter a possibly deleted region.
+ * Every rank adds the statistics of its regions to the slots their names hash to. The slots are
+ * summed up over all ranks by allreduces of a fixed size, independent of the number of ranks and
+ * regions, so every rank gets the same sums and takes the same decision without further
+ * communication. The filtering method is applied to the sums of each slot, using the smallest per
+ * call costs and the highest budget cut-off of all ranks. Slots without timed calls are excluded if
+ * a rank deleted one of their regions (e.g. because of the filter cache). Slots holding a region
+ * optimized beyond repair on any rank are excluded as well, like in the filter file of a single
+ * rank.
  *
- * @param   scorep_location                 unused
- * @param   timestamp                       The timestamp of the entry event.
- * @param   region_handle                   The region that is entered.
- * @param   metric_values                   unused
+ * Has to be called by the main threads of all ranks at the same point, the statistics belong to
+ * the main thread.
  */
-static void on_enter_region( __attribute__((unused)) struct SCOREP_Location*        scorep_location,
-                             uint64_t                                               timestamp,
-                             SCOREP_RegionHandle                                    region_handle,
-                             __attribute__((unused)) uint64_t*                      metric_values )
+static void reduce_consensus( void )
 {
-    if (printed_warning && !continue_despite) return;
-    // Skip the undeletable functions!
-    if( callbacks->SCOREP_RegionHandle_GetParadigmType( region_handle ) != SCOREP_PARADIGM_COMPILER )
+    size_t sum_cnt = 3 * (size_t) consensus_slot_cnt;
+    if( consensus_sums == NULL )
     {
-        return;
+        // The second half of the arrays takes the contribution of this rank.
+        consensus_sums = malloc( 2 * sum_cnt * sizeof( uint64_t ) );
+        consensus_flags = malloc( 2 * consensus_slot_cnt * sizeof( uint32_t ) );
+        consensus_excluded = malloc( consensus_slot_cnt * sizeof( bool ) );
     }
+    uint64_t* sums = consensus_sums + sum_cnt;
+    uint32_t* flags = consensus_flags + consensus_slot_cnt;
+    memset( sums, 0, sum_cnt * sizeof( uint64_t ) );
+    memset( flags, 0, consensus_slot_cnt * sizeof( uint32_t ) );
 
-    // Once per runtime determine which instrumentation calls are used in this binary.
-    if( !enter_func || !exit_func )
+    uint32_t root_flag = callbacks->SCOREP_Ipc_GetRank( ) == 0 ? CONSENSUS_ON_ROOT : 0;
+    region_info* current;
+    REGION_ITER( current )
     {
-        get_instrumentation_call_type( );
+        uint32_t slot = current->consensus_slot;
+        sums[3 * slot] += current->sampled_cnt;
+        sums[3 * slot + 1] += current->duration;
+        sums[3 * slot + 2] += current->exclusive_duration;
+        flags[slot] |= ( current->inactive ? CONSENSUS_DELETED : 0 )
+                       | ( current->optimized ? CONSENSUS_OPTIMIZED : 0 ) | root_flag;
     }
 
-    // The function could be overwritten. Process it further.
-    if( main_thread )
-    {
-        region_info* region;
-        HASH_FIND( hh, regions, &region_handle, sizeof( uint32_t ), region );
-
-        if (region->optimized)
-            return;
-
-        // Check for missing instruction pointer.
-        if( !region->enter_func )
-        {
-            region->enter_func = get_function_call_ip( 1 );
-            if ( region->enter_func == NULL )
-                region->optimized = true;
-        }
+    // The smallest per call costs are the largest negated ones, unknown costs are the smallest.
+    uint64_t cost = get_call_cost( );
+    double limits[2] = { -(double) cost, budget_threshold };
+    double reduced_limits[2];
+    callbacks->SCOREP_Ipc_Allreduce( sums, consensus_sums, (int) sum_cnt, SCOREP_IPC_UINT64_T,
+                                     SCOREP_IPC_SUM );
+    callbacks->SCOREP_Ipc_Allreduce( flags, consensus_flags, (int) consensus_slot_cnt,
+                                     SCOREP_IPC_UINT32_T, SCOREP_IPC_BOR );
+    callbacks->SCOREP_Ipc_Allreduce( limits, reduced_limits, 2, SCOREP_IPC_DOUBLE, SCOREP_IPC_MAX );
+    double min_cost = -reduced_limits[0];
+    double cutoff = reduced_limits[1];
 
-        // If the current region is already deleted, skip this whole thing.
-        if( !region->inactive )
+    // The relative method compares with the mean of all slots.
+    double mean_sum = 0;
+    size_t mean_cnt = 0;
+    for( uint32_t i = 0; i < consensus_slot_cnt; ++i )
+    {
+        if( consensus_sums[3 * i] > 0 )
         {
-            pthread_mutex_lock( &mtx );
-            region->last_enter = timestamp;
-            region->depth++;
-            pthread_mutex_unlock( &mtx );
+            mean_sum += (double) consensus_sums[3 * i + 1] / consensus_sums[3 * i];
+            mean_cnt++;
         }
     }
-    else if( local_info_array_index < MAX_THREAD_CNT )
+    double global_mean = mean_cnt > 0 ? mean_sum / mean_cnt : 0;
+
+    for( uint32_t i = 0; i < consensus_slot_cnt; ++i )
     {
-        local_region_info* info;
-        HASH_FIND( hh, local_info_array[local_info_array_index], &region_handle, sizeof( uint32_t ),
-                                                                                            info );
-        if( info != NULL )
+        uint64_t sampled = consensus_sums[3 * i];
+        uint32_t slot_flags = consensus_flags[i];
+        bool excluded = ( slot_flags & CONSENSUS_OPTIMIZED )
+                        || ( sampled == 0 && ( slot_flags & CONSENSUS_DELETED ) );
+        if( !excluded && sampled > 0 )
         {
-            if (info->optimized)
-                return;
-
-            // Store the last (this) entry for the current thread.
-            info->last_enter = timestamp;
-
-            // Check for missing instruction pointer.
-            if( !info->enter_func )
+            double mean = (double) consensus_sums[3 * i + 1] / sampled;
+            switch( method )
             {
-                info->enter_func = get_function_call_ip( 1 );
-                if ( info->enter_func == NULL )
-                    info->optimized = true;
+                case FILTERING_ABSOLUTE:
+                    excluded = mean < threshold;
+                    break;
+                case FILTERING_RELATIVE:
+                    excluded = mean < global_mean - threshold;
+                    break;
+                case FILTERING_EXCLUSIVE:
+                    excluded = min_cost < (double) UINT64_MAX
+                               && (double) consensus_sums[3 * i + 2] / sampled < cost_factor * min_cost;
+                    break;
+                case FILTERING_BUDGET:
+                    // The cut-off is the mean of the last region filtered by update_budget_threshold.
+                    excluded = mean <= cutoff;
+                    break;
             }
         }
+        consensus_excluded[i] = excluded;
     }
 }
 
 /**
- * Exit region.
+ * Called by Score-P on all ranks before the unification.
  *
- * This method contains the code for calculating metrics (see on_enter as well) and the actual
- * instrumentation override code.
- *
- * @param   scorep_location                 unused
- * @param   timestamp                       Time of the exit from the region.
- * @param   region_handle                   The region that is exited.
- * @param   metric_values                   unused
+ * With consensus, the statistics of all ranks are reduced once more to decide on one common filter
+ * file, see reduce_consensus. This covers the whole run, including the time since the last exchange
+ * of on_mpi_collective_end. Rank 0 writes the file, it knows the names of its own regions. Only the
+ * names of excluded regions in slots none of its regions hashes to are gathered from the other
+ * ranks.
  */
-static void on_exit_region( __attribute__((unused)) struct SCOREP_Location*         scorep_location,
-                            uint64_t                                                timestamp,
-                            SCOREP_RegionHandle                                     region_handle,
-                            __attribute__((unused)) uint64_t*                       metric_values )
+static void on_pre_unify( void )
 {
-    if (printed_warning && !continue_despite) return;
-    // Skip the undeletable functions!
-    if( callbacks->SCOREP_RegionHandle_GetParadigmType( region_handle ) != SCOREP_PARADIGM_COMPILER )
+    if( !consensus || !create_filter )
     {
         return;
     }
 
-    // This function could be overwritten. Process it further.
-    if( main_thread )
-    {
-        region_info* region;
-        HASH_FIND( hh, regions, &region_handle, sizeof( uint32_t ), region );
+    reduce_consensus( );
 
-        if (region->optimized)
-            return;
+    int rank_cnt = callbacks->SCOREP_Ipc_GetSize( );
+    int rank = callbacks->SCOREP_Ipc_GetRank( );
+    output_buffer names = { NULL, 0, 0 };
+    region_info* current;
+    REGION_ITER( current )
+    {
+        uint32_t slot = current->consensus_slot;
+        if( consensus_excluded[slot] && ( rank == 0 || !( consensus_flags[slot] & CONSENSUS_ON_ROOT ) ) )
+        {
+            // The names are separated by their terminating NUL.
+            output_buffer_printf( &names, "%s%c", current->region_name, '\0' );
+        }
+    }
 
-        region->depth--;
+    // A rank whose names might overflow the total size sends none and reports -1, so the gathered
+    // data always fits into one message.
+    bool fits = names.size <= (size_t) INT32_MAX / rank_cnt;
+    int send_size = rank > 0 && fits ? (int) names.size : 0;
+    int size_flag = rank > 0 && !fits ? -1 : send_size;
+    int* sizes = rank == 0 ? calloc( rank_cnt, sizeof( int ) ) : NULL;
+    int* counts = rank == 0 ? calloc( rank_cnt, sizeof( int ) ) : NULL;
+    callbacks->SCOREP_Ipc_Gather( &size_flag, sizes, 1, SCOREP_IPC_INT, 0 );
+    size_t total = 0;
+    bool dropped = false;
+    for( int i = 0; rank == 0 && i < rank_cnt; ++i )
+    {
+        counts[i] = sizes[i] > 0 ? sizes[i] : 0;
+        dropped = dropped || sizes[i] < 0;
+        total += counts[i];
+    }
+    char* gathered = rank == 0 ? malloc( total > 0 ? total : 1 ) : NULL;
+    callbacks->SCOREP_Ipc_Gatherv( names.data, send_size, gathered, counts, SCOREP_IPC_BYTE, 0 );
 
-        // Check for missing instruction pointer.
-        if( !region->exit_func )
+    if( rank == 0 )
+    {
+        // Collect the names of rank 0 and the gathered ones, sorted and without duplicates.
+        size_t capacity = 1;
+        for( size_t i = 0; i < names.size; ++i )
         {
-            region->exit_func = get_function_call_ip( 0 );
-            if ( region->exit_func == NULL )
-                region->optimized = true;
+            capacity += names.data[i] == '\0';
         }
-
-        // If the region already has been deleted or marked as deletable, skip the next steps.
-#ifdef DYNAMIC_FILTERING_DEBUG
-        if( !region->inactive )
-#else
-        if( !region->deletable && !region->inactive )
-#endif
+        for( size_t i = 0; i < total; ++i )
         {
-            region->call_cnt++;
-            region->duration += ( timestamp - region->last_enter );
-
-            if( filtering_absolute )
-            {
-                // We're filtering absolute so just compare this region's mean duration with the
-                // threshold.
-                if( ( (float) region->duration / region->call_cnt ) < threshold )
-                {
-                    region->deletable = true;
-                }
-            }
-            else
+            capacity += gathered[i] == '\0';
+        }
+        consensus_names = malloc( capacity * sizeof( char* ) );
+        for( size_t i = 0; i < names.size; i += strlen( names.data + i ) + 1 )
+        {
+            consensus_names[consensus_name_cnt++] = strdup( names.data + i );
+        }
+        for( size_t i = 0; i < total; i += strnlen( gathered + i, total - i ) + 1 )
+        {
+            consensus_names[consensus_name_cnt++] = strndup( gathered + i, total - i );
+        }
+        qsort( consensus_names, consensus_name_cnt, sizeof( char* ), compare_region_name );
+        size_t unique = 0;
+        for( size_t i = 0; i < consensus_name_cnt; ++i )
+        {
+            if( unique > 0 && strcmp( consensus_names[unique - 1], consensus_names[i] ) == 0 )
             {
-                // We're filtering relative so first update all regions' mean durations and then
-                // compare the duration of this region with the mean of all regions.
-                if( region->call_cnt == 0 )
-                {
-                    region->mean_duration = 0;
-                }
-                else
-                {
-                    region->mean_duration = (float) region->duration / region->call_cnt;
-                }
-
-                update_mean_duration( );
-
-                if( region->mean_duration < mean_duration - threshold )
-                {
-                    region->deletable = true;
-                }
+                free( consensus_names[i] );
+                continue;
             }
+            consensus_names[unique++] = consensus_names[i];
         }
-
-        pthread_mutex_lock( &thread_ctr_mtx );
-        if( thread_ctr == 0 )
+        consensus_name_cnt = unique;
+        if( dropped )
         {
-            // Single threaded execution, time for filtering.
-            delete_regions( );
+            fprintf( stderr, "Too many function names for the consensus on the filter file, some "
+                             "functions are missing in it.\n" );
         }
-        pthread_mutex_unlock( &thread_ctr_mtx );
     }
-    else if( local_info_array_index < MAX_THREAD_CNT )
-    {
-        local_region_info* info;
-        HASH_FIND( hh, local_info_array[local_info_array_index], &region_handle, sizeof( uint32_t ),
-                                                                                            info );
+    consensus_done = true;
 
-        if( info != NULL )
-        {
-            if (info->optimized)
-                return;
-            // Region not (yet) ready for deletion so update the metrics.
-            info->call_cnt++;
-            info->duration += ( timestamp - info->last_enter );
+    free( gathered );
+    free( counts );
+    free( sizes );
+    output_buffer_free( &names );
+}
 
-            // Check for missing instruction pointer.
-            if( !info->exit_func )
-            {
-                info->exit_func = get_function_call_ip(  0 );
-                if ( info->exit_func == NULL )
-                    info->optimized = true;
-            }
+/**
+ * Exchanges the region statistics of all ranks during the run.
+ *
+ * All ranks take the same decision (see reduce_consensus), so the regions in excluded slots are
+ * marked as deletable right away. Regions a rank has already deleted on its own stay deleted. Only
+ * called by the main thread, which owns the queue of pending regions.
+ */
+static void share_consensus( void )
+{
+    reduce_consensus( );
+
+    region_info* current;
+    REGION_ITER( current )
+    {
+        if( !current->deletable && !current->optimized && consensus_excluded[current->consensus_slot] )
+        {
+            mark_deletable( current );
         }
     }
 }
 
 /**
- * Call on Score-P's region definition event.
+ * MPI collective end event, exchanges the statistics of all ranks periodically (see
+ * SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONSENSUS_INTERVAL).
  *
- * Creates a new region_info struct in the global regions table for the newly defined region.
+ * The exchange needs a point all ranks reach at once, i.e. a collective on MPI_COMM_WORLD. Only MPI
+ * communicators show up in this event, thread teams (e.g. the initial OpenMP team, which may be
+ * defined before MPI_Init) never do. Score-P defines MPI_COMM_WORLD while initializing MPI, before
+ * any other MPI communicator, so it is the earliest defined communicator among those of the
+ * collectives (see on_define_region). Communicators derived from it are created by collectives on
+ * it, so it shows up before them. A collective on an earlier defined communicator than the one
+ * taken so far (e.g. on MPI_COMM_SELF first) corrects it and restarts the count, so all ranks count
+ * the same collectives from the first one on MPI_COMM_WORLD on.
  *
- * @param   handle                          Generic handle type identifying the region.
- * @param   type                            Type specifier for the handle.
+ * Only the collectives of the main thread are counted and the exchange runs on the main thread, so
+ * the plugin never communicates from another thread (e.g. with MPI_THREAD_FUNNELED). Collectives on
+ * one communicator are ordered by the program, so every rank counts the same ones.
+ *
+ * @param   scorep_location                 unused
+ * @param   timestamp                       unused
+ * @param   communicator                    Communicator of the collective.
+ * @param   root_rank                       unused
+ * @param   collective_type                 unused
+ * @param   bytes_sent                      unused
+ * @param   bytes_received                  unused
  */
-static void on_define_region( SCOREP_AnyHandle                                      handle,
-                              SCOREP_HandleType                                     type )
+static void on_mpi_collective_end( __attribute__((unused)) struct SCOREP_Location*  scorep_location,
+                                   __attribute__((unused)) uint64_t                 timestamp,
+                                   SCOREP_InterimCommunicatorHandle                 communicator,
+                                   __attribute__((unused)) SCOREP_MpiRank           root_rank,
+                                   __attribute__((unused)) SCOREP_CollectiveType    collective_type,
+                                   __attribute__((unused)) uint64_t                 bytes_sent,
+                                   __attribute__((unused)) uint64_t                 bytes_received )
 {
-    if (printed_warning && !continue_despite) return;
-    // This plugin can only handle compiler instrumentation, so we can safely ignore all other
-    // regions.
-    if( type != SCOREP_HANDLE_TYPE_REGION
-        || callbacks->SCOREP_RegionHandle_GetParadigmType( handle ) != SCOREP_PARADIGM_COMPILER )
+    if( !main_thread || communicator == SCOREP_INVALID_INTERIM_COMMUNICATOR )
     {
         return;
     }
 
-    region_info* new;
-
-    // Check if this region handle is already registered, as this shouldn't happen.
-    HASH_FIND( hh, regions, &handle, sizeof( uint32_t ), new );
-    if( new == NULL )
+    // Communicators defined later than the one of MPI_COMM_WORLD are skipped right away.
+    uint32_t cnt = __atomic_load_n( &early_comm_cnt, __ATOMIC_ACQUIRE );
+    if( cnt > EARLY_COMMUNICATOR_CNT )
     {
-        const char* region_name = callbacks->SCOREP_RegionHandle_GetCanonicalName( handle );
-
-        new = calloc( 1, sizeof( region_info ) );
-        new->region_handle = handle;
-        new->region_name = calloc( 1, strlen( region_name ) * sizeof( char ) );
-        memcpy( new->region_name, region_name, strlen( region_name ) * sizeof( char ) );
-
-        HASH_ADD( hh, regions, region_handle, sizeof( uint32_t ), new );
+        cnt = EARLY_COMMUNICATOR_CNT;
     }
-    else
+    if( world_position < cnt )
     {
-        exit( EXIT_FAILURE );
+        cnt = world_position + 1;
     }
-}
-
-/**
- * Called whenever a location is created.
- *
- * When a location (e.g. an OpenMP thread) is created, we have to copy all region definitions into
- * a location-local storage to gain a lock free data access.
- *
- * @param   location                        The location which is created (unused).
- * @param   parent_location                 The location's parent location (unused).
- */
-void on_create_location( const struct SCOREP_Location*                                    location,
-                         __attribute__((unused)) const struct SCOREP_Location*            parent_location )
-{
-    if (printed_warning && !continue_despite) return;
-    if( callbacks->SCOREP_Location_GetId( location ) == 0 )
+    uint32_t position = 0;
+    while( position < cnt && __atomic_load_n( &early_comms[position], __ATOMIC_ACQUIRE ) != communicator )
     {
-        // Mark the main thread as the main thread.
-        main_thread = true;
+        position++;
     }
-    else
+    if( position == cnt )
     {
-        // Get array index for thread local storage
-        pthread_mutex_lock( &num_threads_mtx );
-        local_info_array_index = num_threads;
-        num_threads++;
-        pthread_mutex_unlock( &num_threads_mtx );
-
-        if( local_info_array_index >= MAX_THREAD_CNT )
-        {
-            fprintf( stderr, "Maximum thread count reached. No information gathered for this thread."
-                             " To increase the maximum number of observable threads you need to "
-                             "recompile the plugin.\n" );
-            return;
-        }
-
-        // All other threads store their info in thread local storage to avoid synchronization.
-        region_info *current, *tmp;
-        local_region_info* new;
-
-        HASH_ITER( hh, regions, current, tmp )
-        {
-            new = calloc( 1, sizeof( local_region_info ) );
-            new->region_handle = current->region_handle;
-            HASH_ADD( hh, local_info_array[local_info_array_index], region_handle,
-                                                                        sizeof( uint32_t ), new );
-        }
+        return;
     }
-}
-
-/**
- * Called whenever a location is deleted.
- *
- * If a location (e.g. a OpenMP thread) is deleted, its data is not needed any longer. So it can
- * safely be deleted.
- *
- * @param   location                        The location which is deleted (unused).
- */
-void on_delete_location( __attribute__((unused)) const struct SCOREP_Location*            location )
-{
-    if (printed_warning && !continue_despite) return;
-    if( local_info_array_index < MAX_THREAD_CNT )
+    if( position < world_position )
     {
-        local_region_info *current, *tmp;
-
-        HASH_ITER( hh, local_info_array[local_info_array_index], current, tmp )
-        {
-            HASH_DEL( local_info_array[local_info_array_index], current );
-            free( current );
-        }
-
-        local_info_array[local_info_array_index] = NULL;
+        world_position = position;
+        consensus_countdown = consensus_interval;
+    }
+    if( --consensus_countdown == 0 )
+    {
+        consensus_countdown = consensus_interval;
+        share_consensus( );
     }
-
-    pthread_mutex_lock( &num_threads_mtx );
-    num_threads--;
-    pthread_mutex_unlock( &num_threads_mtx );
 }
 
 /**
- * The plugin's initialization method.
+ * Writes the given filter file, an already existing file is kept as backup (<filename>.old).
  *
- * Just sets some default values and reads some environment variables.
+ * @param   filename                        Path of the filter file.
+ * @param   filter                          Contents of the filter file.
  */
-static int init( void )
+static void write_filter_file( const char*                                          filename,
+                               const output_buffer*                                 filter )
 {
-    // Get the threshold for filtering.
-    char* env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_THRESHOLD" );
-    if( env_str != NULL )
-    {
-        threshold = strtoull( env_str, NULL, 10 );
-        if( threshold == 0 )
-        {
-            fprintf( stderr, "Unable to parse SCOREP_SUBSTRATE_DYNAMIC_FILTERING_THRESHOLD or set "
-                             "to 0.\n" );
-            exit( EXIT_FAILURE );
-        }
-    }
-
-    // Get the wanted filtering method.
-    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_METHOD" );
-    filtering_absolute = true;
-    if( env_str != NULL )
+    char backup[PATH_MAX + sizeof( ".old" )];
+    if( snprintf( backup, sizeof( backup ), "%s.old", filename ) >= ( int )sizeof( backup ) )
     {
-        if( strcmp( env_str, "dynamic" ) == 0 )
-        {
-            filtering_absolute = false;
-        }
+        fprintf( stderr, "Couldn't create filter list, path too long.\n" );
+        return;
     }
 
-    // Get the wanted filtering method.
-    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CONTINUE_DESPITE_FAILURE" );
-    if( env_str != NULL )
+    int fd = open( filename, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR );
+    if( fd < 0 && errno == EEXIST )
     {
-        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
-        {
-            continue_despite = true;
-        }
+        // File could not be created because it already exists. Let's move it as a backup.
+        rename( filename, backup );
+        fd = open( filename, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR );
     }
-
-    // Get the wanted filtering method.
-    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CREATE_REPORT" );
-    if( env_str != NULL )
+    if( fd < 0 || !output_buffer_write( filter, fd ) )
     {
-        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
-        {
-            create_report = true;
-        }
+        // File still could not be created. Dump an error message.
+        fprintf( stderr, "Couldn't create filter list.\n" );
     }
-
-    // Get the wanted filtering method.
-    env_str = getenv( "SCOREP_SUBSTRATE_DYNAMIC_FILTERING_CREATE_FILTER_FILE" );
-    if( env_str != NULL )
+    if( fd >= 0 )
     {
-        if( strcmp( env_str, "true" ) == 0 || strcmp( env_str, "True" ) == 0 || strcmp( env_str, "TRUE" ) == 0 || strcmp( env_str, "1" ) == 0 )
-        {
-            create_filter = true;
-        }
+        close( fd );
     }
-
-    FILE* maps=fopen("/proc/self/maps","r");
-    fscanf(maps,"%llx",&base_pointer);
-    fclose(maps);
-
-    return 0;
 }
 
 /**
- * Gets the internal Score-P id for this plugin.
- *
- * The id is needed in order to give a proper return value in the finalizing method.
+ * Appends one excluded region to the contents of a filter file.
  *
- * @param   s_id                            Score-Ps internal id for this plugin.
+ * @param   filter                          Contents of the filter file.
+ * @param   name                            Name of the region.
+ * @param   first                           Whether it's the first excluded region.
  */
-static void assign( size_t                                                          s_id )
+static void write_filter_entry( output_buffer*                                      filter,
+                                const char*                                         name,
+                                bool                                                first )
 {
-    id = s_id;
+    output_buffer_printf( filter, first ? "EXCLUDE %s\n" : "        %s\n", name );
 }
 
 /**
@@ -894,76 +6032,48 @@ static void on_write_data( void )
 {
     if ( create_report )
     {
-        fprintf( stderr, "\n\nFinalizing.\n\n\n" );
-        fprintf( stderr, "Global mean duration: %f\n\n", mean_duration );
-        fprintf( stderr, "|                  Region Name                  "
-                         "| Region handle "
-                         "| Call count "
-                         "|        Duration        "
-                         "|   Mean duration  "
-                         "|       Status       |\n" );
-        region_info *current, *tmp;
-
-        HASH_ITER( hh, regions, current, tmp )
-        {
-            fprintf( stderr, "| %-45s | %13d | %10lu | %22lu | %16.2f | %-18s |\n",
-                        current->region_name,
-                        current->region_handle,
-                        current->call_cnt,
-                        current->duration,
-                        current->mean_duration,
-                        current->optimized ? "compiler-optimized" : current->deletable ? ( current->inactive ? "deleted" : "deletable" ) : " " );
-        }
+        write_report( );
+    }
+    if( cache_file != NULL )
+    {
+        store_filter_cache( );
     }
-    if ( create_filter )
+
+    // Rank 0 writes the filter file agreed on by all ranks, without consensus every process writes
+    // its own.
+    if( create_filter && ( !consensus_done || consensus_names != NULL ) )
     {
-        char filename[1024], backup[1024];
-        sprintf( filename, "%s/df-filter.list.%d", callbacks->SCOREP_GetExperimentDirName(), getpid() );
-        printf("%s\n",filename);
-        sprintf( backup, "%s.old", filename );
+        output_buffer filter = { NULL, 0, 0 };
+        char filename[1024];
+        region_info* current;
+        bool first = true;
 
-        int fd = open( filename, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR );
-        if( fd < 0 && errno == EEXIST )
+        output_buffer_printf( &filter, "SCOREP_REGION_NAMES_BEGIN\n" );
+        if( consensus_done )
         {
-            // File could not be created because it already exists. Let's move it as a backup.
-            rename( filename, backup );
-            fd = open( filename, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR );
+            snprintf( filename, sizeof( filename ), "%s/df-filter.list",
+                      callbacks->SCOREP_GetExperimentDirName( ) );
+            for( size_t i = 0; i < consensus_name_cnt; ++i )
+            {
+                write_filter_entry( &filter, consensus_names[i], i == 0 );
+            }
         }
-
-        if( fd > 0 )
+        else
         {
-            // File could be created. Write a Score-P filter file to it.
-            FILE* fp = fdopen( fd, "w" );
-
-            fprintf( fp, "SCOREP_REGION_NAMES_BEGIN\n" );
-
-            region_info *current, *tmp;
-            bool first = true;
-
-            HASH_ITER( hh, regions, current, tmp )
+            snprintf( filename, sizeof( filename ), "%s/df-filter.list.%d",
+                      callbacks->SCOREP_GetExperimentDirName( ), getpid( ) );
+            REGION_ITER( current )
             {
                 if( current->inactive || current->optimized )
                 {
-                    if( first )
-                    {
-                        fprintf( fp, "EXCLUDE %s\n", current->region_name );
-                        first = false;
-                    }
-                    else
-                    {
-                        fprintf( fp, "        %s\n", current->region_name );
-                    }
+                    write_filter_entry( &filter, current->region_name, first );
+                    first = false;
                 }
             }
-
-            fprintf( fp, "SCOREP_REGION_NAMES_END\n" );
-            fclose( fp );
-        }
-        else
-        {
-            // File still could not be created. Dump an error message.
-            fprintf( stderr, "Couldn't create filter list.\n" );
         }
+        output_buffer_printf( &filter, "SCOREP_REGION_NAMES_END\n" );
+        write_filter_file( filename, &filter );
+        output_buffer_free( &filter );
     }
 }
 
@@ -974,16 +6084,80 @@ static void on_write_data( void )
  */
 static void finalize( void )
 {
+    region_hash_free( );
+    local_info_free( &main_info );
+    shadow_stack_free( &main_info );
+    location_registry_free( );
+    free( grace_snapshot );
+    grace_snapshot = NULL;
+    grace_snapshot_capacity = 0;
+    region_vector_free( region_table );
+    region_vector_free( region_list );
+    handle_bitmap_free( );
 
-    region_info *current, *tmp;
-
-    HASH_ITER( hh, regions, current, tmp )
+    free( patch_batch );
+    patch_batch = NULL;
+    patch_batch_capacity = 0;
+    free( saved_callqs );
+    saved_callqs = NULL;
+    saved_callq_cnt = 0;
+    saved_callq_capacity = 0;
+    for( size_t i = 0; i < restore_name_cnt; ++i )
+    {
+        free( restore_names[i] );
+    }
+    free( restore_names );
+    restore_names = NULL;
+    restore_name_cnt = 0;
+    restore_name_capacity = 0;
+    free( restore_waiting );
+    restore_waiting = NULL;
+    restore_waiting_cnt = 0;
+    restore_waiting_capacity = 0;
+    restore_retry = false;
+    restore_countdown = RESTORE_RETRY_EVENTS;
+    if( global_handle != NULL )
+    {
+        dlclose( global_handle );
+        global_handle = NULL;
+    }
+    free( joined_regions );
+    joined_regions = NULL;
+    joined_capacity = 0;
+    free( budget_regions );
+    budget_regions = NULL;
+    budget_capacity = 0;
+    free( consensus_sums );
+    consensus_sums = NULL;
+    free( consensus_flags );
+    consensus_flags = NULL;
+    free( consensus_excluded );
+    consensus_excluded = NULL;
+    for( size_t i = 0; i < consensus_name_cnt; ++i )
     {
-        HASH_DEL( regions, current );
-        free( current );
+        free( consensus_names[i] );
     }
+    free( consensus_names );
+    consensus_names = NULL;
+    consensus_name_cnt = 0;
+    consensus_done = false;
+    early_comm_cnt = 0;
+    world_position = EARLY_COMMUNICATOR_CNT;
+    consensus_countdown = 0;
+
+    callsite_index_free( );
+    site_arena_free( );
+    definition_arena_free( );
+    filter_cache_unload( );
+    free( cache_state );
+    cache_state = NULL;
+    cache_entry_cnt = 0;
+    module_registry_free( );
+    checked_generation = 0;
+    call_type_missed_generation = 0;
 
-    regions = NULL;
+    region_table = NULL;
+    region_list = NULL;
 }
 
 
@@ -1014,11 +6188,19 @@ static uint32_t event_functions( __attribute__((unused)) SCOREP_Substrates_Mode
     SCOREP_Substrates_Callback* ret = calloc( SCOREP_SUBSTRATES_NUM_EVENTS,
                                                     sizeof( SCOREP_Substrates_Callback ) );
 
-    ret[SCOREP_EVENT_ENTER_REGION] = (SCOREP_Substrates_Callback) on_enter_region;
-    ret[SCOREP_EVENT_EXIT_REGION]  = (SCOREP_Substrates_Callback) on_exit_region;
+    // The callbacks are fixed from now on, pick the ones specialized for the filtering method and
+    // the report. Debug output is selected at compile time already.
+    ret[SCOREP_EVENT_ENTER_REGION] = (SCOREP_Substrates_Callback) ( create_report
+                                                                    ? on_enter_region_report
+                                                                    : on_enter_region );
+    ret[SCOREP_EVENT_EXIT_REGION]  = (SCOREP_Substrates_Callback) exit_callbacks[method][create_report];
     ret[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_BEGIN]  = (SCOREP_Substrates_Callback) on_team_begin;
     ret[SCOREP_EVENT_THREAD_FORK_JOIN_TEAM_END]    = (SCOREP_Substrates_Callback) on_team_end;
     ret[SCOREP_EVENT_THREAD_FORK_JOIN_JOIN]        = (SCOREP_Substrates_Callback) on_join;
+    if( consensus && consensus_interval > 0 )
+    {
+        ret[SCOREP_EVENT_MPI_COLLECTIVE_END] = (SCOREP_Substrates_Callback) on_mpi_collective_end;
+    }
 
     *functions = ret;
     return SCOREP_SUBSTRATES_NUM_EVENTS;
@@ -1056,6 +6238,7 @@ SCOREP_SUBSTRATE_PLUGIN_ENTRY( dynamic_filtering )
     info.new_definition_handle  = on_define_region;
     info.create_location        = on_create_location;
     info.delete_location        = on_delete_location;
+    info.pre_unify              = on_pre_unify;
     info.write_data             = on_write_data;
     info.get_event_functions    = event_functions;
     info.set_callbacks          = set_callbacks;
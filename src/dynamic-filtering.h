@@ -0,0 +1,33 @@
+#ifndef DYNAMIC_FILTERING_H
+#define DYNAMIC_FILTERING_H
+
+/**
+ * Interface of the dynamic filtering plugin for the instrumented application.
+ *
+ * The plugin is loaded by Score-P at runtime, after the application has been linked and started, so
+ * applications have to look the functions up with dlsym when they need them. The plugin adds
+ * itself to the global scope during its initialization, so the lookup in RTLD_DEFAULT (needs
+ * _GNU_SOURCE) finds them. It returns NULL when the plugin isn't loaded, e.g.
+ *
+ *     scorep_dynamic_filtering_restore_fn restore;
+ *     *(void**) &restore = dlsym( RTLD_DEFAULT, "scorep_dynamic_filtering_restore" );
+ *     if( restore != NULL ) restore( "solve" );
+ */
+
+/** Type of scorep_dynamic_filtering_restore, for the lookup with dlsym */
+typedef void ( *scorep_dynamic_filtering_restore_fn )( const char*                  region_name );
+
+/**
+ * Requests restoring the instrumentation of deleted regions, e.g. when the application enters a
+ * new phase.
+ *
+ * The restored regions are measured from scratch and may be deleted again. The request is taken
+ * the next time the plugin deletes regions, i.e. on the next exit or join of the main thread, and
+ * all restored call sites are written in one batch. May be called from any thread.
+ *
+ * @param   region_name                     Canonical name of the region to restore, NULL restores
+ *                                          all deleted regions.
+ */
+void scorep_dynamic_filtering_restore( const char*                                  region_name );
+
+#endif /* DYNAMIC_FILTERING_H */
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE /* <- needed for dl_iterate_phdr */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filter-cache.h"
+
+/** Magic number of the cache file */
+#define FILTER_CACHE_MAGIC "DFCACHE"
+
+/** Version of the cache file layout */
+#define FILTER_CACHE_VERSION 2
+
+/** Key of the running binary */
+static unsigned char program_key[FILTER_CACHE_KEY_SIZE];
+
+/** Used bytes of program_key */
+static uint32_t program_key_size = 0;
+
+/** First address of the running binary */
+static uintptr_t program_begin = 0;
+
+/** Address behind the running binary */
+static uintptr_t program_end = 0;
+
+/** The mapped cache file */
+static unsigned char* cache = NULL;
+
+/** Size of the mapped cache file */
+static size_t cache_size = 0;
+
+/** Entries of the mapped cache file */
+static const filter_cache_entry* cache_entries = NULL;
+
+/** Number of entries of the mapped cache file */
+static size_t cache_entry_cnt = 0;
+
+/** Call site offsets of the mapped cache file */
+static const uint64_t* cache_sites = NULL;
+
+/** Number of call site offsets of the mapped cache file */
+static size_t cache_site_cnt = 0;
+
+/** Name table of the mapped cache file */
+static const char* cache_names = NULL;
+
+/**
+ * Reads the build-id and the address range of the running binary (callback of dl_iterate_phdr).
+ *
+ * The binary is always the first object reported, so the iteration stops after it.
+ */
+static int identify_program( struct dl_phdr_info*                                   info,
+                             __attribute__((unused)) size_t                         size,
+                             __attribute__((unused)) void*                          data )
+{
+    program_begin = UINTPTR_MAX;
+    for( size_t i = 0; i < info->dlpi_phnum; ++i )
+    {
+        const ElfW( Phdr )* phdr = &info->dlpi_phdr[i];
+        if( phdr->p_type == PT_LOAD )
+        {
+            uintptr_t begin = info->dlpi_addr + phdr->p_vaddr;
+            if( begin < program_begin )
+            {
+                program_begin = begin;
+            }
+            if( begin + phdr->p_memsz > program_end )
+            {
+                program_end = begin + phdr->p_memsz;
+            }
+        }
+        else if( phdr->p_type == PT_NOTE )
+        {
+            const unsigned char* note = (const unsigned char*) ( info->dlpi_addr + phdr->p_vaddr );
+            const unsigned char* notes_end = note + phdr->p_memsz;
+            while( note + sizeof( ElfW( Nhdr ) ) <= notes_end )
+            {
+                const ElfW( Nhdr )* nhdr = (const ElfW( Nhdr )*) note;
+                const unsigned char* name = note + sizeof( ElfW( Nhdr ) );
+                const unsigned char* desc = name + ( ( nhdr->n_namesz + 3 ) & ~3u );
+                if( nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+                    && memcmp( name, "GNU", 4 ) == 0 && nhdr->n_descsz <= FILTER_CACHE_KEY_SIZE )
+                {
+                    memcpy( program_key, desc, nhdr->n_descsz );
+                    program_key_size = nhdr->n_descsz;
+                }
+                note = desc + ( ( nhdr->n_descsz + 3 ) & ~3u );
+            }
+        }
+    }
+    return 1;
+}
+
+void filter_cache_init( void )
+{
+    dl_iterate_phdr( identify_program, NULL );
+
+    // Without build-id the binary is identified by its file attributes.
+    struct stat file_stat;
+    if( program_key_size == 0 && stat( "/proc/self/exe", &file_stat ) == 0 )
+    {
+        uint64_t values[] = { file_stat.st_dev, file_stat.st_ino, file_stat.st_size,
+                              file_stat.st_mtime };
+        uint64_t hash = 14695981039346656037ull;
+        const unsigned char* bytes = (const unsigned char*) values;
+        for( size_t i = 0; i < sizeof( values ); ++i )
+        {
+            hash = ( hash ^ bytes[i] ) * 1099511628211ull;
+        }
+        memcpy( program_key, &hash, sizeof( hash ) );
+        program_key_size = sizeof( hash );
+    }
+}
+
+bool filter_cache_in_program( uintptr_t                                             address )
+{
+    return address >= program_begin && address < program_end;
+}
+
+size_t filter_cache_load( const char*                                               path )
+{
+    filter_cache_unload( );
+
+    struct stat file_stat;
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return 0;
+    }
+    if( fstat( fd, &file_stat ) != 0 || (size_t) file_stat.st_size < sizeof( filter_cache_header ) )
+    {
+        close( fd );
+        return 0;
+    }
+    cache_size = file_stat.st_size;
+    cache = mmap( NULL, cache_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( cache == MAP_FAILED )
+    {
+        cache = NULL;
+        return 0;
+    }
+
+    // Only use caches written by this version for this binary.
+    const filter_cache_header* header = (const filter_cache_header*) cache;
+    if( memcmp( header->magic, FILTER_CACHE_MAGIC, sizeof( FILTER_CACHE_MAGIC ) ) != 0
+        || header->version != FILTER_CACHE_VERSION || header->key_size != program_key_size
+        || memcmp( header->key, program_key, program_key_size ) != 0
+        || header->entry_cnt > ( cache_size - sizeof( filter_cache_header ) ) / sizeof( filter_cache_entry )
+        || header->site_cnt > ( cache_size - sizeof( filter_cache_header )
+                                - header->entry_cnt * sizeof( filter_cache_entry ) ) / sizeof( uint64_t )
+        || header->names_size != cache_size - sizeof( filter_cache_header )
+                                 - header->entry_cnt * sizeof( filter_cache_entry )
+                                 - header->site_cnt * sizeof( uint64_t ) )
+    {
+        filter_cache_unload( );
+        return 0;
+    }
+
+    cache_entries = (const filter_cache_entry*) ( cache + sizeof( filter_cache_header ) );
+    cache_entry_cnt = header->entry_cnt;
+    cache_sites = (const uint64_t*) ( cache_entries + cache_entry_cnt );
+    cache_site_cnt = header->site_cnt;
+    cache_names = (const char*) ( cache_sites + cache_site_cnt );
+
+    // Don't trust names or call sites reaching beyond their tables.
+    if( header->names_size == 0 || cache_names[header->names_size - 1] != '\0' )
+    {
+        filter_cache_unload( );
+        return 0;
+    }
+    for( size_t i = 0; i < cache_entry_cnt; ++i )
+    {
+        if( cache_entries[i].name_offset >= header->names_size
+            || cache_entries[i].site_index > cache_site_cnt
+            || (uint64_t) cache_entries[i].enter_cnt + cache_entries[i].exit_cnt
+               > cache_site_cnt - cache_entries[i].site_index )
+        {
+            filter_cache_unload( );
+            return 0;
+        }
+    }
+    return cache_entry_cnt;
+}
+
+const filter_cache_entry* filter_cache_get( size_t                                  index )
+{
+    return &cache_entries[index];
+}
+
+const uint64_t* filter_cache_sites( const filter_cache_entry*                       entry )
+{
+    return cache_sites + entry->site_index;
+}
+
+const char* filter_cache_name( const filter_cache_entry*                            entry )
+{
+    return cache_names + entry->name_offset;
+}
+
+size_t filter_cache_lookup( const char*                                             name )
+{
+    size_t low = 0, high = cache_entry_cnt;
+    while( low < high )
+    {
+        size_t mid = ( low + high ) / 2;
+        int cmp = strcmp( name, cache_names + cache_entries[mid].name_offset );
+        if( cmp == 0 )
+        {
+            return mid;
+        }
+        else if( cmp < 0 )
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * Compares two records by their name.
+ */
+static int compare_record( const void*                                              a,
+                           const void*                                              b )
+{
+    return strcmp( ( (const filter_cache_record*) a )->name,
+                   ( (const filter_cache_record*) b )->name );
+}
+
+bool filter_cache_store( const char*                                                path,
+                         filter_cache_record*                                       records,
+                         size_t                                                     record_cnt )
+{
+    qsort( records, record_cnt, sizeof( filter_cache_record ), compare_record );
+
+    filter_cache_header header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, FILTER_CACHE_MAGIC, sizeof( FILTER_CACHE_MAGIC ) );
+    header.version = FILTER_CACHE_VERSION;
+    header.key_size = program_key_size;
+    memcpy( header.key, program_key, program_key_size );
+    header.entry_cnt = record_cnt;
+    header.names_size = 1;
+
+    filter_cache_entry* entries = calloc( record_cnt > 0 ? record_cnt : 1, sizeof( filter_cache_entry ) );
+    for( size_t i = 0; i < record_cnt; ++i )
+    {
+        entries[i].site_index = header.site_cnt;
+        entries[i].enter_cnt = records[i].enter_cnt;
+        entries[i].exit_cnt = records[i].exit_cnt;
+        entries[i].flags = records[i].flags;
+        entries[i].name_offset = header.names_size;
+        header.site_cnt += records[i].enter_cnt + records[i].exit_cnt;
+        header.names_size += strlen( records[i].name ) + 1;
+    }
+
+    char tmp_path[1024];
+    snprintf( tmp_path, sizeof( tmp_path ), "%s.%d", path, getpid( ) );
+    FILE* fp = fopen( tmp_path, "wb" );
+    if( fp == NULL )
+    {
+        free( entries );
+        return false;
+    }
+
+    // The name table starts with an empty name, so that it is never empty.
+    bool success = fwrite( &header, sizeof( header ), 1, fp ) == 1
+                   && fwrite( entries, sizeof( filter_cache_entry ), record_cnt, fp ) == record_cnt;
+    for( size_t i = 0; success && i < record_cnt; ++i )
+    {
+        size_t site_cnt = records[i].enter_cnt + records[i].exit_cnt;
+        success = fwrite( records[i].sites, sizeof( uint64_t ), site_cnt, fp ) == site_cnt;
+    }
+    success = success && fputc( '\0', fp ) != EOF;
+    for( size_t i = 0; success && i < record_cnt; ++i )
+    {
+        success = fwrite( records[i].name, strlen( records[i].name ) + 1, 1, fp ) == 1;
+    }
+    success = fclose( fp ) == 0 && success;
+    free( entries );
+
+    if( !success || rename( tmp_path, path ) != 0 )
+    {
+        unlink( tmp_path );
+        return false;
+    }
+    return true;
+}
+
+void filter_cache_unload( void )
+{
+    if( cache != NULL )
+    {
+        munmap( cache, cache_size );
+    }
+    cache = NULL;
+    cache_size = 0;
+    cache_entries = NULL;
+    cache_entry_cnt = 0;
+    cache_sites = NULL;
+    cache_site_cnt = 0;
+    cache_names = NULL;
+}
@@ -0,0 +1,146 @@
+#ifndef FILTER_CACHE_H
+#define FILTER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Persistent cache of filter decisions.
+ *
+ * The cache file stores the call sites of all deleted regions of a binary, so that the next run of
+ * the same binary can delete them right on startup. The file is keyed by the build-id of the
+ * binary (or by its file attributes if there's no build-id) and is mapped into memory for reading.
+ *
+ * Layout: a filter_cache_header, header.entry_cnt filter_cache_entry structs sorted by name,
+ * header.site_cnt call site offsets (uint64_t, relative to base_pointer) and header.names_size bytes
+ * of NUL terminated region names.
+ */
+
+/** Maximum size of the key identifying the binary */
+#define FILTER_CACHE_KEY_SIZE 32
+
+/** Flag of filter_cache_entry: the region has been deleted */
+#define FILTER_CACHE_DELETED 1
+
+/**
+ * Header of the cache file.
+ */
+typedef struct filter_cache_header
+{
+    /** "DFCACHE" */
+    char magic[8];
+    /** Version of the file layout */
+    uint32_t version;
+    /** Used bytes of key */
+    uint32_t key_size;
+    /** Build-id or hash of the binary */
+    unsigned char key[FILTER_CACHE_KEY_SIZE];
+    /** Number of entries */
+    uint64_t entry_cnt;
+    /** Number of call site offsets */
+    uint64_t site_cnt;
+    /** Size of the name table */
+    uint64_t names_size;
+} filter_cache_header;
+
+/**
+ * A region stored in the cache file.
+ */
+typedef struct filter_cache_entry
+{
+    /** Index of the first call site offset, the enter callqs come first */
+    uint64_t site_index;
+    /** Offset of the region name in the name table */
+    uint64_t name_offset;
+    /** Number of enter callqs */
+    uint32_t enter_cnt;
+    /** Number of exit callqs */
+    uint32_t exit_cnt;
+    /** Filter decision, see FILTER_CACHE_DELETED */
+    uint32_t flags;
+    uint32_t reserved;
+} filter_cache_entry;
+
+/**
+ * A region to be written to the cache file.
+ */
+typedef struct filter_cache_record
+{
+    const char* name;
+    /** Call site offsets, the enter callqs come first */
+    const uint64_t* sites;
+    uint32_t enter_cnt;
+    uint32_t exit_cnt;
+    uint32_t flags;
+} filter_cache_record;
+
+/**
+ * Identifies the running binary. Must be called before any other function.
+ */
+void filter_cache_init( void );
+
+/**
+ * Checks whether the given address belongs to the running binary (not to a shared object).
+ *
+ * @param   address                         The address to check.
+ *
+ * @return                                  Whether the address belongs to the binary.
+ */
+bool filter_cache_in_program( uintptr_t                                             address );
+
+/**
+ * Maps the given cache file, if it has been written for the running binary.
+ *
+ * @param   path                            The cache file.
+ *
+ * @return                                  Number of entries, 0 if the file can't be used.
+ */
+size_t filter_cache_load( const char*                                               path );
+
+/**
+ * Returns the entry with the given index of the loaded cache file.
+ */
+const filter_cache_entry* filter_cache_get( size_t                                  index );
+
+/**
+ * Returns the call site offsets of the given entry of the loaded cache file, enter callqs first.
+ */
+const uint64_t* filter_cache_sites( const filter_cache_entry*                       entry );
+
+/**
+ * Returns the region name of the given entry of the loaded cache file.
+ */
+const char* filter_cache_name( const filter_cache_entry*                            entry );
+
+/**
+ * Looks up a region in the loaded cache file.
+ *
+ * @param   name                            Name of the region.
+ *
+ * @return                                  Index of its entry, SIZE_MAX if it's not cached.
+ */
+size_t filter_cache_lookup( const char*                                             name );
+
+/**
+ * Writes a cache file for the running binary.
+ *
+ * The file is written to a temporary file first and renamed afterwards, so processes running the
+ * same binary concurrently never see a partially written cache.
+ *
+ * @param   path                            The cache file.
+ * @param   records                         The regions to store, will be sorted by name.
+ * @param   record_cnt                      Number of regions.
+ *
+ * @return                                  Whether the file has been written.
+ */
+bool filter_cache_store( const char*                                                path,
+                         filter_cache_record*                                       records,
+                         size_t                                                     record_cnt );
+
+/**
+ * Unmaps the loaded cache file.
+ */
+void filter_cache_unload( void );
+
+#endif /* FILTER_CACHE_H */
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE /* <- needed for dl_iterate_phdr */
+
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "module-registry.h"
+
+/**
+ * A loaded segment of an object.
+ */
+typedef struct module_segment
+{
+    uintptr_t begin;
+    uintptr_t end;
+    /** Whether the segment is executable */
+    bool exec;
+} module_segment;
+
+/**
+ * One copy of the registry.
+ */
+typedef struct module_map
+{
+    /** Previously published copy (retired list) */
+    struct module_map* retired;
+    /** Objects loaded and unloaded by the loader when this copy was built */
+    unsigned long long adds;
+    unsigned long long subs;
+    /** Number of the copy */
+    uint64_t generation;
+    /** All objects in the order of the loader, the binary comes first */
+    module_info* modules;
+    size_t module_cnt;
+    size_t module_capacity;
+    /** All loaded segments, sorted by their address */
+    module_segment* segments;
+    size_t segment_cnt;
+    size_t segment_capacity;
+} module_map;
+
+/**
+ * Address range of an unloaded object.
+ */
+typedef struct unloaded_range
+{
+    uintptr_t begin;
+    uintptr_t end;
+    /** Generation of the copy that noticed the unload */
+    uint64_t generation;
+} unloaded_range;
+
+/** The current copy of the registry */
+static module_map* current_map = NULL;
+
+/** Serializes the updates */
+static pthread_mutex_t update_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/** Next number of a load */
+static uint64_t next_load_id = 1;
+
+/** Number of the last load before the first copy was built, these objects can't be unloaded */
+static uint64_t startup_load_id = 0;
+
+/** Address ranges of all unloaded objects, guarded by update_mtx */
+static unloaded_range* unloaded = NULL;
+static size_t unloaded_cnt = 0;
+static size_t unloaded_capacity = 0;
+
+/**
+ * Reads the load and unload counters of the loader (callback of dl_iterate_phdr).
+ *
+ * The counters are the same for all objects, so the iteration stops after the first one. Loaders
+ * without the counters report every call as a change.
+ */
+static int read_counters( struct dl_phdr_info*                                      info,
+                          size_t                                                    size,
+                          void*                                                     data )
+{
+    unsigned long long* counters = data;
+    if( size >= offsetof( struct dl_phdr_info, dlpi_subs ) + sizeof( info->dlpi_subs ) )
+    {
+        counters[0] = info->dlpi_adds;
+        counters[1] = info->dlpi_subs;
+    }
+    else
+    {
+        counters[0] = ULLONG_MAX;
+        counters[1] = ULLONG_MAX;
+    }
+    return 1;
+}
+
+/**
+ * Adds an object and its loaded segments to the copy being built (callback of dl_iterate_phdr).
+ */
+static int collect_object( struct dl_phdr_info*                                     info,
+                           __attribute__((unused)) size_t                           size,
+                           void*                                                    data )
+{
+    module_map* map = data;
+    module_info module = { NULL, info->dlpi_addr, UINTPTR_MAX, 0, 0 };
+
+    for( size_t i = 0; i < info->dlpi_phnum; ++i )
+    {
+        const ElfW( Phdr )* phdr = &info->dlpi_phdr[i];
+        if( phdr->p_type != PT_LOAD || phdr->p_memsz == 0 )
+        {
+            continue;
+        }
+        uintptr_t begin = info->dlpi_addr + phdr->p_vaddr;
+        if( begin < module.begin )
+        {
+            module.begin = begin;
+        }
+        if( begin + phdr->p_memsz > module.end )
+        {
+            module.end = begin + phdr->p_memsz;
+        }
+        if( ( phdr->p_flags & PF_R ) == 0 )
+        {
+            continue;
+        }
+        if( map->segment_cnt == map->segment_capacity )
+        {
+            map->segment_capacity = map->segment_capacity == 0 ? 64 : 2 * map->segment_capacity;
+            map->segments = realloc( map->segments, map->segment_capacity * sizeof( module_segment ) );
+        }
+        map->segments[map->segment_cnt].begin = begin;
+        map->segments[map->segment_cnt].end = begin + phdr->p_memsz;
+        map->segments[map->segment_cnt].exec = ( phdr->p_flags & PF_X ) != 0;
+        map->segment_cnt++;
+    }
+
+    // The binary always comes first, even if it has no segments of its own (which never happens).
+    if( module.begin == UINTPTR_MAX )
+    {
+        if( map->module_cnt > 0 )
+        {
+            return 0;
+        }
+        module.begin = 0;
+    }
+    module.name = strdup( info->dlpi_name != NULL ? info->dlpi_name : "" );
+    if( map->module_cnt == map->module_capacity )
+    {
+        map->module_capacity = map->module_capacity == 0 ? 16 : 2 * map->module_capacity;
+        map->modules = realloc( map->modules, map->module_capacity * sizeof( module_info ) );
+    }
+    map->modules[map->module_cnt++] = module;
+    return 0;
+}
+
+/**
+ * Compares two segments by their address.
+ */
+static int compare_segment( const void*                                             a,
+                            const void*                                             b )
+{
+    uintptr_t begin_a = ( (const module_segment*) a )->begin;
+    uintptr_t begin_b = ( (const module_segment*) b )->begin;
+    return begin_a < begin_b ? -1 : begin_a > begin_b;
+}
+
+/**
+ * Looks up the given object in another copy of the registry.
+ *
+ * @return                                  The object, NULL if it isn't part of the copy.
+ */
+static const module_info* find_same_module( const module_map*                       map,
+                                            const module_info*                      module )
+{
+    for( size_t i = 0; map != NULL && i < map->module_cnt; ++i )
+    {
+        const module_info* other = &map->modules[i];
+        if( other->base == module->base && other->begin == module->begin
+            && other->end == module->end && strcmp( other->name, module->name ) == 0 )
+        {
+            return other;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Builds a new copy of the registry and publishes it. Has to be called with update_mtx held.
+ *
+ * Objects of the old copy that are part of the new one keep their load_id, all others are
+ * remembered as unloaded. An object might have been unloaded and loaded again to the same addresses
+ * between two copies. The loader only counts the unloads, so if it reports more of them than objects
+ * are missing, it can't be told which object that was, and all objects opened after the startup
+ * count as loaded again.
+ *
+ * @param   counters                        Counters of the loader before the new copy was built.
+ */
+static void rebuild( const unsigned long long*                                      counters )
+{
+    module_map* old = current_map;
+    module_map* map = calloc( 1, sizeof( module_map ) );
+    map->adds = counters[0];
+    map->subs = counters[1];
+    map->generation = old != NULL ? old->generation + 1 : 0;
+    dl_iterate_phdr( collect_object, map );
+    qsort( map->segments, map->segment_cnt, sizeof( module_segment ), compare_segment );
+
+    size_t missing = 0;
+    for( size_t i = 0; old != NULL && i < old->module_cnt; ++i )
+    {
+        missing += find_same_module( map, &old->modules[i] ) == NULL;
+    }
+    bool reloaded = old != NULL && counters[1] != ULLONG_MAX && old->subs != ULLONG_MAX
+                    && counters[1] - old->subs > missing;
+
+    for( size_t i = 0; i < map->module_cnt; ++i )
+    {
+        const module_info* known = find_same_module( old, &map->modules[i] );
+        if( known != NULL && reloaded && known->load_id > startup_load_id )
+        {
+            known = NULL;
+        }
+        map->modules[i].load_id = known != NULL ? known->load_id : next_load_id++;
+    }
+    if( old == NULL )
+    {
+        startup_load_id = next_load_id - 1;
+    }
+    for( size_t i = 0; old != NULL && i < old->module_cnt; ++i )
+    {
+        const module_info* same = find_same_module( map, &old->modules[i] );
+        if( same != NULL && same->load_id == old->modules[i].load_id )
+        {
+            continue;
+        }
+        if( unloaded_cnt == unloaded_capacity )
+        {
+            unloaded_capacity = unloaded_capacity == 0 ? 16 : 2 * unloaded_capacity;
+            unloaded = realloc( unloaded, unloaded_capacity * sizeof( unloaded_range ) );
+        }
+        unloaded[unloaded_cnt].begin = old->modules[i].begin;
+        unloaded[unloaded_cnt].end = old->modules[i].end;
+        unloaded[unloaded_cnt].generation = map->generation;
+        unloaded_cnt++;
+    }
+
+    map->retired = old;
+    __atomic_store_n( &current_map, map, __ATOMIC_RELEASE );
+}
+
+void module_registry_init( void )
+{
+    unsigned long long counters[2] = { 0, 0 };
+    dl_iterate_phdr( read_counters, counters );
+    pthread_mutex_lock( &update_mtx );
+    rebuild( counters );
+    pthread_mutex_unlock( &update_mtx );
+}
+
+bool module_registry_update( void )
+{
+    unsigned long long counters[2] = { 0, 0 };
+    module_map* known = __atomic_load_n( &current_map, __ATOMIC_ACQUIRE );
+    if( known == NULL )
+    {
+        return false;
+    }
+    dl_iterate_phdr( read_counters, counters );
+    if( counters[0] != ULLONG_MAX && counters[0] == known->adds && counters[1] == known->subs )
+    {
+        return false;
+    }
+
+    // Another thread might have rebuilt the registry in the meantime.
+    pthread_mutex_lock( &update_mtx );
+    if( counters[0] == ULLONG_MAX || counters[0] != current_map->adds
+        || counters[1] != current_map->subs )
+    {
+        rebuild( counters );
+    }
+    pthread_mutex_unlock( &update_mtx );
+    return __atomic_load_n( &current_map, __ATOMIC_ACQUIRE ) != known;
+}
+
+uint64_t module_registry_generation( void )
+{
+    const module_map* map = __atomic_load_n( &current_map, __ATOMIC_ACQUIRE );
+    return map != NULL ? map->generation : 0;
+}
+
+bool module_registry_is_mapped( uintptr_t                                           address,
+                                size_t                                              size,
+                                bool                                                exec )
+{
+    const module_map* map = __atomic_load_n( &current_map, __ATOMIC_ACQUIRE );
+    if( map == NULL || address + size < address )
+    {
+        return false;
+    }
+
+    // Find the last segment starting at or before the address.
+    size_t low = 0, high = map->segment_cnt;
+    while( low < high )
+    {
+        size_t mid = ( low + high ) / 2;
+        if( map->segments[mid].begin <= address )
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if( low == 0 )
+    {
+        return false;
+    }
+    const module_segment* segment = &map->segments[low - 1];
+    return address + size <= segment->end && ( segment->exec || !exec );
+}
+
+const module_info* module_registry_find( uintptr_t                                  address )
+{
+    const module_map* map = __atomic_load_n( &current_map, __ATOMIC_ACQUIRE );
+    for( size_t i = 0; map != NULL && i < map->module_cnt; ++i )
+    {
+        if( address >= map->modules[i].begin && address < map->modules[i].end )
+        {
+            return &map->modules[i];
+        }
+    }
+    return NULL;
+}
+
+const module_info* module_registry_program( void )
+{
+    const module_map* map = __atomic_load_n( &current_map, __ATOMIC_ACQUIRE );
+    return map != NULL && map->module_cnt > 0 ? &map->modules[0] : NULL;
+}
+
+bool module_registry_unloaded_since( uintptr_t                                      address,
+                                     uint64_t                                       generation )
+{
+    bool found = false;
+    pthread_mutex_lock( &update_mtx );
+    for( size_t i = 0; !found && i < unloaded_cnt; ++i )
+    {
+        found = unloaded[i].generation > generation && address >= unloaded[i].begin
+                && address < unloaded[i].end;
+    }
+    pthread_mutex_unlock( &update_mtx );
+    return found;
+}
+
+void module_registry_free( void )
+{
+    pthread_mutex_lock( &update_mtx );
+    while( current_map != NULL )
+    {
+        module_map* retired = current_map->retired;
+        for( size_t i = 0; i < current_map->module_cnt; ++i )
+        {
+            free( (char*) current_map->modules[i].name );
+        }
+        free( current_map->modules );
+        free( current_map->segments );
+        free( current_map );
+        current_map = retired;
+    }
+    free( unloaded );
+    unloaded = NULL;
+    unloaded_cnt = 0;
+    unloaded_capacity = 0;
+    pthread_mutex_unlock( &update_mtx );
+}
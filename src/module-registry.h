@@ -0,0 +1,102 @@
+#ifndef MODULE_REGISTRY_H
+#define MODULE_REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Registry of the loaded objects (the binary, its shared objects and everything opened with dlopen).
+ *
+ * The address ranges and the loaded segments of all objects are taken from dl_iterate_phdr. The
+ * registry is rebuilt whenever the loader reports objects being loaded or unloaded since the last
+ * update, so objects opened later on are known as well. Readers may access the registry while it
+ * is rebuilt: a new copy is published and the old one is kept in the retired list until the
+ * registry is freed. Objects that have been unloaded are remembered, so that call sites pointing
+ * into them can be dropped even if another object has been loaded to the same addresses since. This
+ * includes an object unloaded and loaded again between two updates, which only shows in the
+ * loader's counters of loads and unloads.
+ */
+
+/**
+ * A loaded object.
+ */
+typedef struct module_info
+{
+    /** Path of the object, empty for the binary */
+    const char* name;
+    /** Load bias of the object */
+    uintptr_t base;
+    /** First address of the object */
+    uintptr_t begin;
+    /** Address behind the object */
+    uintptr_t end;
+    /** Number of the load, different for every object loaded during the run */
+    uint64_t load_id;
+} module_info;
+
+/**
+ * Builds the registry. Must be called before any other function.
+ */
+void module_registry_init( void );
+
+/**
+ * Rebuilds the registry if objects have been loaded or unloaded since the last update.
+ *
+ * Cheap if nothing changed. May be called by any thread.
+ *
+ * @return                                  Whether the registry has changed.
+ */
+bool module_registry_update( void );
+
+/**
+ * Returns the number of updates that changed the registry, unloaded objects are tagged with it.
+ */
+uint64_t module_registry_generation( void );
+
+/**
+ * Checks whether the given memory range lies within a loaded segment of one object.
+ *
+ * @param   address                         Begin of the memory range.
+ * @param   size                            Size of the memory range.
+ * @param   exec                            Whether the range has to be executable.
+ *
+ * @return                                  Whether the range can be read safely.
+ */
+bool module_registry_is_mapped( uintptr_t                                           address,
+                                size_t                                              size,
+                                bool                                                exec );
+
+/**
+ * Looks up the object holding the given address.
+ *
+ * @param   address                         The address to look up.
+ *
+ * @return                                  The object, NULL if the address doesn't belong to a
+ *                                          loaded object. Stays valid until module_registry_free.
+ */
+const module_info* module_registry_find( uintptr_t                                  address );
+
+/**
+ * Returns the running binary, which is always the first object.
+ */
+const module_info* module_registry_program( void );
+
+/**
+ * Checks whether the given address belonged to an object that has been unloaded by an update
+ * after the given generation.
+ *
+ * @param   address                         The address to check.
+ * @param   generation                      Generation of the registry the caller knows about.
+ *
+ * @return                                  Whether the address has been unloaded since.
+ */
+bool module_registry_unloaded_since( uintptr_t                                      address,
+                                     uint64_t                                       generation );
+
+/**
+ * Frees the registry including all retired copies.
+ */
+void module_registry_free( void );
+
+#endif /* MODULE_REGISTRY_H */
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output-buffer.h"
+
+/** Initial capacity of a buffer */
+#define OUTPUT_BUFFER_INITIAL_CAPACITY ( 64 * 1024 )
+
+/**
+ * Makes sure the buffer can take the given number of further bytes (plus the terminating NUL).
+ */
+static void output_buffer_reserve( output_buffer*                                   buffer,
+                                   size_t                                           size )
+{
+    if( buffer->size + size + 1 <= buffer->capacity )
+    {
+        return;
+    }
+    size_t capacity = buffer->capacity == 0 ? OUTPUT_BUFFER_INITIAL_CAPACITY : buffer->capacity;
+    while( buffer->size + size + 1 > capacity )
+    {
+        capacity *= 2;
+    }
+    buffer->data = realloc( buffer->data, capacity );
+    buffer->capacity = capacity;
+}
+
+void output_buffer_printf( output_buffer*                                           buffer,
+                           const char*                                              format,
+                           ... )
+{
+    va_list args;
+    va_start( args, format );
+    char* end = buffer->data != NULL ? buffer->data + buffer->size : NULL;
+    int size = vsnprintf( end, buffer->capacity - buffer->size, format, args );
+    va_end( args );
+    if( size < 0 )
+    {
+        return;
+    }
+    if( buffer->size + size + 1 > buffer->capacity )
+    {
+        // Didn't fit, so grow the buffer and format again.
+        output_buffer_reserve( buffer, size );
+        va_start( args, format );
+        vsnprintf( buffer->data + buffer->size, buffer->capacity - buffer->size, format, args );
+        va_end( args );
+    }
+    buffer->size += size;
+}
+
+void output_buffer_csv_string( output_buffer*                                       buffer,
+                               const char*                                          string )
+{
+    output_buffer_reserve( buffer, 2 * strlen( string ) + 2 );
+    buffer->data[buffer->size++] = '"';
+    for( const char* c = string; *c != '\0'; ++c )
+    {
+        if( *c == '"' )
+        {
+            buffer->data[buffer->size++] = '"';
+        }
+        buffer->data[buffer->size++] = *c;
+    }
+    buffer->data[buffer->size++] = '"';
+    buffer->data[buffer->size] = '\0';
+}
+
+void output_buffer_json_string( output_buffer*                                      buffer,
+                                const char*                                         string )
+{
+    output_buffer_printf( buffer, "\"" );
+    for( const unsigned char* c = (const unsigned char*) string; *c != '\0'; ++c )
+    {
+        if( *c == '"' || *c == '\\' )
+        {
+            output_buffer_printf( buffer, "\\%c", *c );
+        }
+        else if( *c < 0x20 )
+        {
+            output_buffer_printf( buffer, "\\u%04x", *c );
+        }
+        else
+        {
+            output_buffer_reserve( buffer, 1 );
+            buffer->data[buffer->size++] = *c;
+            buffer->data[buffer->size] = '\0';
+        }
+    }
+    output_buffer_printf( buffer, "\"" );
+}
+
+bool output_buffer_write( const output_buffer*                                      buffer,
+                          int                                                       fd )
+{
+    size_t written = 0;
+    while( written < buffer->size )
+    {
+        ssize_t result = write( fd, buffer->data + written, buffer->size - written );
+        if( result < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( result <= 0 )
+        {
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+void output_buffer_free( output_buffer*                                             buffer )
+{
+    free( buffer->data );
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Growable buffer for the text written at the end of the run.
+ *
+ * The report and the filter file are built in memory and written with a single write call, so the
+ * output of several processes sharing stderr doesn't get interleaved and large outputs don't pay
+ * for one unbuffered write per line.
+ */
+
+/**
+ * A growable text buffer, zero initialize before use.
+ */
+typedef struct output_buffer
+{
+    char* data;
+    /** Used bytes of data */
+    size_t size;
+    /** Allocated bytes of data */
+    size_t capacity;
+} output_buffer;
+
+/**
+ * Appends formatted text to the buffer.
+ *
+ * @param   buffer                          The buffer.
+ * @param   format                          printf format string.
+ */
+void output_buffer_printf( output_buffer*                                           buffer,
+                           const char*                                              format,
+                           ... ) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Appends a string as quoted CSV field, quotes within are doubled.
+ *
+ * @param   buffer                          The buffer.
+ * @param   string                          The string.
+ */
+void output_buffer_csv_string( output_buffer*                                       buffer,
+                               const char*                                          string );
+
+/**
+ * Appends a string as JSON string literal, with quotes, backslashes and control characters escaped.
+ *
+ * @param   buffer                          The buffer.
+ * @param   string                          The string.
+ */
+void output_buffer_json_string( output_buffer*                                      buffer,
+                                const char*                                         string );
+
+/**
+ * Writes the whole buffer to a file descriptor, retrying partial writes.
+ *
+ * @param   buffer                          The buffer.
+ * @param   fd                              The file descriptor.
+ *
+ * @return                                  Whether all bytes have been written.
+ */
+bool output_buffer_write( const output_buffer*                                      buffer,
+                          int                                                       fd );
+
+/**
+ * Frees the buffer, it can be used again afterwards.
+ *
+ * @param   buffer                          The buffer.
+ */
+void output_buffer_free( output_buffer*                                             buffer );
+
+#endif /* OUTPUT_BUFFER_H */
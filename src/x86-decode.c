@@ -0,0 +1,747 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "x86-decode.h"
+
+/** Maximum length of an x86 instruction */
+#define MAX_INSN_LENGTH 15
+
+/**
+ * Kinds of immediates following the opcode and its operands.
+ */
+typedef enum x86_imm
+{
+    IMM_NONE,
+    /** One byte */
+    IMM_8,
+    /** Two bytes (ret/lret) */
+    IMM_16,
+    /** Two bytes and one byte (enter) */
+    IMM_16_8,
+    /** Four bytes, the displacement of the near calls and jumps */
+    IMM_32,
+    /** Two or four bytes depending on the operand size */
+    IMM_Z,
+    /** Two, four or eight bytes depending on the operand size (mov $imm, %reg) */
+    IMM_V,
+    /** Address of the mov between the accumulator and memory, four or eight bytes */
+    IMM_MOFFS
+} x86_imm;
+
+/**
+ * Looks up an opcode of the one byte map.
+ *
+ * @param   op                              The opcode.
+ * @param   modrm                           Returns whether a ModRM byte follows.
+ * @param   imm                             Returns the kind of immediate.
+ *
+ * @return                                  Whether the opcode is valid in 64-bit mode.
+ */
+static bool one_byte_opcode( unsigned char                                          op,
+                             bool*                                                  modrm,
+                             x86_imm*                                               imm )
+{
+    *modrm = false;
+    *imm = IMM_NONE;
+
+    if( op < 0x40 )
+    {
+        // The arithmetic instructions, prefixes and 0x0f are handled by the caller, the others are
+        // invalid in 64-bit mode.
+        switch( op & 7 )
+        {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+                *modrm = true;
+                return true;
+            case 4:
+                *imm = IMM_8;
+                return true;
+            case 5:
+                *imm = IMM_Z;
+                return true;
+            default:
+                return false;
+        }
+    }
+    if( op < 0x50 )
+    {
+        // REX prefix not directly in front of the opcode.
+        return false;
+    }
+    if( op < 0x60 )
+    {
+        return true;
+    }
+    if( op >= 0x70 && op < 0x80 )
+    {
+        *imm = IMM_8;
+        return true;
+    }
+    if( op >= 0x84 && op < 0x90 )
+    {
+        *modrm = true;
+        return true;
+    }
+    if( op >= 0x90 && op < 0xa0 )
+    {
+        return op != 0x9a;
+    }
+    if( op >= 0xb0 && op < 0xb8 )
+    {
+        *imm = IMM_8;
+        return true;
+    }
+    if( op >= 0xb8 && op < 0xc0 )
+    {
+        *imm = IMM_V;
+        return true;
+    }
+    if( op >= 0xd8 && op < 0xe0 )
+    {
+        // x87
+        *modrm = true;
+        return true;
+    }
+
+    switch( op )
+    {
+        case 0x63:
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+        case 0xf6:
+        case 0xf7:
+        case 0xfe:
+        case 0xff:
+            *modrm = true;
+            return true;
+        case 0x69:
+        case 0x81:
+        case 0xc7:
+            *modrm = true;
+            *imm = IMM_Z;
+            return true;
+        case 0x6b:
+        case 0x80:
+        case 0x83:
+        case 0xc0:
+        case 0xc1:
+        case 0xc6:
+            *modrm = true;
+            *imm = IMM_8;
+            return true;
+        case 0x68:
+        case 0xa9:
+            *imm = IMM_Z;
+            return true;
+        case 0x6a:
+        case 0xa8:
+        case 0xcd:
+        case 0xe0:
+        case 0xe1:
+        case 0xe2:
+        case 0xe3:
+        case 0xe4:
+        case 0xe5:
+        case 0xe6:
+        case 0xe7:
+        case 0xeb:
+            *imm = IMM_8;
+            return true;
+        case 0xa0:
+        case 0xa1:
+        case 0xa2:
+        case 0xa3:
+            *imm = IMM_MOFFS;
+            return true;
+        case 0xc2:
+        case 0xca:
+            *imm = IMM_16;
+            return true;
+        case 0xc8:
+            *imm = IMM_16_8;
+            return true;
+        case 0xe8:
+        case 0xe9:
+            *imm = IMM_32;
+            return true;
+        case 0x6c:
+        case 0x6d:
+        case 0x6e:
+        case 0x6f:
+        case 0xa4:
+        case 0xa5:
+        case 0xa6:
+        case 0xa7:
+        case 0xaa:
+        case 0xab:
+        case 0xac:
+        case 0xad:
+        case 0xae:
+        case 0xaf:
+        case 0xc3:
+        case 0xc9:
+        case 0xcb:
+        case 0xcc:
+        case 0xcf:
+        case 0xd7:
+        case 0xec:
+        case 0xed:
+        case 0xee:
+        case 0xef:
+        case 0xf1:
+        case 0xf4:
+        case 0xf5:
+        case 0xf8:
+        case 0xf9:
+        case 0xfa:
+        case 0xfb:
+        case 0xfc:
+        case 0xfd:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Looks up an opcode of the two byte map (0x0f), without the three byte escapes.
+ *
+ * @param   op                              The opcode following 0x0f.
+ * @param   mandatory                       Whether a 0x66 or 0xf2 prefix is present.
+ * @param   modrm                           Returns whether a ModRM byte follows.
+ * @param   imm_size                        Returns the size of the immediate.
+ *
+ * @return                                  Whether the opcode is valid in 64-bit mode.
+ */
+static bool two_byte_opcode( unsigned char                                          op,
+                             bool                                                   mandatory,
+                             bool*                                                  modrm,
+                             size_t*                                                imm_size )
+{
+    *modrm = true;
+    *imm_size = 0;
+
+    if( op >= 0x80 && op < 0x90 )
+    {
+        // jcc rel32
+        *modrm = false;
+        *imm_size = 4;
+        return true;
+    }
+    if( op >= 0xc8 && op < 0xd0 )
+    {
+        // bswap
+        *modrm = false;
+        return true;
+    }
+    if( op >= 0x30 && op < 0x38 )
+    {
+        // wrmsr, rdtsc, rdmsr, rdpmc, sysenter, sysexit, getsec
+        *modrm = false;
+        return op != 0x36;
+    }
+
+    switch( op )
+    {
+        case 0x04:
+        case 0x0a:
+        case 0x0c:
+        case 0x24:
+        case 0x25:
+        case 0x26:
+        case 0x27:
+        case 0x39:
+        case 0x3b:
+        case 0x3c:
+        case 0x3d:
+        case 0x3e:
+        case 0x3f:
+        case 0x7a:
+        case 0x7b:
+            return false;
+        case 0x05:
+        case 0x06:
+        case 0x07:
+        case 0x08:
+        case 0x09:
+        case 0x0b:
+        case 0x0e:
+        case 0x77:
+        case 0xa0:
+        case 0xa1:
+        case 0xa2:
+        case 0xa8:
+        case 0xa9:
+        case 0xaa:
+            *modrm = false;
+            return true;
+        case 0x0f:
+        case 0x70:
+        case 0x71:
+        case 0x72:
+        case 0x73:
+        case 0xa4:
+        case 0xac:
+        case 0xba:
+        case 0xc2:
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+            *imm_size = 1;
+            return true;
+        case 0x78:
+            // extrq/insertq take two immediates, vmread none.
+            *imm_size = mandatory ? 2 : 0;
+            return true;
+        default:
+            return true;
+    }
+}
+
+/**
+ * Looks up an opcode of the VEX and EVEX encoded maps.
+ *
+ * @param   map                             The opcode map, 1 to 3 stand for 0x0f, 0x0f38 and 0x0f3a.
+ * @param   op                              The opcode.
+ * @param   modrm                           Returns whether a ModRM byte follows.
+ * @param   imm_size                        Returns the size of the immediate.
+ *
+ * @return                                  Whether the map is known.
+ */
+static bool vex_opcode( unsigned                                                    map,
+                        unsigned char                                               op,
+                        bool*                                                       modrm,
+                        size_t*                                                     imm_size )
+{
+    *modrm = true;
+    *imm_size = 0;
+
+    switch( map )
+    {
+        case 1:
+            // vzeroupper and vzeroall come without operands.
+            *modrm = op != 0x77;
+            *imm_size = ( op >= 0x70 && op < 0x74 ) || op == 0xc2 || op == 0xc4 || op == 0xc5
+                        || op == 0xc6;
+            return true;
+        case 2:
+        case 5:
+        case 6:
+            return true;
+        case 3:
+            *imm_size = 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Returns the length of the ModRM byte and the SIB byte and displacement it implies.
+ *
+ * @param   code                            The ModRM byte.
+ * @param   available                       Number of bytes that may be read.
+ *
+ * @return                                  The length, 0 if the bytes aren't available.
+ */
+static size_t modrm_length( const unsigned char*                                    code,
+                            size_t                                                  available )
+{
+    if( available < 1 )
+    {
+        return 0;
+    }
+
+    unsigned mod = code[0] >> 6;
+    unsigned rm = code[0] & 7;
+    size_t length = 1;
+    if( mod == 3 )
+    {
+        return length;
+    }
+    if( rm == 4 )
+    {
+        if( available < 2 )
+        {
+            return 0;
+        }
+        // A SIB byte without base register takes a four byte displacement.
+        length++;
+        if( mod == 0 && ( code[1] & 7 ) == 5 )
+        {
+            length += 4;
+        }
+    }
+    else if( mod == 0 && rm == 5 )
+    {
+        // RIP relative
+        length += 4;
+    }
+    if( mod == 1 )
+    {
+        length += 1;
+    }
+    else if( mod == 2 )
+    {
+        length += 4;
+    }
+    return length;
+}
+
+bool x86_decode( const unsigned char*                                               code,
+                 size_t                                                             available,
+                 x86_insn*                                                          insn )
+{
+    bool operand_size = false, address_size = false, mandatory = false, rex = false, rex_w = false;
+    size_t i = 0;
+
+    if( available > MAX_INSN_LENGTH )
+    {
+        available = MAX_INSN_LENGTH;
+    }
+
+    // Legacy prefixes, a REX prefix only counts right in front of the opcode.
+    for( ; i < available; ++i )
+    {
+        unsigned char c = code[i];
+        if( c == 0x66 )
+        {
+            operand_size = true;
+        }
+        else if( c == 0x67 )
+        {
+            address_size = true;
+        }
+        else if( c == 0xf2 || c == 0xf3 )
+        {
+            mandatory |= c == 0xf2;
+        }
+        else if( c != 0xf0 && c != 0x26 && c != 0x2e && c != 0x36 && c != 0x3e && c != 0x64
+                 && c != 0x65 )
+        {
+            break;
+        }
+    }
+    insn->rex = 0;
+    insn->modrm = 0;
+    if( i < available && ( code[i] & 0xf0 ) == 0x40 )
+    {
+        insn->rex = code[i];
+        rex = true;
+        rex_w = ( code[i] & 8 ) != 0;
+        i++;
+    }
+    if( i >= available )
+    {
+        return false;
+    }
+    insn->opcode = i;
+
+    unsigned char op = code[i];
+    bool modrm = false;
+    size_t imm_size = 0;
+    unsigned char group_op = 0;
+
+    if( op == 0xc4 || op == 0xc5 || op == 0x62
+        || ( op == 0x8f && i + 1 < available && ( code[i + 1] & 0x1f ) >= 8 ) )
+    {
+        // VEX, EVEX and XOP can't be combined with the operand size, mandatory and REX prefixes.
+        size_t prefix_length = op == 0xc5 ? 2 : op == 0x62 ? 4 : 3;
+        if( operand_size || mandatory || rex || i + prefix_length >= available )
+        {
+            return false;
+        }
+        unsigned map = op == 0xc5 ? 1 : op == 0x62 ? code[i + 1] & 7u : code[i + 1] & 0x1fu;
+        unsigned char vex_op = code[i + prefix_length];
+        i += prefix_length + 1;
+        if( op == 0x8f )
+        {
+            // XOP maps 8 to 10 take a one byte, no or a four byte immediate.
+            if( map > 10 )
+            {
+                return false;
+            }
+            modrm = true;
+            imm_size = map == 8 ? 1 : map == 9 ? 0 : 4;
+        }
+        else if( !vex_opcode( map, vex_op, &modrm, &imm_size ) || ( op != 0x62 && map > 3 ) )
+        {
+            return false;
+        }
+    }
+    else if( op == 0x0f )
+    {
+        if( ++i >= available )
+        {
+            return false;
+        }
+        op = code[i++];
+        if( op == 0x38 || op == 0x3a )
+        {
+            // Three byte maps, the opcode itself doesn't matter.
+            if( i++ >= available )
+            {
+                return false;
+            }
+            modrm = true;
+            imm_size = op == 0x3a;
+        }
+        else if( !two_byte_opcode( op, operand_size || mandatory, &modrm, &imm_size ) )
+        {
+            return false;
+        }
+    }
+    else
+    {
+        x86_imm imm;
+        if( !one_byte_opcode( op, &modrm, &imm ) )
+        {
+            return false;
+        }
+        i++;
+        group_op = op;
+        switch( imm )
+        {
+            case IMM_NONE:
+                break;
+            case IMM_8:
+                imm_size = 1;
+                break;
+            case IMM_16:
+                imm_size = 2;
+                break;
+            case IMM_16_8:
+                imm_size = 3;
+                break;
+            case IMM_32:
+                imm_size = 4;
+                break;
+            case IMM_Z:
+                imm_size = operand_size ? 2 : 4;
+                break;
+            case IMM_V:
+                imm_size = rex_w ? 8 : operand_size ? 2 : 4;
+                break;
+            case IMM_MOFFS:
+                imm_size = address_size ? 4 : 8;
+                break;
+        }
+    }
+
+    if( modrm )
+    {
+        size_t length = modrm_length( code + i, available - i );
+        if( length == 0 )
+        {
+            return false;
+        }
+        insn->modrm = i;
+        // test $imm, r/m is the only member of its group with an immediate.
+        if( ( group_op == 0xf6 || group_op == 0xf7 ) && ( ( code[i] >> 3 ) & 7 ) < 2 )
+        {
+            imm_size = group_op == 0xf6 ? 1 : operand_size ? 2 : 4;
+        }
+        i += length;
+    }
+
+    if( i + imm_size > available )
+    {
+        return false;
+    }
+    insn->length = i + imm_size;
+    return true;
+}
+
+/** Registers not preserved across calls: rax, rcx, rdx, rsi, rdi and r8 to r11 */
+#define CALLER_SAVED_REGISTERS 0x0fc7u
+
+/**
+ * Makes the given registers unknown.
+ *
+ * @param   values                          The known addresses of the registers.
+ * @param   mask                            The registers, one bit per register number.
+ */
+static void forget_registers( uintptr_t*                                            values,
+                              unsigned                                              mask )
+{
+    for( unsigned r = 0; r < X86_REGISTER_CNT; ++r )
+    {
+        if( mask & ( 1u << r ) )
+        {
+            values[r] = 0;
+        }
+    }
+}
+
+/**
+ * Checks whether a two byte opcode only takes vector registers as reg and r/m operands.
+ *
+ * @param   op                              The opcode following 0x0f.
+ *
+ * @return                                  Whether no general purpose register is written.
+ */
+static bool is_vector_opcode( unsigned char                                         op )
+{
+    return ( op >= 0x10 && op <= 0x17 ) || ( op >= 0x28 && op <= 0x2b ) || op == 0x2e || op == 0x2f
+           || ( op >= 0x51 && op <= 0x7d ) || op == 0x7f || op == 0xc2 || op == 0xc6
+           || ( op >= 0xd0 && op <= 0xd6 ) || ( op >= 0xd8 && op <= 0xfe );
+}
+
+/**
+ * Checks whether the reg field of an opcode's modrm byte extends the opcode instead of naming a
+ * register.
+ *
+ * @param   op                              First byte of the opcode.
+ *
+ * @return                                  Whether the reg field isn't a register operand.
+ */
+static bool is_group_opcode( const unsigned char*                                   op )
+{
+    if( op[0] == 0x0f )
+    {
+        return op[1] == 0x00 || op[1] == 0x01 || ( op[1] >= 0x18 && op[1] <= 0x1f ) || op[1] == 0xae
+               || op[1] == 0xba || op[1] == 0xc7;
+    }
+    return ( op[0] >= 0x80 && op[0] <= 0x83 ) || op[0] == 0x8f || op[0] == 0xc0 || op[0] == 0xc1
+           || op[0] == 0xc6 || op[0] == 0xc7 || ( op[0] >= 0xd0 && op[0] <= 0xdf ) || op[0] == 0xf6
+           || op[0] == 0xf7 || op[0] == 0xfe || op[0] == 0xff;
+}
+
+void x86_track_registers( const unsigned char*                                      code,
+                          const x86_insn*                                           insn,
+                          uintptr_t*                                                values )
+{
+    const unsigned char* op = code + insn->opcode;
+    const unsigned char* next = code + insn->length;
+    bool wide = ( insn->rex & 8 ) != 0;
+    unsigned reg = 0, rm = 0, mod = 0;
+    bool rip_relative = false;
+    int32_t imm;
+
+    if( insn->modrm != 0 )
+    {
+        unsigned char modrm = code[insn->modrm];
+        mod = modrm >> 6;
+        reg = ( ( modrm >> 3 ) & 7u ) | ( insn->rex & 4 ? 8u : 0u );
+        rm = ( modrm & 7u ) | ( insn->rex & 1 ? 8u : 0u );
+        rip_relative = mod == 0 && ( modrm & 7 ) == 5;
+    }
+
+    // VEX, EVEX and XOP encode their registers elsewhere.
+    if( op[0] == 0xc4 || op[0] == 0xc5 || op[0] == 0x62
+        || ( op[0] == 0x8f && insn->modrm != insn->opcode + 1 ) )
+    {
+        forget_registers( values, 0xffffu );
+        return;
+    }
+
+    if( op[0] == 0xe8
+        || ( op[0] == 0xff && insn->modrm != 0 && ( ( reg & 7 ) == 2 || ( reg & 7 ) == 3 ) ) )
+    {
+        forget_registers( values, CALLER_SAVED_REGISTERS );
+    }
+    else if( op[0] >= 0xb8 && op[0] <= 0xbf )
+    {
+        // mov $imm, %reg
+        uintptr_t value = 0;
+        size_t imm_size = insn->length - insn->opcode - 1;
+        if( imm_size == 4 || imm_size == 8 )
+        {
+            memcpy( &value, op + 1, imm_size );
+        }
+        values[( op[0] & 7u ) | ( insn->rex & 1 ? 8u : 0u )] = value;
+    }
+    else if( op[0] == 0xc7 && mod == 3 && ( reg & 7 ) == 0 )
+    {
+        // mov $imm32, %reg, sign extended with REX.W
+        imm = 0;
+        if( insn->length - insn->modrm == 5 )
+        {
+            memcpy( &imm, next - 4, sizeof( imm ) );
+        }
+        values[rm] = wide ? (uintptr_t) (intptr_t) imm : (uint32_t) imm;
+    }
+    else if( op[0] == 0x8d )
+    {
+        values[reg] = 0;
+        if( rip_relative && wide )
+        {
+            memcpy( &imm, code + insn->modrm + 1, sizeof( imm ) );
+            values[reg] = (uintptr_t) ( next + imm );
+        }
+    }
+    else if( op[0] == 0x8b && ( rip_relative || mod == 3 ) )
+    {
+        uintptr_t value = wide && mod == 3 ? values[rm] : 0;
+        if( rip_relative && wide )
+        {
+            memcpy( &imm, code + insn->modrm + 1, sizeof( imm ) );
+            value = (uintptr_t) ( next + imm );
+        }
+        values[reg] = value;
+    }
+    else if( op[0] == 0x89 )
+    {
+        if( mod == 3 )
+        {
+            values[rm] = wide ? values[reg] : 0;
+        }
+    }
+    else if( op[0] >= 0x58 && op[0] <= 0x5f )
+    {
+        // pop %reg
+        values[( op[0] & 7u ) | ( insn->rex & 1 ? 8u : 0u )] = 0;
+    }
+    else if( op[0] == 0x0f && op[1] >= 0xc8 && op[1] <= 0xcf )
+    {
+        // bswap %reg
+        values[( op[1] & 7u ) | ( insn->rex & 1 ? 8u : 0u )] = 0;
+    }
+    else if( op[0] == 0x90 && !( insn->rex & 1 ) )
+    {
+        // nop
+    }
+    else if( ( op[0] >= 0x90 && op[0] <= 0x97 ) || ( op[0] >= 0xa4 && op[0] <= 0xaf )
+             || ( op[0] >= 0xe0 && op[0] <= 0xe2 ) || op[0] == 0xc8 || op[0] == 0xc9
+             || ( op[0] == 0x0f && ( op[1] == 0x05 || op[1] == 0xa2 ) ) )
+    {
+        // Implicit destinations: xchg, string instructions, loop, enter, leave, syscall and cpuid.
+        forget_registers( values, 0xffffu );
+    }
+    else if( insn->modrm != 0 && !( op[0] == 0x0f && is_vector_opcode( op[1] ) ) )
+    {
+        // Any of the operands may be written, byte registers 4 to 7 are ah to bh without REX.
+        if( !is_group_opcode( op ) )
+        {
+            values[reg] = 0;
+            if( insn->rex == 0 && reg >= 4 )
+            {
+                values[reg - 4] = 0;
+            }
+        }
+        if( mod == 3 )
+        {
+            values[rm] = 0;
+            if( insn->rex == 0 && rm >= 4 )
+            {
+                values[rm - 4] = 0;
+            }
+        }
+        // rax and rdx are implicit destinations of many instructions (e.g. mul, div and cmpxchg).
+        values[0] = 0;
+        values[2] = 0;
+    }
+    else
+    {
+        // Without operands, rax and rdx may still be written (e.g. cqo, rdtsc or add $imm, %al).
+        values[0] = 0;
+        values[2] = 0;
+    }
+}
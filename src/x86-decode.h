@@ -0,0 +1,73 @@
+#ifndef X86_DECODE_H
+#define X86_DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Length decoder for x86-64 instructions.
+ *
+ * Call sites are only recognized by their bytes, which might as well be part of another
+ * instruction (e.g. the immediate of a mov). Decoding a function linearly from its first byte
+ * yields the instruction boundaries, so only real calls and jumps are taken as call sites. The
+ * decoder covers the legacy, VEX, EVEX and XOP encodings of 64-bit mode, as emitted by compilers.
+ */
+
+/**
+ * A decoded instruction.
+ */
+typedef struct x86_insn
+{
+    /** Length of the instruction */
+    size_t length;
+    /** Offset of the first opcode byte, i.e. the number of prefix bytes */
+    size_t opcode;
+    /** Offset of the ModRM byte, 0 if there's none */
+    size_t modrm;
+    /** The REX prefix, 0 if there's none */
+    unsigned char rex;
+} x86_insn;
+
+/**
+ * Decodes the length of the instruction at the given position.
+ *
+ * @param   code                            First byte of the instruction.
+ * @param   available                       Number of bytes that may be read.
+ * @param   insn                            Returns the decoded instruction.
+ *
+ * @return                                  Whether the instruction could be decoded. Fails for
+ *                                          invalid and unknown opcodes and for instructions
+ *                                          exceeding the available bytes.
+ */
+bool x86_decode( const unsigned char*                                               code,
+                 size_t                                                             available,
+                 x86_insn*                                                          insn );
+
+/** Number of general purpose registers */
+#define X86_REGISTER_CNT 16
+
+/** Number of rdi, the register of the first argument */
+#define X86_RDI 7
+
+/**
+ * Tracks the addresses held by the general purpose registers across a decoded instruction.
+ *
+ * An address is known after being loaded by "lea disp32(%rip), %reg" or "mov $imm, %reg". A
+ * "mov disp32(%rip), %reg" loads an address from a slot (e.g. of the GOT), the register is then
+ * known by the address of the slot, which identifies the loaded address just as well. Known
+ * addresses are copied by register to register moves. Every other write makes a register unknown,
+ * calls make the caller-saved registers unknown. Instructions whose destinations aren't known make
+ * all of their register operands unknown, so an address is never taken for a value it doesn't
+ * hold along the decoded order.
+ *
+ * @param   code                            First byte of the instruction.
+ * @param   insn                            The decoded instruction.
+ * @param   values                          The known addresses of the X86_REGISTER_CNT registers,
+ *                                          0 for unknown ones, updated in place.
+ */
+void x86_track_registers( const unsigned char*                                      code,
+                          const x86_insn*                                           insn,
+                          uintptr_t*                                                values );
+
+#endif /* X86_DECODE_H */